@@ -15,13 +15,35 @@ HEADERS += ./resource.h \
     ./about.h \
     ./audioplayer.h \
     ./qcheckboxex.h \
-    ./modinfo.h
+    ./modinfo.h \
+    ./similarity.h \
+    ./melody.h \
+    ./parallel.h \
+    ./search.h \
+    ./playlistexport.h \
+    ./ringbuffer.h \
+    ./previewcache.h \
+    ./playlistplayer.h \
+    ./batchrender.h \
+    ./analysis.h \
+    ./librarywatcher.h
 SOURCES += ./about.cpp \
     ./database.cpp \
     ./main.cpp \
     ./modinfo.cpp \
     ./modlibrary.cpp \
-    ./settings.cpp
+    ./settings.cpp \
+    ./similarity.cpp \
+    ./melody.cpp \
+    ./tablemodel.cpp \
+    ./search.cpp \
+    ./playlistexport.cpp \
+    ./audioplayer.cpp \
+    ./previewcache.cpp \
+    ./playlistplayer.cpp \
+    ./batchrender.cpp \
+    ./analysis.cpp \
+    ./librarywatcher.cpp
 FORMS += ./modlibrary.ui \
     ./modinfo.ui \
     ./about.ui \
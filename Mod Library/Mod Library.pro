@@ -13,8 +13,9 @@ INCLUDEPATH += ./GeneratedFiles \
     ./GeneratedFiles/Release \
     ./../lib \
     ./../lib/libopenmpt \
-    ./../lib/libopenmpt/include/portaudio/include
-LIBS += -lksuser
+    ./../lib/libopenmpt/include/portaudio/include \
+    ./../lib/sqlite
+LIBS += -lksuser -lsqlite3
 DEPENDPATH += .
 MOC_DIR += ./GeneratedFiles/release
 OBJECTS_DIR += release
@@ -0,0 +1,270 @@
+/*
+ * analysis.cpp
+ * ------------
+ * Purpose: Audio analysis of modules, rendering each module only once for all measurements.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "analysis.h"
+#include <libopenmpt/libopenmpt.hpp>
+#include <chromaprint/src/chromaprint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+// Number of frames rendered at once
+static constexpr size_t RENDER_BLOCK = 512;
+// Blocks of the silence map and waveform thumbnail per second
+static constexpr int32_t BLOCKS_PER_SECOND = 10;
+// Blocks whose peak stays below this level (about -60 dBFS) are considered to be silent
+static constexpr int SILENCE_THRESHOLD = 32;
+
+
+int64_t Analysis::Render(openmpt::module &mod, std::initializer_list<AnalysisConsumer *> consumers)
+{
+	for(auto consumer : consumers)
+	{
+		consumer->Start(SAMPLE_RATE);
+	}
+	int16_t data[RENDER_BLOCK];
+	int64_t numFrames = 0;
+	const int64_t maxFrames = int64_t(MAX_SECONDS) * SAMPLE_RATE;
+	while(numFrames < maxFrames)
+	{
+		const size_t count = mod.read(SAMPLE_RATE, RENDER_BLOCK, data);
+		if(!count)
+		{
+			break;
+		}
+		for(auto consumer : consumers)
+		{
+			consumer->Feed(data, count);
+		}
+		numFrames += count;
+	}
+	for(auto consumer : consumers)
+	{
+		consumer->Finish();
+	}
+	return numFrames;
+}
+
+
+FingerprintConsumer::FingerprintConsumer()
+	: context(chromaprint_new(CHROMAPRINT_ALGORITHM_DEFAULT))
+{
+}
+
+
+FingerprintConsumer::~FingerprintConsumer()
+{
+	chromaprint_dealloc(rawFingerprint);
+	chromaprint_free(context);
+}
+
+
+void FingerprintConsumer::Start(int32_t sampleRate)
+{
+	chromaprint_dealloc(rawFingerprint);
+	rawFingerprint = nullptr;
+	rawFingerprintSize = 0;
+	ok = chromaprint_start(context, sampleRate, 1) != 0;
+}
+
+
+void FingerprintConsumer::Feed(const int16_t *samples, size_t count)
+{
+	if(ok && !chromaprint_feed(context, samples, static_cast<int>(count)))
+	{
+		ok = false;
+	}
+}
+
+
+void FingerprintConsumer::Finish()
+{
+	chromaprint_finish(context);
+	if(!chromaprint_get_raw_fingerprint(context, &rawFingerprint, &rawFingerprintSize))
+	{
+		rawFingerprint = nullptr;
+		rawFingerprintSize = 0;
+	}
+}
+
+
+QByteArray FingerprintConsumer::EncodedFingerprint() const
+{
+	if(rawFingerprint == nullptr)
+	{
+		return QByteArray();
+	}
+	char *encodedFingerprint = nullptr;
+	int encodedFingerprintSize = 0;
+	chromaprint_encode_fingerprint(rawFingerprint, rawFingerprintSize, CHROMAPRINT_ALGORITHM_DEFAULT, &encodedFingerprint, &encodedFingerprintSize, 0);
+	const QByteArray result(encodedFingerprint, encodedFingerprintSize);
+	chromaprint_dealloc(encodedFingerprint);
+	return result;
+}
+
+
+void LevelMeter::Start(int32_t)
+{
+	sumOfSquares = 0.0;
+	numSamples = 0;
+	peak = 0;
+}
+
+
+void LevelMeter::Feed(const int16_t *samples, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+	{
+		const int sample = samples[i];
+		sumOfSquares += double(sample) * sample;
+		peak = std::max(peak, std::abs(sample));
+	}
+	numSamples += count;
+}
+
+
+double LevelMeter::Loudness() const
+{
+	if(!numSamples || sumOfSquares <= 0.0)
+	{
+		return -96.0;
+	}
+	return std::max(-96.0, 10.0 * std::log10(sumOfSquares / numSamples / (32768.0 * 32768.0)));
+}
+
+
+double LevelMeter::Peak() const
+{
+	if(!peak)
+	{
+		return -96.0;
+	}
+	return 20.0 * std::log10(peak / 32768.0);
+}
+
+
+SilenceMap::SilenceMap()
+{
+	// Enough for 20 minutes, so that most modules fit without growing the map
+	map.reserve(20 * 60 * BLOCKS_PER_SECOND / 8);
+}
+
+
+void SilenceMap::Start(int32_t sampleRate)
+{
+	map.resize(0);
+	blockSize = sampleRate / BLOCKS_PER_SECOND;
+	blockPos = 0;
+	numBlocks = 0;
+	silent = true;
+}
+
+
+void SilenceMap::Feed(const int16_t *samples, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+	{
+		if(std::abs(samples[i]) >= SILENCE_THRESHOLD)
+		{
+			silent = false;
+		}
+		if(++blockPos == blockSize)
+		{
+			EndBlock();
+		}
+	}
+}
+
+
+void SilenceMap::Finish()
+{
+	EndBlock();
+}
+
+
+void SilenceMap::EndBlock()
+{
+	if(!blockPos)
+	{
+		return;
+	}
+	if((numBlocks % 8) == 0)
+	{
+		map.append('\0');
+	}
+	if(silent)
+	{
+		map.back() = static_cast<char>(map.back() | (1 << (numBlocks % 8)));
+	}
+	numBlocks++;
+	blockPos = 0;
+	silent = true;
+}
+
+
+WaveformThumbnail::WaveformThumbnail()
+{
+	thumbnail.reserve(NUM_POINTS);
+}
+
+
+void WaveformThumbnail::Start(int32_t sampleRate)
+{
+	blockPeaks.clear();
+	blockSize = sampleRate / BLOCKS_PER_SECOND;
+	blockPos = 0;
+	thumbnail.resize(0);
+}
+
+
+void WaveformThumbnail::Feed(const int16_t *samples, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+	{
+		if(blockPos == 0)
+		{
+			blockPeaks.push_back(0);
+		}
+		blockPeaks.back() = static_cast<uint16_t>(std::max<int>(blockPeaks.back(), std::abs(samples[i])));
+		if(++blockPos == blockSize)
+		{
+			blockPos = 0;
+		}
+	}
+}
+
+
+void WaveformThumbnail::Finish()
+{
+	thumbnail.resize(0);
+	if(blockPeaks.empty())
+	{
+		return;
+	}
+	thumbnail.resize(NUM_POINTS);
+	const size_t numBlocks = blockPeaks.size();
+	for(int point = 0; point < NUM_POINTS; point++)
+	{
+		// Short modules repeat blocks, long modules combine them
+		const size_t first = point * numBlocks / NUM_POINTS;
+		const size_t last = std::max(first + 1, (point + 1) * numBlocks / NUM_POINTS);
+		const int peak = *std::max_element(blockPeaks.begin() + first, blockPeaks.begin() + last);
+		thumbnail[point] = static_cast<char>(std::min(peak, 32767) >> 7);
+	}
+}
+
+
+AnalysisContext::AnalysisContext()
+{
+	// Sizes that most modules fit into, bigger ones grow the buffers once
+	content.reserve(1024 * 1024);
+	notes.reserve(64 * 1024);
+	sampleText.reserve(4096);
+	instrumentText.reserve(4096);
+}
@@ -0,0 +1,163 @@
+/*
+ * analysis.h
+ * ----------
+ * Purpose: Audio analysis of modules, rendering each module only once for all measurements.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+namespace openmpt { class module; }
+struct ChromaprintContextPrivate;
+
+
+// Receives the audio of a module block by block while it is rendered for analysis
+class AnalysisConsumer
+{
+public:
+	virtual ~AnalysisConsumer() = default;
+
+	virtual void Start(int32_t sampleRate) { (void)sampleRate; }
+	// Mono audio
+	virtual void Feed(const int16_t *samples, size_t count) = 0;
+	virtual void Finish() { }
+};
+
+
+namespace Analysis
+{
+	// Sample rate used for all measurements
+	constexpr int32_t SAMPLE_RATE = 22050;
+	// Modules are not analyzed beyond this length, in case their end cannot be detected
+	constexpr int32_t MAX_SECONDS = 30 * 60;
+
+	// Render a module once from its current position to its end, passing the audio to all consumers.
+	// Returns the number of rendered frames at SAMPLE_RATE.
+	int64_t Render(openmpt::module &mod, std::initializer_list<AnalysisConsumer *> consumers);
+}
+
+
+// Chromaprint fingerprint of the audio
+class FingerprintConsumer : public AnalysisConsumer
+{
+protected:
+	ChromaprintContextPrivate *context;
+	bool ok = true;
+	uint32_t *rawFingerprint = nullptr;
+	int rawFingerprintSize = 0;
+
+public:
+	FingerprintConsumer();
+	~FingerprintConsumer();
+
+	void Start(int32_t sampleRate) override;
+	void Feed(const int16_t *samples, size_t count) override;
+	void Finish() override;
+
+	// Available after Finish()
+	const uint32_t *RawFingerprint() const { return rawFingerprint; }
+	int RawFingerprintSize() const { return rawFingerprintSize; }
+	QByteArray EncodedFingerprint() const;
+};
+
+
+// Overall loudness (RMS) and peak level, both in dBFS
+class LevelMeter : public AnalysisConsumer
+{
+protected:
+	double sumOfSquares = 0.0;
+	int64_t numSamples = 0;
+	int peak = 0;
+
+public:
+	void Start(int32_t sampleRate) override;
+	void Feed(const int16_t *samples, size_t count) override;
+
+	double Loudness() const;
+	double Peak() const;
+};
+
+
+// One bit per block of 100ms (least significant bit first), set if the block is silent
+class SilenceMap : public AnalysisConsumer
+{
+protected:
+	QByteArray map;
+	size_t blockSize = 0, blockPos = 0;
+	int64_t numBlocks = 0;
+	bool silent = true;
+
+public:
+	SilenceMap();
+
+	void Start(int32_t sampleRate) override;
+	void Feed(const int16_t *samples, size_t count) override;
+	void Finish() override;
+
+	const QByteArray &Map() const { return map; }
+
+protected:
+	void EndBlock();
+};
+
+
+// Peak level of the audio at a fixed number of points spread over the whole module, scaled to 0...255
+class WaveformThumbnail : public AnalysisConsumer
+{
+public:
+	static constexpr int NUM_POINTS = 256;
+
+protected:
+	std::vector<uint16_t> blockPeaks;	// Peaks of 100ms blocks, the length of the module is not known in advance
+	size_t blockSize = 0, blockPos = 0;
+	QByteArray thumbnail;
+
+public:
+	WaveformThumbnail();
+
+	void Start(int32_t sampleRate) override;
+	void Feed(const int16_t *samples, size_t count) override;
+	void Finish() override;
+
+	const QByteArray &Thumbnail() const { return thumbnail; }
+};
+
+
+// Everything that is needed for analyzing a module and can be reused for the next one, so that analyzing a module hardly allocates any memory.
+// Every thread that analyzes modules needs its own context.
+struct AnalysisContext
+{
+	// Notes of a pattern, offsets[c] to offsets[c + 1] being the notes of channel c
+	struct PatternNotes
+	{
+		std::vector<int8_t> notes;
+		std::vector<uint32_t> offsets;
+	};
+
+	QByteArray content;	// File contents
+	QByteArray notes;
+	std::vector<PatternNotes> patterns;
+	std::vector<uint8_t> cells;
+	std::vector<const PatternNotes *> orderPatterns;
+	QByteArray sampleText, instrumentText;	// UTF-8
+
+	// The Chromaprint context is only reset between modules
+	FingerprintConsumer fingerprint;
+	LevelMeter levels;
+	SilenceMap silence;
+	WaveformThumbnail waveform;
+
+	AnalysisContext();
+};
+
+
+// Bind a buffer to a query without sharing it, so that the buffer can be overwritten for the next module instead of being detached.
+// The query must be executed before the buffer is modified.
+inline QByteArray BufferView(const QByteArray &buffer) { return QByteArray::fromRawData(buffer.constData(), buffer.size()); }
@@ -0,0 +1,251 @@
+/*
+ * audioplayer.cpp
+ * ---------------
+ * Purpose: Implementation of the Mod Library audio player thread.
+ * Notes  : The PortAudio callback must not block, allocate memory or call into libopenmpt.
+ *          It only ever reads from the ring buffer and looks at atomic flags.
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "audioplayer.h"
+#include "previewcache.h"
+#include <QDebug>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+// Rendered audio that is kept ready for the callback, about 170ms
+static constexpr size_t BUFFER_FRAMES = 8192;
+// Number of frames rendered at once
+static constexpr size_t RENDER_BLOCK = 512;
+
+
+AudioThread::AudioThread(const QString &fileName, int volume, std::shared_ptr<const Preview> preview, QObject *parent)
+	: QObject(parent), fileName(fileName), initialVolume(volume), preview(std::move(preview)), previewPos(0), frames(BUFFER_FRAMES), commands(64), stream(nullptr), stopRequested(false), renderFinished(false)
+{
+	static_assert(sizeof(AudioFrame) == 2 * sizeof(float));
+	previewGain = std::pow(10.0f, VolumeToMillibel(volume) / 2000.0f);
+}
+
+
+void AudioThread::PrepareModule(openmpt::module &mod)
+{
+	mod.select_subsong(-1);	// Play all subsongs consecutively
+	mod.set_repeat_count(-1);
+}
+
+
+bool AudioThread::InitializeAudio()
+{
+	static const struct PortAudio
+	{
+		const PaError result;
+		PortAudio() : result(Pa_Initialize()) { }
+		~PortAudio()
+		{
+			if(result == paNoError)
+				Pa_Terminate();
+		}
+	} portAudio;
+	return portAudio.result == paNoError;
+}
+
+
+AudioThread::~AudioThread()
+{
+	Stop();
+	if(renderThread.joinable())
+	{
+		renderThread.join();
+	}
+}
+
+
+bool AudioThread::Start()
+{
+	if(stream != nullptr)
+	{
+		return true;
+	}
+	if(!InitializeAudio())
+	{
+		return false;
+	}
+	PaStreamParameters streamparameters;
+	std::memset(&streamparameters, 0, sizeof(PaStreamParameters));
+	streamparameters.device = Pa_GetDefaultOutputDevice();
+	if(streamparameters.device == paNoDevice)
+	{
+		return false;
+	}
+	streamparameters.channelCount = 2;
+	streamparameters.sampleFormat = paFloat32;
+	streamparameters.suggestedLatency = Pa_GetDeviceInfo(streamparameters.device)->defaultLowOutputLatency;
+	const PaError result = Pa_OpenStream(&stream, nullptr, &streamparameters, SAMPLE_RATE, paFramesPerBufferUnspecified, paNoFlag, &AudioThread::Callback, this);
+	if(result != paNoError)
+	{
+		qDebug() << Pa_GetErrorText(result);
+		stream = nullptr;
+		return false;
+	}
+
+	// The module is loaded by the render thread, the preview (if any) can be played in the meantime
+	Pa_StartStream(stream);
+	renderThread = std::thread(&AudioThread::Render, this);
+	return true;
+}
+
+
+void AudioThread::Stop()
+{
+	stopRequested = true;
+	commands.Push(Command{ Command::Stop, 0 });
+}
+
+
+void AudioThread::SetVolume(int volume)
+{
+	previewGain = std::pow(10.0f, VolumeToMillibel(volume) / 2000.0f);
+	commands.Push(Command{ Command::SetVolume, volume });
+}
+
+
+// Load the module and skip the part that is covered by the preview. Returns false if the module cannot be played.
+bool AudioThread::LoadModule()
+{
+	QFile file(fileName);
+	if(!file.open(QIODevice::ReadOnly))
+	{
+		return false;
+	}
+	const QByteArray content = file.readAll();
+	try
+	{
+		mod = std::make_unique<openmpt::module>(content.begin(), content.end());
+	} catch(openmpt::exception &e)
+	{
+		qDebug() << e.what();
+		return false;
+	}
+	PrepareModule(*mod);
+	mod->set_render_param(openmpt::module::RENDER_MASTERGAIN_MILLIBEL, VolumeToMillibel(initialVolume));
+
+	// Rendering is deterministic, so the module continues exactly where the preview ends
+	size_t skipFrames = preview ? preview->frames.size() : 0;
+	AudioFrame block[RENDER_BLOCK];
+	while(skipFrames > 0 && !stopRequested)
+	{
+		const size_t count = mod->read_interleaved_stereo(SAMPLE_RATE, std::min(RENDER_BLOCK, skipFrames), &block[0].left);
+		if(count == 0)
+		{
+			break;
+		}
+		skipFrames -= count;
+	}
+	return true;
+}
+
+
+// Render the next block of the module into the ring buffer. Returns false once the end of the module has been reached.
+bool AudioThread::RenderBlock()
+{
+	AudioFrame block[RENDER_BLOCK];
+	const size_t count = mod->read_interleaved_stereo(SAMPLE_RATE, RENDER_BLOCK, &block[0].left);
+	if(count == 0)
+	{
+		renderFinished = true;
+		return false;
+	}
+	frames.Write(block, count);
+	return true;
+}
+
+
+void AudioThread::Render()
+{
+	if(!LoadModule())
+	{
+		// Still play the preview until its end
+		renderFinished = true;
+	}
+
+	bool stop = false;
+	while(!stop)
+	{
+		Command command;
+		while(commands.Pop(command))
+		{
+			switch(command.type)
+			{
+			case Command::SetVolume:
+				if(mod)
+					mod->set_render_param(openmpt::module::RENDER_MASTERGAIN_MILLIBEL, VolumeToMillibel(command.value));
+				break;
+			case Command::Stop:
+				stop = true;
+				break;
+			}
+		}
+		if(stop || stopRequested)
+		{
+			// The command queue may have been full
+			stop = true;
+			break;
+		}
+
+		if(!renderFinished && frames.WriteAvailable() >= RENDER_BLOCK)
+		{
+			RenderBlock();
+			continue;
+		}
+		if(renderFinished && Pa_IsStreamActive(stream) != 1)
+		{
+			// Everything has been played
+			break;
+		}
+		// The ring buffer is full, wait for the callback to make some room
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+
+	stopRequested = true;
+	if(stop)
+		Pa_AbortStream(stream);
+	else
+		Pa_StopStream(stream);
+	Pa_CloseStream(stream);
+	emit finished();
+}
+
+
+int AudioThread::Callback(const void *, void *output, unsigned long frameCount, const PaStreamCallbackTimeInfo *, PaStreamCallbackFlags, void *userData)
+{
+	AudioThread &that = *static_cast<AudioThread *>(userData);
+	AudioFrame *out = static_cast<AudioFrame *>(output);
+	// Must be checked before reading, as the last frames may be added in the meantime
+	const bool renderFinished = that.renderFinished;
+	const bool stopRequested = that.stopRequested;
+	size_t count = 0;
+	if(!stopRequested)
+	{
+		if(that.preview && that.previewPos < that.preview->frames.size())
+		{
+			const AudioFrame *previewFrames = that.preview->frames.data() + that.previewPos;
+			const float gain = that.previewGain;
+			count = std::min(static_cast<size_t>(frameCount), that.preview->frames.size() - that.previewPos);
+			for(size_t i = 0; i < count; i++)
+			{
+				out[i] = AudioFrame{ previewFrames[i].left * gain, previewFrames[i].right * gain };
+			}
+			that.previewPos += count;
+		}
+		count += that.frames.Read(out + count, frameCount - count);
+	}
+	// Play silence if the renderer cannot keep up
+	std::fill(out + count, out + frameCount, AudioFrame{ 0.0f, 0.0f });
+	if(stopRequested || (renderFinished && count < frameCount))
+	{
+		return paComplete;
+	}
+	return paContinue;
+}
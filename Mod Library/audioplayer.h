@@ -9,70 +9,82 @@
 
 #pragma once
 
-#include <QThread>
+#include <QObject>
 #include <QFile>
 #include <libopenmpt/libopenmpt.hpp>
 #include <portaudio.h>
+#include "ringbuffer.h"
+#include <atomic>
+#include <memory>
+#include <thread>
 
+// One interleaved stereo sample frame, as passed to the sound device
+struct AudioFrame
+{
+	float left, right;
+};
+
+struct Preview;
+
+
+// Plays a module through a PortAudio callback. The module is rendered ahead of time on a separate thread into a lock-free ring buffer,
+// so the callback never has to wait for the renderer. Controls are passed to the render thread through a lock-free command queue.
+// If a preview of the module is available, it is played while the module is being loaded, and the renderer takes over where the preview ends.
 class AudioThread : public QObject
 {
 	Q_OBJECT
 
-protected:
-	QByteArray content;
-	openmpt::module mod;
-	int volume;
-public:
-	volatile bool kill;
-
 public:
-	AudioThread(QFile &file, int v) : content(file.readAll()), mod(content.begin(), content.end()), kill(false)
-	{
-		mod.select_subsong(-1);	// Play all subsongs consecutively
-		setVolume(v);
-	}
+	static constexpr int32_t SAMPLE_RATE = 48000;
 
-public slots:
-	void process()
+	struct Command
 	{
-		const std::size_t buffersize = 4800;
-		const std::int32_t samplerate = 48000;
-		std::vector<float> left(buffersize);
-		std::vector<float> right(buffersize);
-		mod.set_repeat_count(-1);
-		Pa_Initialize();
-		PaStream * stream = 0;
-		PaStreamParameters streamparameters;
-		std::memset(&streamparameters, 0, sizeof(PaStreamParameters));
-		streamparameters.device = Pa_GetDefaultOutputDevice();
-		streamparameters.channelCount = 2;
-		streamparameters.sampleFormat = paFloat32 | paNonInterleaved;
-		streamparameters.suggestedLatency = Pa_GetDeviceInfo(streamparameters.device)->defaultHighOutputLatency;
-		Pa_OpenStream(&stream, nullptr, &streamparameters, samplerate, paFramesPerBufferUnspecified, 0, nullptr, nullptr);
-		Pa_StartStream(stream);
-		while(!kill)
+		enum Type
 		{
-			std::size_t count = mod.read(samplerate, buffersize, left.data(), right.data());
-			if(count == 0)
-			{
-				break;
-			}
-			const float * const buffers [2] = { left.data(), right.data() };
-			Pa_WriteStream(stream, buffers, static_cast<unsigned long>(count));
-		}
-		Pa_StopStream(stream);
-		Pa_CloseStream(stream);
-		Pa_Terminate();
-		emit finished();
-	}
+			SetVolume,
+			Stop,
+		};
+		Type type;
+		int value;
+	};
 
-	void setVolume(int v)
-	{
-		volume = v;
-		mod.set_render_param(openmpt::module::RENDER_MASTERGAIN_MILLIBEL, (volume - 100) * 50);
-	}
+protected:
+	QString fileName;
+	int initialVolume;
+	std::unique_ptr<openmpt::module> mod;	// Only accessed by the render thread
+	std::shared_ptr<const Preview> preview;
+	size_t previewPos;	// Only accessed by the callback
+	std::atomic<float> previewGain;
+	RingBuffer<AudioFrame> frames;
+	RingBuffer<Command> commands;
+	std::thread renderThread;
+	PaStream *stream;
+	std::atomic<bool> stopRequested;	// Makes the callback output silence from now on
+	std::atomic<bool> renderFinished;	// All frames of the module are in the ring buffer
+
+public:
+	AudioThread(const QString &fileName, int volume, std::shared_ptr<const Preview> preview, QObject *parent = nullptr);
+	~AudioThread();
+
+	// Apply the playback settings to a module that is about to be rendered
+	static void PrepareModule(openmpt::module &mod);
+	// PortAudio is initialized once and stays initialized until the program exits. Returns false if initialization failed.
+	static bool InitializeAudio();
+	static int VolumeToMillibel(int volume) { return (volume - 100) * 50; }
+
+	// Open the sound device and start playing. Returns false if no sound device could be opened.
+	bool Start();
+	// Silence the output immediately and end playback. finished() is emitted once the sound device has been closed.
+	void Stop();
+	void SetVolume(int volume);
 
 signals:
+	// Emitted from the render thread
 	void finished();
 
+protected:
+	void Render();
+	bool LoadModule();
+	bool RenderBlock();
+	static int Callback(const void *input, void *output, unsigned long frameCount, const PaStreamCallbackTimeInfo *timeInfo, PaStreamCallbackFlags statusFlags, void *userData);
 };
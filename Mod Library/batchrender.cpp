@@ -0,0 +1,222 @@
+/*
+ * batchrender.cpp
+ * ---------------
+ * Purpose: Renders many modules to audio files at once.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "batchrender.h"
+#include <QDataStream>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QSettings>
+#include <QtEndian>
+#include <QDebug>
+#include <libopenmpt/libopenmpt.hpp>
+#include <mutex>
+
+// Number of frames rendered at once
+static constexpr size_t RENDER_BLOCK = 4096;
+// Rendered audio is collected in a buffer of this many frames (256 KiB) before it is written to disk
+static constexpr size_t WRITE_BUFFER_FRAMES = 64 * 1024;
+
+
+BatchRender::Settings BatchRender::Settings::Load()
+{
+	QSettings settings;
+	settings.beginGroup("Render");
+	Settings result;
+	result.sampleRate = std::clamp(settings.value("samplerate", result.sampleRate).toInt(), 8000, 192000);
+	result.interpolation = std::clamp(settings.value("interpolation", result.interpolation).toInt(), 1, 8);
+	result.subsongs = static_cast<SubsongMode>(std::clamp(settings.value("subsongs", result.subsongs).toInt(), int(FirstSubsong), int(SeparateSubsongs)));
+	settings.endGroup();
+	return result;
+}
+
+
+void BatchRender::Settings::Save() const
+{
+	QSettings settings;
+	settings.beginGroup("Render");
+	settings.setValue("samplerate", sampleRate);
+	settings.setValue("interpolation", interpolation);
+	settings.setValue("subsongs", static_cast<int>(subsongs));
+	settings.endGroup();
+}
+
+
+static bool WriteWAVHeader(QFile &file, int sampleRate, quint32 dataSize)
+{
+	QByteArray header;
+	QDataStream out(&header, QIODevice::WriteOnly);
+	out.setByteOrder(QDataStream::LittleEndian);
+	out.writeRawData("RIFF", 4);
+	out << quint32(36 + dataSize);
+	out.writeRawData("WAVEfmt ", 8);
+	out << quint32(16) << quint16(1) << quint16(2) << quint32(sampleRate) << quint32(sampleRate * 4) << quint16(4) << quint16(16);
+	out.writeRawData("data", 4);
+	out << dataSize;
+	return file.write(header) == header.size();
+}
+
+
+// Render the currently selected subsong of a module into a WAV file
+static bool RenderFile(openmpt::module &mod, const QString &fileName, int sampleRate, std::vector<int16_t> &buffer, std::atomic<qint64> &framesDone, std::atomic<qint64> &bytesDone)
+{
+	QFile file(fileName);
+	if(!file.open(QIODevice::WriteOnly) || !WriteWAVHeader(file, sampleRate, 0))
+	{
+		qDebug() << file.errorString();
+		return false;
+	}
+
+	// Prevent endless pattern loops
+	qint64 framesLeft = static_cast<qint64>(mod.get_duration_seconds() * sampleRate) + sampleRate;
+	// WAV files cannot be larger than 4 GiB
+	framesLeft = std::min(framesLeft, static_cast<qint64>((0xFFFFFFFFu - 36u) / 4u));
+	buffer.resize(WRITE_BUFFER_FRAMES * 2);
+	size_t bufferedFrames = 0;
+	quint32 dataSize = 0;
+	bool ok = true;
+	const auto flush = [&]()
+	{
+		const qint64 size = static_cast<qint64>(bufferedFrames * 4);
+		qToLittleEndian<qint16>(buffer.data(), static_cast<qsizetype>(bufferedFrames * 2), buffer.data());
+		if(file.write(reinterpret_cast<const char *>(buffer.data()), size) != size)
+		{
+			qDebug() << file.errorString();
+			ok = false;
+		}
+		dataSize += static_cast<quint32>(size);
+		bytesDone += size;
+		bufferedFrames = 0;
+	};
+
+	while(framesLeft > 0 && ok)
+	{
+		const size_t count = mod.read_interleaved_stereo(sampleRate, std::min({ RENDER_BLOCK, WRITE_BUFFER_FRAMES - bufferedFrames, static_cast<size_t>(framesLeft) }), buffer.data() + bufferedFrames * 2);
+		if(!count)
+		{
+			break;
+		}
+		bufferedFrames += count;
+		framesLeft -= count;
+		framesDone += count;
+		if(bufferedFrames == WRITE_BUFFER_FRAMES)
+		{
+			flush();
+		}
+	}
+	if(ok && bufferedFrames)
+	{
+		flush();
+	}
+	ok = ok && file.seek(0) && WriteWAVHeader(file, sampleRate, dataSize);
+	file.close();
+	if(!ok)
+	{
+		file.remove();
+	}
+	return ok;
+}
+
+
+bool BatchRender::Render(const QStringList &fileNames, const QString &outputDir, const Settings &settings, const ProgressCallback &progress, Stats &stats)
+{
+	QElapsedTimer timer;
+	timer.start();
+
+	// Output names are assigned up front, so that modules with the same name in different folders don't overwrite each other, nor any files that are already there
+	QStringList outputNames;
+	QSet<QString> usedNames;
+	const QDir dir(outputDir);
+	const auto isUsed = [&usedNames, &dir](const QString &name)
+	{
+		return usedNames.contains(name.toLower()) || QFileInfo::exists(dir.filePath(name + ".wav")) || QFileInfo::exists(dir.filePath(name + " (Subsong 1).wav"));
+	};
+	for(const auto &fileName : fileNames)
+	{
+		const QString baseName = QFileInfo(fileName).completeBaseName();
+		QString name = baseName;
+		for(int i = 2; isUsed(name); i++)
+		{
+			name = baseName + QString(" (%1)").arg(i);
+		}
+		usedNames.insert(name.toLower());
+		outputNames.push_back(dir.filePath(name));
+	}
+
+	std::atomic<qint64> framesDone(0), bytesDone(0);
+	std::atomic<int> filesWritten(0);
+	std::mutex failedMutex;
+	std::vector<std::vector<int16_t>> buffers(ParallelWorkers());
+
+	const auto reportProgress = [&](const QString &status, int done, int total)
+	{
+		const double elapsed = std::max(timer.elapsed(), qint64(1)) / 1000.0;
+		const qint64 seconds = framesDone / settings.sampleRate;
+		return progress(QObject::tr("%1\n%2 of %3 modules done, %4:%5:%6 of audio rendered (%7x real time, %8 MiB/s).")
+			.arg(status)
+			.arg(done)
+			.arg(total)
+			.arg(seconds / 3600)
+			.arg((seconds / 60) % 60, 2, 10, QChar('0'))
+			.arg(seconds % 60, 2, 10, QChar('0'))
+			.arg(framesDone / (settings.sampleRate * elapsed), 0, 'f', 1)
+			.arg(bytesDone / (1024.0 * 1024.0 * elapsed), 0, 'f', 1), done, total);
+	};
+
+	const bool completed = ParallelFor(fileNames.size(), QObject::tr("Rendering modules..."), reportProgress, [&](int i, int w)
+	{
+		bool ok = false;
+		QFile file(fileNames[i]);
+		if(file.open(QIODevice::ReadOnly))
+		{
+			const QByteArray content = file.readAll();
+			file.close();
+			try
+			{
+				openmpt::module mod(content.cbegin(), content.cend());
+				mod.set_repeat_count(0);
+				mod.set_render_param(openmpt::module::RENDER_INTERPOLATIONFILTER_LENGTH, settings.interpolation);
+				if(settings.subsongs == SeparateSubsongs && mod.get_num_subsongs() > 1)
+				{
+					ok = true;
+					for(int32_t subsong = 0; subsong < mod.get_num_subsongs() && ok; subsong++)
+					{
+						mod.select_subsong(subsong);
+						ok = RenderFile(mod, outputNames[i] + QString(" (Subsong %1).wav").arg(subsong + 1), settings.sampleRate, buffers[w], framesDone, bytesDone);
+						if(ok)
+							filesWritten++;
+					}
+				} else
+				{
+					mod.select_subsong(settings.subsongs == AllSubsongs ? -1 : 0);
+					ok = RenderFile(mod, outputNames[i] + ".wav", settings.sampleRate, buffers[w], framesDone, bytesDone);
+					if(ok)
+						filesWritten++;
+				}
+			} catch(openmpt::exception &e)
+			{
+				qDebug() << e.what();
+				ok = false;
+			}
+		}
+		if(!ok)
+		{
+			std::lock_guard<std::mutex> lock(failedMutex);
+			stats.failed.push_back(fileNames[i]);
+		}
+	});
+
+	stats.numFiles = filesWritten;
+	stats.numFrames = framesDone;
+	stats.numBytes = bytesDone;
+	stats.seconds = timer.elapsed() / 1000.0;
+	return completed;
+}
@@ -0,0 +1,48 @@
+/*
+ * batchrender.h
+ * -------------
+ * Purpose: Renders many modules to audio files at once.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QString>
+#include <QStringList>
+#include "parallel.h"
+
+namespace BatchRender
+{
+	enum SubsongMode
+	{
+		FirstSubsong = 0,	// Only render the first subsong
+		AllSubsongs,		// Render all subsongs one after another into the same file
+		SeparateSubsongs,	// Render each subsong into its own file
+	};
+
+	struct Settings
+	{
+		int sampleRate = 48000;
+		int interpolation = 8;	// Interpolation filter length as understood by libopenmpt (1 = none, 2 = linear, 4 = cubic, 8 = sinc)
+		SubsongMode subsongs = FirstSubsong;
+
+		// Settings last used, as stored in the configuration
+		static Settings Load();
+		void Save() const;
+	};
+
+	struct Stats
+	{
+		int numFiles = 0;		// Number of audio files written
+		QStringList failed;		// Modules that could not be rendered
+		qint64 numFrames = 0;	// Total length of the rendered audio
+		qint64 numBytes = 0;	// Total size of the written files
+		double seconds = 0.0;	// Time it took to render everything
+	};
+
+	// Render the given modules to 16-bit stereo WAV files in the output directory, using all available cores.
+	// Returns false if the job was cancelled.
+	bool Render(const QStringList &fileNames, const QString &outputDir, const Settings &settings, const ProgressCallback &progress, Stats &stats);
+}
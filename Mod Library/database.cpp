@@ -8,21 +8,133 @@
  */
 
 #include "database.h"
+#include "similarity.h"
+#include "melody.h"
+#include "analysis.h"
 #include <QStandardPaths>
 #include <QCryptographicHash>
 #include <QDebug>
 #include <QSettings>
+#include <QTimer>
 #include <libopenmpt/libopenmpt.hpp>
 #include <chromaprint/src/chromaprint.h>
 #include <chromaprint/src/utils/base64.h>
+#include <limits>
 
-#define SCHEMA_VERSION 1
+#define SCHEMA_VERSION 9
 #define VER_HELPER_STRINGIZE(x) #x
 #define VER_STRINGIZE(x)        VER_HELPER_STRINGIZE(x)
 #define SCHEMA_VERSION_STR VER_STRINGIZE(SCHEMA_VERSION)
 
 
+// Time during which changes are collected before they are announced
+static constexpr int CHANGE_BATCH_INTERVAL = 250;
+// Number of modules that a folder must contain to be suggested as a library folder
+static constexpr int MIN_SUGGESTED_FOLDER_SIZE = 5;
+// Time that a connection waits for another connection to finish writing, such as clustering the whole library
+static constexpr int BUSY_TIMEOUT = 60000;
+
+
+// True if the database was still locked by another connection after the busy timeout
+static bool IsBusy(const QSqlError &error)
+{
+	const QString code = error.nativeErrorCode();
+	return code == "5" || code == "6";	// SQLITE_BUSY, SQLITE_LOCKED
+}
+
+
+ChangeNotifier::ChangeNotifier()
+	: flushScheduled(false)
+{
+	// Announcements are always made from the main thread, no matter which thread reported the first change
+	if(QCoreApplication::instance())
+	{
+		moveToThread(QCoreApplication::instance()->thread());
+	}
+}
+
+
+ChangeNotifier &ChangeNotifier::Instance()
+{
+	static ChangeNotifier notifier;
+	return notifier;
+}
+
+
+void ChangeNotifier::Inserted(qint64 id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(removed.removeOne(id))
+	{
+		// SQLite may hand out the ID of a removed module again
+		if(!updated.contains(id))
+			updated.push_back(id);
+	} else if(!inserted.contains(id))
+	{
+		inserted.push_back(id);
+	}
+	ScheduleFlush();
+}
+
+
+void ChangeNotifier::Updated(qint64 id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(!inserted.contains(id) && !updated.contains(id))
+	{
+		updated.push_back(id);
+	}
+	ScheduleFlush();
+}
+
+
+void ChangeNotifier::Removed(qint64 id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	inserted.removeOne(id);
+	updated.removeOne(id);
+	if(!removed.contains(id))
+	{
+		removed.push_back(id);
+	}
+	ScheduleFlush();
+}
+
+
+// Must be called with the mutex held
+void ChangeNotifier::ScheduleFlush()
+{
+	if(flushScheduled)
+	{
+		return;
+	}
+	flushScheduled = true;
+	QMetaObject::invokeMethod(this, [this]()
+	{
+		QTimer::singleShot(CHANGE_BATCH_INTERVAL, this, &ChangeNotifier::Flush);
+	}, Qt::QueuedConnection);
+}
+
+
+void ChangeNotifier::Flush()
+{
+	QVector<qint64> insertedIds, updatedIds, removedIds;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		insertedIds.swap(inserted);
+		updatedIds.swap(updated);
+		removedIds.swap(removed);
+		flushScheduled = false;
+	}
+	if(!insertedIds.isEmpty() || !updatedIds.isEmpty() || !removedIds.isEmpty())
+	{
+		emit modulesChanged(insertedIds, updatedIds, removedIds);
+	}
+}
+
+
 ModDatabase ModDatabase::instance;
+std::atomic<quint64> ModDatabase::writeGeneration{0};
 
 void ModDatabase::Open()
 {
@@ -34,12 +146,19 @@ void ModDatabase::Open()
 	QFile::remove(dbBackup);
 	QFile::copy(dbFile, dbBackup);
 	db.setDatabaseName(dbFile);
+	// Also applies to the connections cloned from this one
+	db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=" + QString::number(BUSY_TIMEOUT));
 
 	if(!db.open())
 	{
 		throw Exception("Cannot option database: ", db.lastError());
 	}
 	QSqlQuery query(db);
+	// Allow searching on other connections while the library is being updated
+	if(!query.exec("PRAGMA journal_mode = WAL"))
+	{
+		qDebug() << query.lastError();
+	}
 	if(!query.exec("CREATE TABLE IF NOT EXISTS `modlib_schema` (`name` TEXT PRIMARY KEY, `value` TEXT)"))
 	{
 		throw Exception("Cannot create schema table: ", query.lastError());
@@ -55,7 +174,7 @@ void ModDatabase::Open()
 		schemaVersion = query.value(0).toInt();
 	}
 
-	if(schemaVersion == 0)
+	if(schemaVersion < 1)
 	{
 		if(!query.exec(R"(
 			CREATE TABLE IF NOT EXISTS `modlib_modules` (
@@ -86,13 +205,211 @@ void ModDatabase::Open()
 		{
 			throw Exception("Cannot update library schema: ", query.lastError());
 		}
+	}
+
+	if(schemaVersion < 2)
+	{
+		// Version 2: Modules get an explicit integer primary key, so that their IDs remain stable when the database is vacuumed
+		// and can be referenced from other tables, such as the fingerprint index and the duplicate clusters.
+		db.transaction();
+		if(!query.exec(R"(
+			CREATE TABLE `modlib_modules_new` (
+			`id` INTEGER PRIMARY KEY,
+			`hash` TEXT,
+			`filename` TEXT UNIQUE,
+			`filesize` INT,
+			`filedate` INT,
+			`editdate` INT,
+			`format` TEXT,
+			`title` TEXT,
+			`length` INT,
+			`num_channels` INT,
+			`num_patterns` INT,
+			`num_orders` INT,
+			`num_subsongs` INT,
+			`num_samples` INT,
+			`num_instruments` INT,
+			`sample_text` TEXT,
+			`instrument_text` TEXT,
+			`comments` TEXT,
+			`artist` TEXT,
+			`personal_comments` TEXT,
+			`fingerprint` BLOB COLLATE BINARY,
+			`note_data` BLOB COLLATE BINARY,
+			`pattern_hash` INT
+			)
+			)")
+			|| !query.exec(R"(
+			INSERT INTO `modlib_modules_new` (
+			`hash`, `filename`, `filesize`, `filedate`, `editdate`, `format`, `title`, `length`, `num_channels`, `num_patterns`, `num_orders`, `num_subsongs`, `num_samples`, `num_instruments`, `sample_text`, `instrument_text`, `comments`, `artist`, `personal_comments`, `fingerprint`, `note_data`, `pattern_hash`)
+			SELECT
+			`hash`, `filename`, `filesize`, `filedate`, `editdate`, `format`, `title`, `length`, `num_channels`, `num_patterns`, `num_orders`, `num_subsongs`, `num_samples`, `num_instruments`, `sample_text`, `instrument_text`, `comments`, `artist`, `personal_comments`, `fingerprint`, `note_data`, `pattern_hash`
+			FROM `modlib_modules`
+			)")
+			|| !query.exec("DROP TABLE `modlib_modules`")
+			|| !query.exec("ALTER TABLE `modlib_modules_new` RENAME TO `modlib_modules`"))
+		{
+			db.rollback();
+			throw Exception("Cannot update library schema: ", query.lastError());
+		}
+
+		if(!query.exec("CREATE TABLE IF NOT EXISTS `modlib_fp_index` (`key` INT, `module_id` INT)")
+			|| !query.exec("CREATE TABLE IF NOT EXISTS `modlib_clusters` (`module_id` INTEGER PRIMARY KEY, `cluster_id` INT)"))
+		{
+			db.rollback();
+			throw Exception("Cannot create duplicate tables: ", query.lastError());
+		}
+		db.commit();
+	}
+
+	if(schemaVersion < 3)
+	{
+		// Version 3: N-gram index of the note data for melody search
+		db.transaction();
+		if(!query.exec("CREATE TABLE IF NOT EXISTS `modlib_note_ngrams` (`gram` INT, `module_id` INT, PRIMARY KEY (`gram`, `module_id`)) WITHOUT ROWID"))
+		{
+			db.rollback();
+			throw Exception("Cannot create melody index: ", query.lastError());
+		}
+		QSqlQuery notesQuery(db), ngramQuery(db);
+		notesQuery.setForwardOnly(true);
+		if(!notesQuery.exec("SELECT `id`, `note_data` FROM `modlib_modules`")
+			|| !ngramQuery.prepare("INSERT OR IGNORE INTO `modlib_note_ngrams` (`gram`, `module_id`) VALUES (?, ?)"))
+		{
+			db.rollback();
+			throw Exception("Cannot create melody index: ", db.lastError());
+		}
+		while(notesQuery.next())
+		{
+			Melody::UpdateIndex(ngramQuery, notesQuery.value(0).toLongLong(), notesQuery.value(1).toByteArray());
+		}
+		db.commit();
+	}
+
+	if(schemaVersion < 4)
+	{
+		// Version 4: MinHash signatures of the note data and their LSH buckets for near-duplicate detection
+		db.transaction();
+		if(!query.exec("ALTER TABLE `modlib_modules` ADD COLUMN `note_minhash` BLOB")
+			|| !query.exec("CREATE TABLE IF NOT EXISTS `modlib_note_lsh` (`band` INT, `bucket` INT, `module_id` INT, PRIMARY KEY (`band`, `bucket`, `module_id`)) WITHOUT ROWID"))
+		{
+			db.rollback();
+			throw Exception("Cannot create near-duplicate index: ", query.lastError());
+		}
+		QSqlQuery notesQuery(db), minhashQuery(db), lshQuery(db);
+		notesQuery.setForwardOnly(true);
+		if(!notesQuery.exec("SELECT `id`, `note_data` FROM `modlib_modules`")
+			|| !minhashQuery.prepare("UPDATE `modlib_modules` SET `note_minhash` = :note_minhash WHERE `id` = :id")
+			|| !lshQuery.prepare("INSERT OR IGNORE INTO `modlib_note_lsh` (`band`, `bucket`, `module_id`) VALUES (?, ?, ?)"))
+		{
+			db.rollback();
+			throw Exception("Cannot create near-duplicate index: ", db.lastError());
+		}
+		while(notesQuery.next())
+		{
+			const qint64 id = notesQuery.value(0).toLongLong();
+			const QByteArray signature = Melody::MinHash(notesQuery.value(1).toByteArray());
+			if(signature.isEmpty())
+				continue;
+			minhashQuery.bindValue(":note_minhash", signature);
+			minhashQuery.bindValue(":id", id);
+			minhashQuery.exec();
+			Melody::UpdateLSH(lshQuery, id, signature);
+		}
+		db.commit();
+	}
+
+	if(schemaVersion < 5)
+	{
+		// Version 5: Precomputed sort keys, so that results can be sorted by title in the database
+		db.transaction();
+		if(!query.exec("ALTER TABLE `modlib_modules` ADD COLUMN `title_sortkey` BLOB"))
+		{
+			db.rollback();
+			throw Exception("Cannot update library schema: ", query.lastError());
+		}
+		QSqlQuery titleQuery(db), sortKeyQuery(db);
+		titleQuery.setForwardOnly(true);
+		if(!titleQuery.exec("SELECT `id`, `title`, `filename` FROM `modlib_modules`")
+			|| !sortKeyQuery.prepare("UPDATE `modlib_modules` SET `title_sortkey` = :title_sortkey WHERE `id` = :id"))
+		{
+			db.rollback();
+			throw Exception("Cannot update library schema: ", db.lastError());
+		}
+		while(titleQuery.next())
+		{
+			sortKeyQuery.bindValue(":title_sortkey", TitleSortKey(titleQuery.value(1).toString(), titleQuery.value(2).toString()));
+			sortKeyQuery.bindValue(":id", titleQuery.value(0));
+			sortKeyQuery.exec();
+		}
+		db.commit();
+	}
+
+	if(schemaVersion < 6)
+	{
+		// Version 6: Number of modules per format, channel count, release year and artist, maintained whenever a module is added, updated or removed
+		db.transaction();
+		if(!query.exec("CREATE TABLE IF NOT EXISTS `modlib_facets` (`facet` INT, `value` TEXT, `count` INT, PRIMARY KEY (`facet`, `value`)) WITHOUT ROWID")
+			|| !query.exec("INSERT INTO `modlib_facets` (`facet`, `value`, `count`) SELECT " + QString::number(FacetFormat) + ", `format`, COUNT(*) FROM `modlib_modules` WHERE `format` <> '' GROUP BY `format`")
+			|| !query.exec("INSERT INTO `modlib_facets` (`facet`, `value`, `count`) SELECT " + QString::number(FacetChannels) + ", CAST(`num_channels` AS TEXT), COUNT(*) FROM `modlib_modules` WHERE `num_channels` > 0 GROUP BY `num_channels`")
+			|| !query.exec("INSERT INTO `modlib_facets` (`facet`, `value`, `count`) SELECT " + QString::number(FacetYear) + ", CAST(CAST(strftime('%Y', `editdate`, 'unixepoch') AS INT) AS TEXT) AS `year`, COUNT(*) FROM `modlib_modules` WHERE `editdate` > 0 AND `editdate` < 4294967295 GROUP BY `year`")
+			|| !query.exec("INSERT INTO `modlib_facets` (`facet`, `value`, `count`) SELECT " + QString::number(FacetArtist) + ", `artist`, COUNT(*) FROM `modlib_modules` WHERE `artist` <> '' GROUP BY `artist`"))
+		{
+			db.rollback();
+			throw Exception("Cannot create facet table: ", query.lastError());
+		}
+		db.commit();
+	}
+
+	if(schemaVersion < 7)
+	{
+		// Version 7: Audio measurements taken while rendering the fingerprint. Existing modules get them when they are updated.
+		db.transaction();
+		if(!query.exec("ALTER TABLE `modlib_modules` ADD COLUMN `loudness` REAL")
+			|| !query.exec("ALTER TABLE `modlib_modules` ADD COLUMN `peak` REAL")
+			|| !query.exec("ALTER TABLE `modlib_modules` ADD COLUMN `silence_map` BLOB")
+			|| !query.exec("ALTER TABLE `modlib_modules` ADD COLUMN `waveform` BLOB"))
+		{
+			db.rollback();
+			throw Exception("Cannot update library schema: ", query.lastError());
+		}
+		db.commit();
+	}
+
+	if(schemaVersion < 8)
+	{
+		// Version 8: Artist as found in the module, as the artist column can be edited by the user. Existing modules get it when they are updated.
+		if(!query.exec("ALTER TABLE `modlib_modules` ADD COLUMN `module_artist` TEXT"))
+		{
+			throw Exception("Cannot update library schema: ", query.lastError());
+		}
+	}
 
-		if(!query.exec("CREATE INDEX IF NOT EXISTS `modlib_title` ON `modlib_modules` (`title`)")
-			|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_filename` ON `modlib_modules` (`filename`)"))
+	if(schemaVersion < 9)
+	{
+		// Version 9: Files in the library folders that are not modules, so that they are not analyzed whenever their folder is checked
+		if(!query.exec("CREATE TABLE IF NOT EXISTS `modlib_rejected` (`filename` TEXT PRIMARY KEY, `filesize` INT, `filedate` INT)"))
 		{
-			throw Exception("Cannot create library indices: ", query.lastError());
+			throw Exception("Cannot update library schema: ", query.lastError());
 		}
+	}
 
+	if(!query.exec("CREATE INDEX IF NOT EXISTS `modlib_title` ON `modlib_modules` (`title`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_filename` ON `modlib_modules` (`filename`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_fp_key` ON `modlib_fp_index` (`key`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_fp_module` ON `modlib_fp_index` (`module_id`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_cluster` ON `modlib_clusters` (`cluster_id`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_note_lsh_module` ON `modlib_note_lsh` (`module_id`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_title_sortkey` ON `modlib_modules` (`title_sortkey`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_filesize` ON `modlib_modules` (`filesize`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_filedate` ON `modlib_modules` (`filedate`)")
+		|| !query.exec("CREATE INDEX IF NOT EXISTS `modlib_hash` ON `modlib_modules` (`hash`)"))
+	{
+		throw Exception("Cannot create library indices: ", query.lastError());
+	}
+
+	if(schemaVersion < SCHEMA_VERSION)
+	{
 		if(!query.exec("INSERT OR IGNORE INTO `modlib_schema` (`name`, `value`) VALUES ('schema_version', '" SCHEMA_VERSION_STR "')")
 			|| !query.exec("UPDATE `modlib_schema` SET `value` = '" SCHEMA_VERSION_STR "' WHERE `name` = 'schema_version'"))
 		{
@@ -100,11 +417,29 @@ void ModDatabase::Open()
 		}
 	}
 
+	PrepareQueries();
+}
+
+
+// Open another connection for a thread that adds, updates or removes modules. The main connection must be open already.
+void ModDatabase::OpenConnection(const QString &connectionName)
+{
+	db = QSqlDatabase::cloneDatabase(instance.db.connectionName(), connectionName);
+	if(!db.open())
+	{
+		throw Exception("Cannot open database: ", db.lastError());
+	}
+	PrepareQueries();
+}
+
+
+void ModDatabase::PrepareQueries()
+{
 	insertQuery = QSqlQuery(db);
 	if(!insertQuery.prepare(R"(
 		INSERT INTO `modlib_modules` (
-		`hash`, `filename`, `filesize`, `filedate`, `editdate`, `format`, `title`, `length`, `num_channels`, `num_patterns`, `num_orders`, `num_subsongs`, `num_samples`, `num_instruments`, `sample_text`, `instrument_text`, `comments`, `artist`, `fingerprint`, `note_data`, `pattern_hash`)
-		 VALUES (:hash, :filename, :filesize, :filedate, :editdate, :format, :title, :length, :num_channels, :num_patterns, :num_orders, :num_subsongs, :num_samples, :num_instruments, :sample_text, :instrument_text, :comments, :artist, :fingerprint, :note_data, :pattern_hash)
+		`hash`, `filename`, `filesize`, `filedate`, `editdate`, `format`, `title`, `length`, `num_channels`, `num_patterns`, `num_orders`, `num_subsongs`, `num_samples`, `num_instruments`, `sample_text`, `instrument_text`, `comments`, `artist`, `fingerprint`, `note_data`, `pattern_hash`, `note_minhash`, `title_sortkey`, `loudness`, `peak`, `silence_map`, `waveform`, `module_artist`)
+		 VALUES (:hash, :filename, :filesize, :filedate, :editdate, :format, :title, :length, :num_channels, :num_patterns, :num_orders, :num_subsongs, :num_samples, :num_instruments, :sample_text, :instrument_text, :comments, :artist, :fingerprint, :note_data, :pattern_hash, :note_minhash, :title_sortkey, :loudness, :peak, :silence_map, :waveform, :module_artist)
 		)"))
 	{
 		throw Exception("Cannot prepare insert query: ", insertQuery.lastError());
@@ -115,7 +450,8 @@ void ModDatabase::Open()
 		UPDATE `modlib_modules` SET
 		`hash` = :hash, `filename` = :filename, `filesize` = :filesize, `filedate` = :filedate, `editdate` = :editdate, `format` = :format, `title` = :title, `length` = :length,
 		`num_channels` = :num_channels, `num_patterns` = :num_patterns, `num_orders` = :num_orders, `num_subsongs` = :num_subsongs, `num_samples` = :num_samples,
-		`num_instruments` = :num_instruments, `sample_text` = :sample_text, `instrument_text` = :instrument_text, `comments` = :comments, `artist` = :artist, `fingerprint` = :fingerprint, `note_data` = :note_data, `pattern_hash` = :pattern_hash
+		`num_instruments` = :num_instruments, `sample_text` = :sample_text, `instrument_text` = :instrument_text, `comments` = :comments, `artist` = :artist, `fingerprint` = :fingerprint, `note_data` = :note_data, `pattern_hash` = :pattern_hash, `note_minhash` = :note_minhash, `title_sortkey` = :title_sortkey,
+		`loudness` = :loudness, `peak` = :peak, `silence_map` = :silence_map, `waveform` = :waveform, `module_artist` = :module_artist
 		WHERE `filename` = :filename_old
 		)"))
 	{
@@ -133,12 +469,36 @@ void ModDatabase::Open()
 		throw Exception("Cannot prepare update comments query: ", updateCustomQuery.lastError());
 	}
 
+	moveQuery = QSqlQuery(db);
+	if(!moveQuery.prepare(R"(
+		UPDATE `modlib_modules` SET
+		`filename` = :filename,
+		`filedate` = :filedate,
+		`title_sortkey` = :title_sortkey
+		WHERE `filename` = :filename_old
+		)"))
+	{
+		throw Exception("Cannot prepare move query: ", moveQuery.lastError());
+	}
+
+	fileInfoQuery = QSqlQuery(db);
+	if(!fileInfoQuery.prepare("UPDATE `modlib_modules` SET `filesize` = :filesize, `filedate` = :filedate WHERE `id` = :id"))
+	{
+		throw Exception("Cannot prepare file info query: ", fileInfoQuery.lastError());
+	}
+
 	selectQuery = QSqlQuery(db);
 	if(!selectQuery.prepare("SELECT * FROM `modlib_modules` WHERE `filename` = :filename"))
 	{
 		throw Exception("Cannot prepare select query: ", selectQuery.lastError());
 	}
 
+	hashQuery = QSqlQuery(db);
+	if(!hashQuery.prepare("SELECT * FROM `modlib_modules` WHERE `hash` = :hash LIMIT 1"))
+	{
+		throw Exception("Cannot prepare hash query: ", hashQuery.lastError());
+	}
+
 	fpQuery = QSqlQuery(db);
 	if(!fpQuery.prepare("SELECT `fingerprint` FROM `modlib_modules` WHERE `filename` = :filename"))
 	{
@@ -150,23 +510,85 @@ void ModDatabase::Open()
 	{
 		throw Exception("Cannot prepare delete query: ", selectQuery.lastError());
 	}
+
+	idQuery = QSqlQuery(db);
+	if(!idQuery.prepare("SELECT `id`, `note_data`, `format`, `num_channels`, `editdate`, `artist` FROM `modlib_modules` WHERE `filename` = :filename"))
+	{
+		throw Exception("Cannot prepare ID query: ", idQuery.lastError());
+	}
+
+	fpByIdQuery = QSqlQuery(db);
+	if(!fpByIdQuery.prepare("SELECT `fingerprint`, (SELECT COUNT(*) FROM `modlib_fp_index` WHERE `module_id` = :id2) FROM `modlib_modules` WHERE `id` = :id"))
+	{
+		throw Exception("Cannot prepare fingerprint query: ", fpByIdQuery.lastError());
+	}
+
+	ngramInsertQuery = QSqlQuery(db);
+	ngramRemoveQuery = QSqlQuery(db);
+	if(!ngramInsertQuery.prepare("INSERT OR IGNORE INTO `modlib_note_ngrams` (`gram`, `module_id`) VALUES (?, ?)")
+		|| !ngramRemoveQuery.prepare("DELETE FROM `modlib_note_ngrams` WHERE `gram` = ? AND `module_id` = ?"))
+	{
+		throw Exception("Cannot prepare melody index queries: ", db.lastError());
+	}
+
+	lshInsertQuery = QSqlQuery(db);
+	lshRemoveQuery = QSqlQuery(db);
+	if(!lshInsertQuery.prepare("INSERT OR IGNORE INTO `modlib_note_lsh` (`band`, `bucket`, `module_id`) VALUES (?, ?, ?)")
+		|| !lshRemoveQuery.prepare("DELETE FROM `modlib_note_lsh` WHERE `module_id` = :id"))
+	{
+		throw Exception("Cannot prepare near-duplicate index queries: ", db.lastError());
+	}
+
+	fpIndexInsertQuery = QSqlQuery(db);
+	fpIndexRemoveQuery = QSqlQuery(db);
+	clusterRemoveQuery = QSqlQuery(db);
+	clusterLeaveQuery = QSqlQuery(db);
+	clusterInsertQuery = QSqlQuery(db);
+	if(!fpIndexInsertQuery.prepare("INSERT INTO `modlib_fp_index` (`key`, `module_id`) VALUES (?, ?)")
+		|| !fpIndexRemoveQuery.prepare("DELETE FROM `modlib_fp_index` WHERE `module_id` = :id")
+		|| !clusterRemoveQuery.prepare(R"(
+			DELETE FROM `modlib_clusters` WHERE `cluster_id` IN
+			(SELECT `cluster_id` FROM `modlib_clusters` WHERE `module_id` = :id)
+			AND (SELECT COUNT(*) FROM `modlib_clusters` AS `c` WHERE `c`.`cluster_id` = `modlib_clusters`.`cluster_id` AND `c`.`module_id` <> :id2) < 2
+			)")
+		|| !clusterLeaveQuery.prepare("DELETE FROM `modlib_clusters` WHERE `module_id` = :id")
+		|| !clusterInsertQuery.prepare("INSERT OR REPLACE INTO `modlib_clusters` (`module_id`, `cluster_id`) VALUES (:id, :cluster_id)"))
+	{
+		throw Exception("Cannot prepare duplicate queries: ", db.lastError());
+	}
+
+	facetInsertQuery = QSqlQuery(db);
+	facetCountQuery = QSqlQuery(db);
+	facetCleanupQuery = QSqlQuery(db);
+	if(!facetInsertQuery.prepare("INSERT OR IGNORE INTO `modlib_facets` (`facet`, `value`, `count`) VALUES (?, ?, 0)")
+		|| !facetCountQuery.prepare("UPDATE `modlib_facets` SET `count` = `count` + ? WHERE `facet` = ? AND `value` = ?")
+		|| !facetCleanupQuery.prepare("DELETE FROM `modlib_facets` WHERE `facet` = ? AND `value` = ? AND `count` <= 0"))
+	{
+		throw Exception("Cannot prepare facet queries: ", db.lastError());
+	}
 }
 
 
 ModDatabase::~ModDatabase()
 {
-	QSqlQuery query(db);
-	query.exec("VACUUM `modlib_modules`");
+	if(this == &instance)
+	{
+		QSqlQuery query(db);
+		query.exec("VACUUM `modlib_modules`");
+	}
 	db.close();
 }
 
 
 ModDatabase::AddResult ModDatabase::AddModule(const QString &path)
 {
-	AddResult result = PrepareQuery(path, insertQuery);
-	if(result != NotAdded)
-		return result;
-	return UpdateModule(path);
+	// Only files that are in the library already are updated, so that files which are not modules are not parsed twice
+	selectQuery.bindValue(":filename", QDir::fromNativeSeparators(path));
+	const bool exists = selectQuery.exec() && selectQuery.next();
+	selectQuery.finish();
+	if(exists)
+		return UpdateModule(path);
+	return PrepareQuery(path, insertQuery);
 }
 
 
@@ -180,16 +602,44 @@ ModDatabase::AddResult ModDatabase::UpdateModule(const QString &path)
 
 bool ModDatabase::UpdateCustom(const QString &path, const QString &artist, const QString &comments)
 {
+	db.transaction();
+	QStringList oldFacets;
+	qint64 id = -1;
+	selectQuery.bindValue(":filename", path);
+	if(selectQuery.exec() && selectQuery.next())
+	{
+		oldFacets = FacetValues(selectQuery);
+		id = selectQuery.value("id").toLongLong();
+	}
+	selectQuery.finish();
 	updateCustomQuery.bindValue(":filename", path);
 	updateCustomQuery.bindValue(":artist", artist);
 	updateCustomQuery.bindValue(":personal_comments", comments);
-	return updateCustomQuery.exec();
+	if(!updateCustomQuery.exec())
+	{
+		db.rollback();
+		return false;
+	}
+	if(!oldFacets.isEmpty() && oldFacets[FacetArtist] != artist)
+	{
+		CountFacets(QStringList{ QString(), QString(), QString(), oldFacets[FacetArtist] }, -1);
+		CountFacets(QStringList{ QString(), QString(), QString(), artist }, 1);
+	}
+	db.commit();
+	writeGeneration++;
+	if(id >= 0)
+	{
+		ChangeNotifier::Instance().Updated(id);
+	}
+	return true;
 }
 
 
 // Extract the notes from some module's patterns, as a byte sequence of note deltas.
-static int64_t BuildNoteString(openmpt::module &mod, QByteArray &notes)
+static int64_t BuildNoteString(openmpt::module &mod, AnalysisContext &context)
 {
+	QByteArray &notes = context.notes;
+	notes.resize(0);
 	const int32_t numChannels = mod.get_num_channels();
 	const int32_t numSongs = mod.get_num_subsongs();
 
@@ -198,7 +648,59 @@ static int64_t BuildNoteString(openmpt::module &mod, QByteArray &notes)
 	uint64_t hash = FNV1a_BASIS;
 
 #if 1
+	// Patterns are often referenced by many orders, so decode each of them only once.
+	// The valid notes of a pattern are stored channel by channel.
+	using PatternNotes = AnalysisContext::PatternNotes;
+	const int32_t numPatterns = std::max(mod.get_num_patterns(), 0);
+	if(context.patterns.size() < static_cast<size_t>(numPatterns))
+	{
+		context.patterns.resize(numPatterns);
+	}
+	for(int32_t p = 0; p < numPatterns; p++)
+	{
+		context.patterns[p].notes.clear();
+		context.patterns[p].offsets.clear();
+	}
+	std::vector<uint8_t> &cells = context.cells;
+	const auto getPattern = [&](int32_t p) -> const PatternNotes *
+	{
+		if(p < 0 || p >= numPatterns)
+		{
+			return nullptr;
+		}
+		PatternNotes &pattern = context.patterns[p];
+		if(pattern.offsets.empty())
+		{
+			// Read the pattern in row-major order, the same way it is stored in memory
+			const int32_t numRows = mod.get_pattern_num_rows(p);
+			cells.resize(static_cast<size_t>(std::max(numRows, 0)) * numChannels);
+			for(int32_t r = 0; r < numRows; r++)
+			{
+				for(int32_t c = 0; c < numChannels; c++)
+				{
+					cells[r * numChannels + c] = mod.get_pattern_row_channel_command(p, r, c, openmpt::module::command_note);
+				}
+			}
+			pattern.offsets.resize(numChannels + 1);
+			for(int32_t c = 0; c < numChannels; c++)
+			{
+				pattern.offsets[c] = static_cast<uint32_t>(pattern.notes.size());
+				for(int32_t r = 0; r < numRows; r++)
+				{
+					const uint8_t note = cells[r * numChannels + c];
+					if(note > 0 && note <= 128)
+					{
+						pattern.notes.push_back(static_cast<int8_t>(note));
+					}
+				}
+			}
+			pattern.offsets[numChannels] = static_cast<uint32_t>(pattern.notes.size());
+		}
+		return &pattern;
+	};
+
 	int8_t prevNote = 0, prevNoteHash = -1;
+	std::vector<const PatternNotes *> &orderPatterns = context.orderPatterns;
 	for(int32_t s = 0; s < numSongs; s++)
 	{
 		mod.select_subsong(s);
@@ -208,28 +710,36 @@ static int64_t BuildNoteString(openmpt::module &mod, QByteArray &notes)
 			continue;
 		}
 		const int32_t numOrders = mod.get_num_orders();
-		notes.reserve(notes.size() + numChannels * numOrders * 64);
+		orderPatterns.clear();
+		size_t numNotes = 0;
+		for(int32_t o = 0; o < numOrders; o++)
+		{
+			// Orders without a valid pattern (e.g. separators) don't have any notes
+			const PatternNotes *pattern = getPattern(mod.get_order_pattern(o));
+			if(pattern != nullptr)
+			{
+				orderPatterns.push_back(pattern);
+				numNotes += pattern->notes.size();
+			}
+		}
+		notes.reserve(notes.size() + static_cast<int>(numNotes) + numChannels);
 		for(int32_t c = 0; c < numChannels; c++)
 		{
 			// Go through the complete sequence channel by channel.
 			if(prevNote)
 				notes.push_back(-prevNote);
-			for(int32_t o = 0; o < numOrders; o++)
+			for(const auto pattern : orderPatterns)
 			{
-				const int32_t p = mod.get_order_pattern(o);
-				const int32_t numRows = mod.get_pattern_num_rows(p);
-				for(int32_t r = 0; r < numRows; r++)
+				const int8_t *channelNotes = pattern->notes.data();
+				for(uint32_t i = pattern->offsets[c]; i < pattern->offsets[c + 1]; i++)
 				{
-					const uint8_t note = mod.get_pattern_row_channel_command(p, r, c, openmpt::module::command_note);
-					if(note > 0 && note <= 128)
-					{
-						notes.push_back(static_cast<int8_t>(note) - prevNote);
-						if(prevNoteHash == -1)
-							prevNoteHash = static_cast<int8_t>(note);
-						const uint8_t noteDiff = static_cast<uint8_t>(static_cast<int8_t>(note) - prevNoteHash);
-						hash = (hash ^ noteDiff) * FNV1a_PRIME;
-						prevNote = prevNoteHash = static_cast<int8_t>(note);
-					}
+					const int8_t note = channelNotes[i];
+					notes.push_back(note - prevNote);
+					if(prevNoteHash == -1)
+						prevNoteHash = note;
+					const uint8_t noteDiff = static_cast<uint8_t>(note - prevNoteHash);
+					hash = (hash ^ noteDiff) * FNV1a_PRIME;
+					prevNote = prevNoteHash = note;
 				}
 			}
 		}
@@ -282,104 +792,217 @@ ModDatabase::AddResult ModDatabase::PrepareQuery(const QString &path, QSqlQuery
 	{
 		return IOError;
 	}
-	QByteArray content(file.readAll());
+	// Read into the buffer of the previous module
+	QByteArray &content = analysisContext.content;
+	content.resize(static_cast<int>(file.size()));
+	if(file.read(content.data(), content.size()) != content.size())
+	{
+		return IOError;
+	}
 
 	try
 	{
-		openmpt::module mod(content.cbegin(), content.cend());
-		const QByteArray hash = QCryptographicHash::hash(content, QCryptographicHash::Sha512);
-		const QString hashStr = hash.toBase64();
+		const QString hashStr = ContentHash(content);
 
 		const QString dbPath = QDir::fromNativeSeparators(path);
-		// Check if this file already exists as-is in the database.
+		// Check if this file already exists as-is in the database, before spending any time on parsing it.
+		qint64 existingId = -1;
+		QByteArray existingNotes;
+		QStringList existingFacets;
 		selectQuery.bindValue(":filename", dbPath);
 		if(selectQuery.exec() && selectQuery.next())
 		{
 			if(selectQuery.value("hash").toString() == hashStr)
 			{
+				// The file may have been touched, copied or restored. Remember its new date so that it doesn't look modified anymore.
+				const qint64 fileDate = QFileInfo(file).lastModified().toTime_t();
+				if(selectQuery.value("filesize").toLongLong() != content.size() || selectQuery.value("filedate").toLongLong() != fileDate)
+				{
+					const qint64 id = selectQuery.value("id").toLongLong();
+					selectQuery.finish();
+					fileInfoQuery.bindValue(":filesize", content.size());
+					fileInfoQuery.bindValue(":filedate", fileDate);
+					fileInfoQuery.bindValue(":id", id);
+					if(fileInfoQuery.exec())
+					{
+						writeGeneration++;
+						ChangeNotifier::Instance().Updated(id);
+					} else
+					{
+						qDebug() << fileInfoQuery.lastError();
+						if(IsBusy(fileInfoQuery.lastError()))
+							return Busy;
+					}
+				}
 				return NoChange;
 			}
+			existingId = selectQuery.value("id").toLongLong();
+			existingNotes = selectQuery.value("note_data").toByteArray();
+			existingFacets = FacetValues(selectQuery);
 		}
 
 		query.bindValue(":hash", hashStr);
 		query.bindValue(":filename", dbPath);
 		query.bindValue(":filesize", content.size());
 		query.bindValue(":filedate", QFileInfo(file).lastModified().toTime_t());
-		query.bindValue(":editdate", QDateTime::fromString(QString::fromStdString(mod.get_metadata("date")), Qt::ISODate).toTime_t());
-		query.bindValue(":format", QString::fromStdString(mod.get_metadata("type")));
-		query.bindValue(":title", QString::fromStdString(mod.get_metadata("title")));
-		query.bindValue(":length", static_cast<int>(mod.get_duration_seconds() * 1000));
-		query.bindValue(":num_channels", mod.get_num_channels());
-		query.bindValue(":num_patterns", mod.get_num_patterns());
-		query.bindValue(":num_orders", mod.get_num_orders());
-		query.bindValue(":num_subsongs", mod.get_num_subsongs());
-		query.bindValue(":num_samples", mod.get_num_samples());
-		query.bindValue(":num_instruments", mod.get_num_instruments());
-		{
-			QString sampleText;
-			auto names = mod.get_sample_names();
-			for(const auto &name : names)
+
+		QString moduleArtist;
+		const QByteArray *notes = &analysisContext.notes;
+		QByteArray copiedNotes, noteSignature;
+		std::vector<uint32_t> copiedFingerprint;
+		const uint32_t *rawFingerprint = nullptr;
+		int rawFingerprintSize = 0;
+
+		// The same file may already exist under a different name, in which case there is no need to analyze it again
+		hashQuery.bindValue(":hash", hashStr);
+		if(hashQuery.exec() && hashQuery.next())
+		{
+			static const char *copiedColumns[] =
 			{
-				sampleText += QString::fromStdString(name) + "\n";
+				"editdate", "format", "title", "length", "num_channels", "num_patterns", "num_orders", "num_subsongs", "num_samples", "num_instruments",
+				"sample_text", "instrument_text", "comments", "fingerprint", "note_data", "pattern_hash", "note_minhash", "loudness", "peak", "silence_map", "waveform",
+			};
+			for(const char *column : copiedColumns)
+			{
+				query.bindValue(QLatin1Char(':') + QLatin1String(column), hashQuery.value(column));
 			}
-			query.bindValue(":sample_text", sampleText);
-		}
+			query.bindValue(":title_sortkey", TitleSortKey(hashQuery.value("title").toString(), dbPath));
+			// The artist column may have been edited by the user, so only the artist found in the module is copied
+			const QVariant copiedArtist = hashQuery.value("module_artist");
+			copiedNotes = hashQuery.value("note_data").toByteArray();
+			notes = &copiedNotes;
+			noteSignature = hashQuery.value("note_minhash").toByteArray();
+			copiedFingerprint = Fingerprint::Decode(hashQuery.value("fingerprint").toByteArray());
+			rawFingerprint = copiedFingerprint.data();
+			rawFingerprintSize = static_cast<int>(copiedFingerprint.size());
+			hashQuery.finish();
+			if(copiedArtist.isNull())
+			{
+				// Analyzed before the module artist was stored
+				openmpt::module mod(content.cbegin(), content.cend());
+				moduleArtist = QString::fromStdString(mod.get_metadata("artist"));
+			} else
+			{
+				moduleArtist = copiedArtist.toString();
+			}
+		} else
 		{
-			QString instrText;
-			auto names = mod.get_instrument_names();
-			for(const auto &name : names)
+			hashQuery.finish();
+			openmpt::module mod(content.cbegin(), content.cend());
+
+			query.bindValue(":editdate", QDateTime::fromString(QString::fromStdString(mod.get_metadata("date")), Qt::ISODate).toTime_t());
+			query.bindValue(":format", QString::fromStdString(mod.get_metadata("type")));
+			const QString title = QString::fromStdString(mod.get_metadata("title"));
+			query.bindValue(":title", title);
+			query.bindValue(":title_sortkey", TitleSortKey(title, dbPath));
+			query.bindValue(":num_channels", mod.get_num_channels());
+			query.bindValue(":num_patterns", mod.get_num_patterns());
+			query.bindValue(":num_orders", mod.get_num_orders());
+			query.bindValue(":num_subsongs", mod.get_num_subsongs());
+			query.bindValue(":num_samples", mod.get_num_samples());
+			query.bindValue(":num_instruments", mod.get_num_instruments());
+			{
+				// Collect the names as UTF-8 and convert them all at once
+				QByteArray &sampleText = analysisContext.sampleText;
+				sampleText.resize(0);
+				for(const auto &name : mod.get_sample_names())
+				{
+					sampleText.append(name.data(), static_cast<int>(name.size())).append('\n');
+				}
+				query.bindValue(":sample_text", QString::fromUtf8(sampleText));
+			}
 			{
-				instrText += QString::fromStdString(name) + "\n";
+				QByteArray &instrText = analysisContext.instrumentText;
+				instrText.resize(0);
+				for(const auto &name : mod.get_instrument_names())
+				{
+					instrText.append(name.data(), static_cast<int>(name.size())).append('\n');
+				}
+				query.bindValue(":instrument_text", QString::fromUtf8(instrText));
 			}
-			query.bindValue(":instrument_text", instrText);
+			query.bindValue(":comments", QString::fromStdString(mod.get_metadata("message_raw")));
+			moduleArtist = QString::fromStdString(mod.get_metadata("artist"));
+
+			const auto patternHash = BuildNoteString(mod, analysisContext);
+			query.bindValue(":note_data", BufferView(*notes));
+			query.bindValue(":pattern_hash", patternHash);
+			noteSignature = Melody::MinHash(*notes);
+			query.bindValue(":note_minhash", noteSignature.isEmpty() ? QVariant(QVariant::ByteArray) : QVariant(noteSignature));
+
+			// Render the module only once for all audio measurements, which also tells its duration.
+			// Extracting the notes has gone through all subsongs, so go back to the first one.
+			FingerprintConsumer &fingerprint = analysisContext.fingerprint;
+			LevelMeter &levels = analysisContext.levels;
+			SilenceMap &silence = analysisContext.silence;
+			WaveformThumbnail &waveform = analysisContext.waveform;
+			mod.select_subsong(0);
+			mod.set_render_param(openmpt::module::RENDER_INTERPOLATIONFILTER_LENGTH, 2);
+			const int64_t numFrames = Analysis::Render(mod, { &fingerprint, &levels, &silence, &waveform });
+			if(numFrames < int64_t(Analysis::MAX_SECONDS) * Analysis::SAMPLE_RATE)
+				query.bindValue(":length", static_cast<int>(numFrames * 1000 / Analysis::SAMPLE_RATE));
+			else
+				query.bindValue(":length", static_cast<int>(mod.get_duration_seconds() * 1000));	// Analysis stopped early
+			query.bindValue(":fingerprint", fingerprint.EncodedFingerprint());
+			query.bindValue(":loudness", levels.Loudness());
+			query.bindValue(":peak", levels.Peak());
+			query.bindValue(":silence_map", BufferView(silence.Map()));
+			query.bindValue(":waveform", BufferView(waveform.Thumbnail()));
+			rawFingerprint = fingerprint.RawFingerprint();
+			rawFingerprintSize = fingerprint.RawFingerprintSize();
 		}
-		query.bindValue(":comments", QString::fromStdString(mod.get_metadata("message_raw")));
-		QString artist = QString::fromStdString(mod.get_metadata("artist"));
+		query.bindValue(":module_artist", moduleArtist);
+		QString artist = moduleArtist;
 		if(artist.isEmpty())
 		{
 			artist = selectQuery.value("artist").toString();
 		}
 		query.bindValue(":artist", artist);
 
-		QByteArray notes;
-		const auto patternHash = BuildNoteString(mod, notes);
-		query.bindValue(":note_data", notes);
-		query.bindValue(":pattern_hash", patternHash);
-
-		ChromaprintContext *chromaprint_ctx = chromaprint_new(CHROMAPRINT_ALGORITHM_DEFAULT);
-		const int32_t samplerate = 22050;
-		chromaprint_start(chromaprint_ctx, samplerate, 1);
-		std::vector<int16_t> data(512);
-		double modLength = mod.get_duration_seconds() * samplerate;	// Prevent endless pattern loops
-		mod.set_render_param(openmpt::module::RENDER_INTERPOLATIONFILTER_LENGTH, 2);
-		while(modLength >= 0.0)
-		{
-			std::size_t count = mod.read(samplerate, data.size(), data.data());
-			modLength -= count;
-			if(!count || !chromaprint_feed(chromaprint_ctx, data.data(), static_cast<int>(count)))
+		db.transaction();
+		if(!query.exec())
+		{
+			// May happen if identical file already exists
+			qDebug() << query.lastError();
+			db.rollback();
+			return IsBusy(query.lastError()) ? Busy : NotAdded;
+		}
+		if(&query == &updateQuery && (existingId < 0 || query.numRowsAffected() != 1))
+		{
+			// The module has been removed from the library in the meantime, so there are no facets or indices to update
+			db.rollback();
+			return NotAdded;
+		}
+		const qint64 id = (&query == &insertQuery) ? query.lastInsertId().toLongLong() : existingId;
+		if(&query == &updateQuery)
+		{
+			CountFacets(existingFacets, -1);
+		}
+		CountFacets(FacetValues(query.boundValue(":format").toString(), query.boundValue(":num_channels").toInt(), query.boundValue(":editdate").toLongLong(), artist), 1);
+		if(id >= 0)
+		{
+			UpdateFingerprintIndex(id, rawFingerprint, rawFingerprintSize);
+			if(existingNotes != *notes)
 			{
-				break;
+				Melody::UpdateIndex(ngramRemoveQuery, id, existingNotes);
+				Melody::UpdateIndex(ngramInsertQuery, id, *notes);
+				lshRemoveQuery.bindValue(":id", id);
+				lshRemoveQuery.exec();
+				Melody::UpdateLSH(lshInsertQuery, id, noteSignature);
 			}
 		}
-		chromaprint_finish(chromaprint_ctx);
-
-		int rawFingerprintSize = 0, encodedFingerprintSize = 0;
-		uint32_t *rawFingerprint = nullptr;
-		char *encodedFingerprint = nullptr;
-		if(chromaprint_get_raw_fingerprint(chromaprint_ctx, &rawFingerprint, &rawFingerprintSize))
+		if(!db.commit())
 		{
-			chromaprint_encode_fingerprint(rawFingerprint, rawFingerprintSize, CHROMAPRINT_ALGORITHM_DEFAULT, &encodedFingerprint, &encodedFingerprintSize, 0);
+			qDebug() << db.lastError();
+			db.rollback();
+			return IsBusy(db.lastError()) ? Busy : NotAdded;
 		}
-		query.bindValue(":fingerprint", QByteArray(encodedFingerprint, encodedFingerprintSize));
-		chromaprint_dealloc(rawFingerprint);
-		chromaprint_dealloc(encodedFingerprint);
-		chromaprint_free(chromaprint_ctx);
-
-		if(!query.exec())
+		writeGeneration++;
+		if(id >= 0)
 		{
-			// May happen if identical file already exists
-			qDebug() << query.lastError();
-			return NotAdded;
+			if(&query == &insertQuery)
+				ChangeNotifier::Instance().Inserted(id);
+			else
+				ChangeNotifier::Instance().Updated(id);
 		}
 	} catch(openmpt::exception &e)
 	{
@@ -391,6 +1014,148 @@ ModDatabase::AddResult ModDatabase::PrepareQuery(const QString &path, QSqlQuery
 }
 
 
+bool ModDatabase::MoveModule(const QString &oldPath, const QString &newPath)
+{
+	const QString oldDbPath = QDir::fromNativeSeparators(oldPath), newDbPath = QDir::fromNativeSeparators(newPath);
+	qint64 id = -1;
+	QString title;
+	selectQuery.bindValue(":filename", oldDbPath);
+	if(selectQuery.exec() && selectQuery.next())
+	{
+		id = selectQuery.value("id").toLongLong();
+		title = selectQuery.value("title").toString();
+	}
+	selectQuery.finish();
+	if(id < 0)
+	{
+		return false;
+	}
+
+	moveQuery.bindValue(":filename", newDbPath);
+	moveQuery.bindValue(":filedate", QFileInfo(newPath).lastModified().toTime_t());
+	// Untitled modules are sorted by their file name
+	moveQuery.bindValue(":title_sortkey", TitleSortKey(title, newDbPath));
+	moveQuery.bindValue(":filename_old", oldDbPath);
+	if(!moveQuery.exec())
+	{
+		qDebug() << moveQuery.lastError();
+		return false;
+	}
+	writeGeneration++;
+	ChangeNotifier::Instance().Updated(id);
+	return true;
+}
+
+
+QString ModDatabase::ContentHash(const QByteArray &content)
+{
+	return QCryptographicHash::hash(content, QCryptographicHash::Sha512).toBase64();
+}
+
+
+QStringList ModDatabase::LibraryFolders()
+{
+	return QSettings().value("Library/folders").toStringList();
+}
+
+
+// Libraries created before the library folders were remembered have none. Suggest the topmost folders that contain several modules,
+// so that files which were added on their own do not turn the folders around them into library folders.
+QStringList ModDatabase::SuggestedLibraryFolders()
+{
+	QHash<QString, int> parents;
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	if(query.exec("SELECT `filename` FROM `modlib_modules`"))
+	{
+		while(query.next())
+		{
+			const QString fileName = query.value(0).toString();
+			parents[fileName.left(fileName.lastIndexOf('/') + 1)]++;
+		}
+	} else
+	{
+		qDebug() << query.lastError();
+	}
+	// With the trailing slash, subfolders are sorted right after their parent folder
+	QStringList sorted;
+	for(auto parent = parents.cbegin(); parent != parents.cend(); parent++)
+	{
+		if(parent.value() >= MIN_SUGGESTED_FOLDER_SIZE && QFileInfo(parent.key()).isDir())
+			sorted.push_back(parent.key());
+	}
+	sorted.sort();
+	QStringList folders;
+	QString lastFolder;
+	for(const auto &folder : sorted)
+	{
+		if(!lastFolder.isEmpty() && folder.startsWith(lastFolder))
+			continue;
+		lastFolder = folder;
+		folders.push_back(QDir(folder).absolutePath());
+	}
+	return folders;
+}
+
+
+void ModDatabase::AddLibraryFolder(const QString &path)
+{
+	const QString folder = QDir::fromNativeSeparators(QDir(path).absolutePath());
+	QStringList folders = LibraryFolders();
+	if(!folders.contains(folder))
+	{
+		folders.push_back(folder);
+		QSettings().setValue("Library/folders", folders);
+	}
+}
+
+
+// Sort key for the title of a module (or its file name if it has no title), as shown in the result table.
+// Comparing two keys byte-wise gives a case- and accent-insensitive order in which numbers are sorted by their value.
+QByteArray ModDatabase::TitleSortKey(const QString &title, const QString &fileName)
+{
+	// Compatibility decomposition separates accents from their letters and expands ligatures and full-width characters
+	const QString decomposed = (title.isEmpty() ? QFileInfo(fileName).fileName() : title).normalized(QString::NormalizationForm_KD);
+	QString folded;
+	folded.reserve(decomposed.size());
+	for(const QChar c : decomposed)
+	{
+		const auto category = c.category();
+		if(category != QChar::Mark_NonSpacing && category != QChar::Mark_SpacingCombining && category != QChar::Mark_Enclosing)
+		{
+			folded += c;
+		}
+	}
+	folded = folded.toCaseFolded();
+
+	QByteArray key;
+	key.reserve(folded.size() + 8);
+	const int length = folded.size();
+	for(int i = 0; i < length; )
+	{
+		const int start = i;
+		if(folded[i].isDigit() && folded[i].unicode() < 0x80)
+		{
+			// Numbers are prefixed by their number of digits, so that e.g. 10 comes after 9
+			while(i < length && folded[i].isDigit() && folded[i].unicode() < 0x80)
+				i++;
+			int first = start;
+			while(first < i - 1 && folded[first] == '0')
+				first++;
+			const int numDigits = std::min(i - first, 15);
+			key += static_cast<char>('0' + numDigits);
+			key += folded.midRef(first, numDigits).toLatin1();
+		} else
+		{
+			while(i < length && !(folded[i].isDigit() && folded[i].unicode() < 0x80))
+				i++;
+			key += folded.midRef(start, i - start).toUtf8();
+		}
+	}
+	return key;
+}
+
+
 void ModDatabase::GetModule(const QString &path, Module &mod)
 {
 	selectQuery.bindValue(":filename", QDir::fromNativeSeparators(path));
@@ -421,6 +1186,10 @@ void ModDatabase::GetModule(QSqlQuery &query, Module &mod)
 	mod.comments = query.value("comments").toString();
 	mod.artist = query.value("artist").toString();
 	mod.personalComment = query.value("personal_comments").toString();
+	mod.loudness = query.value("loudness").isNull() ? std::numeric_limits<double>::quiet_NaN() : query.value("loudness").toDouble();
+	mod.peak = query.value("peak").isNull() ? std::numeric_limits<double>::quiet_NaN() : query.value("peak").toDouble();
+	mod.silenceMap = query.value("silence_map").toByteArray();
+	mod.waveform = query.value("waveform").toByteArray();
 }
 
 
@@ -436,6 +1205,258 @@ QString ModDatabase::GetPrintableFingerprint(const QString &path)
 
 bool ModDatabase::RemoveModule(const QString &path)
 {
-	removeQuery.bindValue(":filename", QDir::fromNativeSeparators(path));
-	return removeQuery.exec();
+	const QString dbPath = QDir::fromNativeSeparators(path);
+	db.transaction();
+	qint64 id = -1;
+	idQuery.bindValue(":filename", dbPath);
+	if(idQuery.exec() && idQuery.next())
+	{
+		id = idQuery.value(0).toLongLong();
+		CountFacets(FacetValues(idQuery), -1);
+		RemoveFromFingerprintIndex(id);
+		Melody::UpdateIndex(ngramRemoveQuery, id, idQuery.value(1).toByteArray());
+		lshRemoveQuery.bindValue(":id", id);
+		lshRemoveQuery.exec();
+	}
+	idQuery.finish();
+	removeQuery.bindValue(":filename", dbPath);
+	if(!removeQuery.exec())
+	{
+		qDebug() << removeQuery.lastError();
+		db.rollback();
+		return false;
+	}
+	if(!db.commit())
+	{
+		qDebug() << db.lastError();
+		db.rollback();
+		return false;
+	}
+	writeGeneration++;
+	if(id >= 0)
+		ChangeNotifier::Instance().Removed(id);
+	return true;
+}
+
+
+// Update the fingerprint index of a newly added or updated module, and merge it into the clusters of any modules that it duplicates.
+void ModDatabase::UpdateFingerprintIndex(qint64 id, const uint32_t *fp, int fpSize)
+{
+	RemoveFromFingerprintIndex(id);
+	// The whole library is indexed at once when similarity is analyzed for the first time
+	if(!Similarity::IsClustered(db))
+	{
+		return;
+	}
+
+	const auto keys = Fingerprint::IndexKeys(fp, fpSize);
+	if(keys.empty())
+	{
+		return;
+	}
+	QVariantList keyList, idList;
+	QStringList keyStr;
+	for(const auto key : keys)
+	{
+		keyList << key;
+		idList << id;
+		keyStr << QString::number(key);
+	}
+	fpIndexInsertQuery.bindValue(0, keyList);
+	fpIndexInsertQuery.bindValue(1, idList);
+	if(!fpIndexInsertQuery.execBatch())
+	{
+		qDebug() << fpIndexInsertQuery.lastError();
+		return;
+	}
+
+	// Skip the same common keys as when clustering the whole library
+	QSqlQuery candidates(db);
+	candidates.setForwardOnly(true);
+	int numModules = 0;
+	if(candidates.exec("SELECT COUNT(*) FROM `modlib_modules`") && candidates.next())
+	{
+		numModules = candidates.value(0).toInt();
+	}
+	candidates.finish();
+	if(!candidates.exec("SELECT `module_id`, COUNT(*) FROM `modlib_fp_index` WHERE `key` IN ("
+		"SELECT `key` FROM `modlib_fp_index` WHERE `key` IN (" + keyStr.join(',') + ") GROUP BY `key` HAVING COUNT(*) <= " + QString::number(Fingerprint::MaxPostingLength(numModules))
+		+ ") AND `module_id` <> " + QString::number(id) + " GROUP BY `module_id` HAVING COUNT(*) >= 2"))
+	{
+		qDebug() << candidates.lastError();
+		return;
+	}
+
+	const int threshold = Fingerprint::DuplicateThreshold();
+	std::vector<qint64> matches;
+	while(candidates.next())
+	{
+		const qint64 candidateId = candidates.value(0).toLongLong();
+		fpByIdQuery.bindValue(":id", candidateId);
+		fpByIdQuery.bindValue(":id2", candidateId);
+		if(!fpByIdQuery.exec() || !fpByIdQuery.next())
+		{
+			continue;
+		}
+		if(candidates.value(1).toInt() < Fingerprint::MinSharedKeys(keys.size(), fpByIdQuery.value(1).toUInt()))
+		{
+			continue;
+		}
+		const auto candidateFp = Fingerprint::Decode(fpByIdQuery.value(0).toByteArray());
+		if(Fingerprint::Compare(fp, fpSize, candidateFp.data(), static_cast<int>(candidateFp.size())) >= threshold)
+		{
+			matches.push_back(candidateId);
+		}
+	}
+	fpByIdQuery.finish();
+	if(matches.empty())
+	{
+		return;
+	}
+
+	// The cluster ID is always the lowest module ID in the cluster, so merging clusters is simple.
+	QSqlQuery clusters(db);
+	clusters.setForwardOnly(true);
+	QStringList matchStr;
+	for(const auto match : matches)
+	{
+		matchStr << QString::number(match);
+	}
+	QStringList mergedClusters;
+	qint64 clusterId = std::min(id, *std::min_element(matches.begin(), matches.end()));
+	clusters.exec("SELECT DISTINCT `cluster_id` FROM `modlib_clusters` WHERE `module_id` IN (" + matchStr.join(',') + ")");
+	while(clusters.next())
+	{
+		mergedClusters << clusters.value(0).toString();
+		clusterId = std::min(clusterId, clusters.value(0).toLongLong());
+	}
+	if(!mergedClusters.isEmpty())
+	{
+		clusters.exec("UPDATE `modlib_clusters` SET `cluster_id` = " + QString::number(clusterId) + " WHERE `cluster_id` IN (" + mergedClusters.join(',') + ")");
+	}
+	matches.push_back(id);
+	for(const auto match : matches)
+	{
+		clusterInsertQuery.bindValue(":id", match);
+		clusterInsertQuery.bindValue(":cluster_id", clusterId);
+		clusterInsertQuery.exec();
+	}
+}
+
+
+// Remove a module from the fingerprint index and from its cluster. A cluster that only has one member left is dissolved.
+void ModDatabase::RemoveFromFingerprintIndex(qint64 id)
+{
+	fpIndexRemoveQuery.bindValue(":id", id);
+	fpIndexRemoveQuery.exec();
+	clusterRemoveQuery.bindValue(":id", id);
+	clusterRemoveQuery.bindValue(":id2", id);
+	clusterRemoveQuery.exec();
+	clusterLeaveQuery.bindValue(":id", id);
+	clusterLeaveQuery.exec();
+}
+
+
+QStringList ModDatabase::FacetValues(const QString &format, int numChannels, qint64 editDate, const QString &artist)
+{
+	QStringList values;
+	values << format;
+	values << (numChannels > 0 ? QString::number(numChannels) : QString());
+	// Invalid release dates are stored as UINT32_MAX
+	values << ((editDate > 0 && editDate < UINT32_MAX) ? QString::number(QDateTime::fromSecsSinceEpoch(editDate, Qt::UTC).date().year()) : QString());
+	values << artist;
+	return values;
+}
+
+
+QStringList ModDatabase::FacetValues(const QSqlQuery &query)
+{
+	return FacetValues(query.value("format").toString(), query.value("num_channels").toInt(), query.value("editdate").toLongLong(), query.value("artist").toString());
+}
+
+
+QString ModDatabase::FacetCondition(Facet facet, const QStringList &values)
+{
+	QStringList conditions;
+	for(const auto &value : values)
+	{
+		switch(facet)
+		{
+		case FacetFormat:
+			conditions << "`format` = '" + QString(value).replace('\'', "''") + "'";
+			break;
+		case FacetChannels:
+			conditions << "`num_channels` = " + QString::number(value.toInt());
+			break;
+		case FacetYear:
+			{
+				const qint64 start = QDateTime(QDate(value.toInt(), 1, 1), QTime(0, 0), Qt::UTC).toSecsSinceEpoch();
+				const qint64 end = QDateTime(QDate(value.toInt() + 1, 1, 1), QTime(0, 0), Qt::UTC).toSecsSinceEpoch() - 1;
+				conditions << "`editdate` BETWEEN " + QString::number(start) + " AND " + QString::number(end);
+			}
+			break;
+		case FacetArtist:
+			conditions << "`artist` = '" + QString(value).replace('\'', "''") + "'";
+			break;
+		default:
+			break;
+		}
+	}
+	if(conditions.isEmpty())
+	{
+		return QString();
+	}
+	return "(" + conditions.join(" OR ") + ")";
+}
+
+
+ModDatabase::FacetCounts ModDatabase::LibraryFacets(QSqlDatabase &db)
+{
+	FacetCounts counts;
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	if(!query.exec("SELECT `facet`, `value`, `count` FROM `modlib_facets`"))
+	{
+		qDebug() << query.lastError();
+		return counts;
+	}
+	while(query.next())
+	{
+		const int facet = query.value(0).toInt();
+		if(facet >= 0 && facet < NumFacets)
+		{
+			counts[facet].insert(query.value(1).toString(), query.value(2).toInt());
+		}
+	}
+	return counts;
+}
+
+
+// Add a module to (delta = 1) or remove it from (delta = -1) the facet tables
+void ModDatabase::CountFacets(const QStringList &values, int delta)
+{
+	for(int facet = 0; facet < NumFacets && facet < values.size(); facet++)
+	{
+		if(values[facet].isEmpty())
+			continue;
+		if(delta > 0)
+		{
+			facetInsertQuery.bindValue(0, facet);
+			facetInsertQuery.bindValue(1, values[facet]);
+			facetInsertQuery.exec();
+		}
+		facetCountQuery.bindValue(0, delta);
+		facetCountQuery.bindValue(1, facet);
+		facetCountQuery.bindValue(2, values[facet]);
+		if(!facetCountQuery.exec())
+		{
+			qDebug() << facetCountQuery.lastError();
+		}
+		if(delta < 0)
+		{
+			facetCleanupQuery.bindValue(0, facet);
+			facetCleanupQuery.bindValue(1, values[facet]);
+			facetCleanupQuery.exec();
+		}
+	}
 }
@@ -10,6 +10,10 @@
 #pragma once
 
 #include <QtSql/QtSql>
+#include "analysis.h"
+#include <array>
+#include <atomic>
+#include <mutex>
 
 struct Module
 {
@@ -32,6 +36,40 @@ struct Module
 	QString comments;
 	QString artist;
 	QString personalComment;
+	double loudness;		// RMS level in dBFS, NaN if the module has not been measured yet
+	double peak;			// Peak level in dBFS, likewise
+	QByteArray silenceMap;	// See SilenceMap
+	QByteArray waveform;	// See WaveformThumbnail
+};
+
+
+// Announces which modules have been added, updated or removed, so that open search results can follow the changes.
+// Changes may be reported from any thread. They are collected for a short while and announced together on the main thread.
+class ChangeNotifier : public QObject
+{
+	Q_OBJECT
+
+protected:
+	std::mutex mutex;
+	QVector<qint64> inserted, updated, removed;
+	bool flushScheduled;
+
+	ChangeNotifier();
+
+public:
+	static ChangeNotifier &Instance();
+
+	void Inserted(qint64 id);
+	void Updated(qint64 id);
+	void Removed(qint64 id);
+
+signals:
+	// A module ID only appears in one of the lists
+	void modulesChanged(const QVector<qint64> &inserted, const QVector<qint64> &updated, const QVector<qint64> &removed);
+
+protected:
+	void ScheduleFlush();
+	void Flush();
 };
 
 
@@ -40,7 +78,12 @@ class ModDatabase
 protected:
 	static ModDatabase instance;
 	QSqlDatabase db;
-	QSqlQuery insertQuery, updateQuery, updateCustomQuery, selectQuery, fpQuery, removeQuery;
+	QSqlQuery insertQuery, updateQuery, updateCustomQuery, moveQuery, fileInfoQuery, selectQuery, hashQuery, fpQuery, removeQuery, idQuery;
+	QSqlQuery ngramInsertQuery, ngramRemoveQuery, lshInsertQuery, lshRemoveQuery;
+	QSqlQuery fpByIdQuery, fpIndexInsertQuery, fpIndexRemoveQuery, clusterRemoveQuery, clusterLeaveQuery, clusterInsertQuery;
+	QSqlQuery facetInsertQuery, facetCountQuery, facetCleanupQuery;
+	AnalysisContext analysisContext;	// Reused for every module that is added or updated
+	static std::atomic<quint64> writeGeneration;	// Shared by all connections
 
 public:
 	enum AddResult
@@ -50,11 +93,25 @@ public:
 		Added		= 0x04,
 		Updated		= 0x08,
 		NoChange	= 0x10,
+		Busy		= 0x20,	// Another connection kept the database locked, try again later
 
 		Error		= NotAdded | IOError,
 		OK			= Added | Updated | NoChange,
 	};
 
+	// Properties of modules that are counted in the facet tables
+	enum Facet
+	{
+		FacetFormat = 0,
+		FacetChannels,
+		FacetYear,
+		FacetArtist,
+
+		NumFacets
+	};
+	// Number of modules per value of each facet
+	using FacetCounts = std::array<QMap<QString, int>, NumFacets>;
+
 	class Exception
 	{
 	protected:
@@ -70,6 +127,7 @@ public:
 	static ModDatabase &Instance() { return instance; }
 
 	void Open();
+	void OpenConnection(const QString &connectionName);
 	AddResult AddModule(const QString &path);
 	AddResult UpdateModule(const QString &path);
 	bool UpdateCustom(const QString &path, const QString &artist, const QString &comments);
@@ -77,9 +135,33 @@ public:
 	static void GetModule(QSqlQuery &query, Module &mod);
 	QString GetPrintableFingerprint(const QString &path);
 	bool RemoveModule(const QString &path);
+	// Point an existing module to the new location of its file, keeping all analysis results and custom fields
+	bool MoveModule(const QString &oldPath, const QString &newPath);
+	// Hash that identifies the contents of a module file
+	static QString ContentHash(const QByteArray &content);
+	// Folders that have been added to the library
+	static QStringList LibraryFolders();
+	static void AddLibraryFolder(const QString &path);
+	// Folders that could be watched in a library from before the library folders were remembered
+	QStringList SuggestedLibraryFolders();
+	static QByteArray TitleSortKey(const QString &title, const QString &fileName);
+
+	// Facet values of a module, an empty string means that the module is not counted for that facet
+	static QStringList FacetValues(const QString &format, int numChannels, qint64 editDate, const QString &artist);
+	static QStringList FacetValues(const QSqlQuery &query);
+	// SQL condition that restricts `modlib_modules` to modules with any of the given facet values
+	static QString FacetCondition(Facet facet, const QStringList &values);
+	// Number of modules per facet value in the whole library
+	static FacetCounts LibraryFacets(QSqlDatabase &db);
 
 	QSqlDatabase &GetDB() { return db; }
+	// Increases whenever a module is added, updated or removed, so that cached search results can be told apart from current ones
+	quint64 WriteGeneration() const { return writeGeneration; }
 
 protected:
+	void PrepareQueries();
 	AddResult PrepareQuery(const QString &path, QSqlQuery &query);
+	void UpdateFingerprintIndex(qint64 id, const uint32_t *fp, int fpSize);
+	void RemoveFromFingerprintIndex(qint64 id);
+	void CountFacets(const QStringList &values, int delta);
 };
\ No newline at end of file
@@ -0,0 +1,487 @@
+/*
+ * librarywatcher.cpp
+ * ------------------
+ * Purpose: Keeps the library up to date with the files in the library folders.
+ * Notes  : Directory watches do not report files that are modified in place on all platforms, Maintain still catches those.
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "librarywatcher.h"
+#include "database.h"
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QMultiHash>
+#include <QSqlQuery>
+#include <QDebug>
+#include <libopenmpt/libopenmpt.hpp>
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+// Time without any further changes after which the changed folders are compared with the library
+static constexpr int DEBOUNCE_INTERVAL = 2000;
+// Time after which folders whose changes could not be written to the library are compared again
+static constexpr std::chrono::seconds RETRY_INTERVAL{30};
+
+
+// Check whether a file could be a module before reading all of it. Files with unknown extensions may still be modules, e.g. Amiga-style names like mod.title.
+static bool LooksLikeModule(const QFileInfo &info)
+{
+	if(openmpt::is_extension_supported(info.suffix().toStdString()))
+	{
+		return true;
+	}
+	QFile file(info.absoluteFilePath());
+	if(!file.open(QIODevice::ReadOnly))
+	{
+		return false;
+	}
+	const QByteArray header = file.read(static_cast<qint64>(openmpt::probe_file_header_get_recommended_size()));
+	return openmpt::probe_file_header(openmpt::probe_file_header_flags_default, reinterpret_cast<const std::uint8_t *>(header.constData()), header.size(), info.size()) != openmpt::probe_file_header_result_failure;
+}
+
+
+LibraryWatcher::LibraryWatcher(QObject *parent)
+	: QObject(parent), stop(false)
+{
+	debounceTimer.setSingleShot(true);
+	debounceTimer.setInterval(DEBOUNCE_INTERVAL);
+	connect(&watcher, &QFileSystemWatcher::directoryChanged, this, &LibraryWatcher::OnDirectoryChanged);
+	connect(&debounceTimer, &QTimer::timeout, this, &LibraryWatcher::OnDebounceTimeout);
+}
+
+
+LibraryWatcher::~LibraryWatcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		queue.clear();
+	}
+	wakeUp.notify_one();
+	if(thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+
+void LibraryWatcher::Start()
+{
+	QStringList folders, roots;
+	for(const auto &folder : ModDatabase::LibraryFolders())
+	{
+		const QString root = QDir::fromNativeSeparators(QDir(folder).absolutePath());
+		// A library folder that is not available (e.g. on a drive that is not connected) must not make its modules look removed
+		if(QFileInfo(root).isDir())
+		{
+			folders += Watch(root);
+			roots.push_back(root);
+		}
+	}
+	{
+		// Folders that have been renamed or moved while the program was not running only exist in the library.
+		// They are compared together with the existing folders, so that their files are recognized as moved.
+		std::lock_guard<std::mutex> lock(mutex);
+		startRoots += roots;
+	}
+	Enqueue(folders);
+}
+
+
+void LibraryWatcher::AddFolder(const QString &path)
+{
+	ModDatabase::AddLibraryFolder(path);
+	// The folder has just been scanned, so there is nothing to compare yet
+	Watch(path);
+}
+
+
+QStringList LibraryWatcher::Watch(const QString &path)
+{
+	const QString root = QDir::fromNativeSeparators(QDir(path).absolutePath());
+	if(!QFileInfo(root).isDir())
+	{
+		return QStringList();
+	}
+	const QStringList watchedList = watcher.directories();
+	const QSet<QString> watched(watchedList.cbegin(), watchedList.cend());
+
+	QStringList folders;
+	if(!watched.contains(root))
+	{
+		folders.push_back(root);
+	}
+	QDirIterator di(root, QDir::Dirs | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+	while(di.hasNext())
+	{
+		const QString folder = di.next();
+		if(!watched.contains(folder))
+		{
+			folders.push_back(folder);
+		}
+	}
+	if(!folders.isEmpty())
+	{
+		const QStringList failed = watcher.addPaths(folders);
+		if(!failed.isEmpty())
+		{
+			qDebug() << "Cannot watch" << failed.size() << "folders, starting with" << failed.first();
+		}
+	}
+	return folders;
+}
+
+
+void LibraryWatcher::Rescan(const QStringList &extraFolders)
+{
+	QStringList folders = watcher.directories();
+	for(const auto &folder : extraFolders)
+	{
+		folders.push_back(QDir::fromNativeSeparators(QDir(folder).absolutePath()));
+	}
+	folders.removeDuplicates();
+	Enqueue(folders);
+}
+
+
+void LibraryWatcher::OnDirectoryChanged(const QString &path)
+{
+	changedFolders.insert(path);
+	debounceTimer.start();
+}
+
+
+void LibraryWatcher::OnDebounceTimeout()
+{
+	const QStringList watchedList = watcher.directories();
+	const QSet<QString> watched(watchedList.cbegin(), watchedList.cend());
+	QStringList folders;
+	for(const auto &folder : changedFolders)
+	{
+		folders.push_back(folder);
+		// Folders that have been created or moved into a watched folder need to be watched as well, and their contents added
+		const QStringList subFolders = QDir(folder).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+		for(const auto &subFolder : subFolders)
+		{
+			const QString path = folder + '/' + subFolder;
+			if(!watched.contains(path))
+			{
+				folders += Watch(path);
+			}
+		}
+	}
+	changedFolders.clear();
+	folders.removeDuplicates();
+	Enqueue(folders);
+}
+
+
+void LibraryWatcher::Enqueue(const QStringList &folders)
+{
+	if(folders.isEmpty())
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for(const auto &folder : folders)
+		{
+			if(std::find(queue.begin(), queue.end(), folder) == queue.end())
+			{
+				queue.push_back(folder);
+			}
+		}
+		if(!thread.joinable())
+		{
+			thread = std::thread(&LibraryWatcher::Run, this);
+		}
+	}
+	wakeUp.notify_one();
+}
+
+
+void LibraryWatcher::Run()
+{
+	const QString connectionName = "modlib_watcher";
+	try
+	{
+		ModDatabase database;
+		database.OpenConnection(connectionName);
+		QSqlQuery folderQuery(database.GetDB());
+		folderQuery.setForwardOnly(true);
+		folderQuery.prepare("SELECT `filename`, `filesize`, `filedate`, `hash` FROM `modlib_modules` WHERE `filename` > :first AND `filename` < :last");
+		// Files that are not modules are remembered, so that they are only looked at again once they have changed
+		QSqlQuery rejectedQuery(database.GetDB()), rejectQuery(database.GetDB()), unrejectQuery(database.GetDB());
+		rejectedQuery.setForwardOnly(true);
+		rejectedQuery.prepare("SELECT `filename`, `filesize`, `filedate` FROM `modlib_rejected` WHERE `filename` > :first AND `filename` < :last");
+		rejectQuery.prepare("INSERT OR REPLACE INTO `modlib_rejected` (`filename`, `filesize`, `filedate`) VALUES (:filename, :filesize, :filedate)");
+		unrejectQuery.prepare("DELETE FROM `modlib_rejected` WHERE `filename` = :filename");
+		const auto reject = [&rejectQuery](const QFileInfo &info)
+		{
+			rejectQuery.bindValue(":filename", info.absoluteFilePath());
+			rejectQuery.bindValue(":filesize", info.size());
+			rejectQuery.bindValue(":filedate", info.lastModified().toSecsSinceEpoch());
+			if(!rejectQuery.exec())
+				qDebug() << rejectQuery.lastError();
+		};
+
+		// Folders with changes that could not be written, e.g. because the database was locked by another connection for too long
+		QSet<QString> retryFolders;
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true)
+		{
+			const auto wakeUpCondition = [this]() { return stop || !queue.empty(); };
+			if(retryFolders.isEmpty())
+				wakeUp.wait(lock, wakeUpCondition);
+			else
+				wakeUp.wait_for(lock, RETRY_INTERVAL, wakeUpCondition);
+			if(stop)
+			{
+				break;
+			}
+			// Take all folders at once, so that files moved from one folder to another are recognized as such
+			for(const auto &folder : retryFolders)
+			{
+				if(std::find(queue.begin(), queue.end(), folder) == queue.end())
+					queue.push_back(folder);
+			}
+			retryFolders.clear();
+			std::vector<QString> folders(queue.cbegin(), queue.cend());
+			queue.clear();
+			const QStringList roots = std::move(startRoots);
+			startRoots.clear();
+			lock.unlock();
+
+			if(!roots.isEmpty())
+			{
+				QSet<QString> knownFolders;
+				for(const auto &root : roots)
+				{
+					folderQuery.bindValue(":first", root + '/');
+					folderQuery.bindValue(":last", root + QChar('/' + 1));
+					if(folderQuery.exec())
+					{
+						while(folderQuery.next())
+						{
+							const QString fileName = folderQuery.value(0).toString();
+							knownFolders.insert(fileName.left(fileName.lastIndexOf('/')));
+						}
+					}
+					folderQuery.finish();
+				}
+				const QSet<QString> queued(folders.cbegin(), folders.cend());
+				for(const auto &folder : knownFolders)
+				{
+					if(!queued.contains(folder))
+						folders.push_back(folder);
+				}
+			}
+
+			struct MissingFile
+			{
+				QString fileName;
+				QString hash;
+			};
+			QStringList newFiles, modifiedFiles;
+			QMultiHash<qint64, MissingFile> missingFiles;
+			for(const auto &folder : folders)
+			{
+				// Modules directly in this folder according to the library
+				struct KnownFile
+				{
+					qint64 fileSize;
+					qint64 fileDate;
+					QString hash;
+				};
+				QHash<QString, KnownFile> knownFiles;
+				folderQuery.bindValue(":first", folder + '/');
+				folderQuery.bindValue(":last", folder + QChar('/' + 1));
+				if(folderQuery.exec())
+				{
+					while(folderQuery.next())
+					{
+						const QString fileName = folderQuery.value(0).toString();
+						if(fileName.indexOf('/', folder.size() + 1) >= 0)
+						{
+							continue;
+						}
+						knownFiles.insert(fileName, KnownFile{ folderQuery.value(1).toLongLong(), folderQuery.value(2).toLongLong(), folderQuery.value(3).toString() });
+					}
+				}
+				folderQuery.finish();
+				QHash<QString, std::pair<qint64, qint64>> rejectedFiles;	// File size and date
+				rejectedQuery.bindValue(":first", folder + '/');
+				rejectedQuery.bindValue(":last", folder + QChar('/' + 1));
+				if(rejectedQuery.exec())
+				{
+					while(rejectedQuery.next())
+					{
+						const QString fileName = rejectedQuery.value(0).toString();
+						if(fileName.indexOf('/', folder.size() + 1) < 0)
+							rejectedFiles.insert(fileName, std::make_pair(rejectedQuery.value(1).toLongLong(), rejectedQuery.value(2).toLongLong()));
+					}
+				}
+				rejectedQuery.finish();
+
+				// A folder that does not exist anymore has no files
+				const QFileInfoList entries = QDir(folder).entryInfoList(QDir::Files);
+				for(const auto &info : entries)
+				{
+					const QString fileName = info.absoluteFilePath();
+					const auto known = knownFiles.find(fileName);
+					if(known == knownFiles.end())
+					{
+						const auto rejected = rejectedFiles.find(fileName);
+						if(rejected != rejectedFiles.end())
+						{
+							const bool unchanged = rejected->first == info.size() && rejected->second == info.lastModified().toSecsSinceEpoch();
+							rejectedFiles.erase(rejected);
+							if(unchanged)
+								continue;
+						}
+						if(LooksLikeModule(info))
+							newFiles.push_back(fileName);
+						else
+							reject(info);
+						continue;
+					}
+					if(info.size() != known->fileSize || info.lastModified().toSecsSinceEpoch() != known->fileDate)
+					{
+						modifiedFiles.push_back(fileName);
+					}
+					knownFiles.erase(known);
+				}
+				for(auto missing = knownFiles.cbegin(); missing != knownFiles.cend(); missing++)
+				{
+					missingFiles.insert(missing->fileSize, MissingFile{ missing.key(), missing->hash });
+				}
+				// Rejected files that are gone
+				for(auto rejected = rejectedFiles.cbegin(); rejected != rejectedFiles.cend(); rejected++)
+				{
+					unrejectQuery.bindValue(":filename", rejected.key());
+					unrejectQuery.exec();
+				}
+			}
+
+			int added = 0, updated = 0, moved = 0, removed = 0, failed = 0;
+			const auto retryLater = [&](const QString &fileName)
+			{
+				retryFolders.insert(QFileInfo(fileName).absolutePath());
+				failed++;
+			};
+			for(const auto &fileName : modifiedFiles)
+			{
+				if(stop)
+					break;
+				const ModDatabase::AddResult result = database.UpdateModule(fileName);
+				if(result & (ModDatabase::Added | ModDatabase::Updated))
+					updated++;
+				else if(result == ModDatabase::Busy)
+					retryLater(fileName);
+			}
+
+			// Files that have only been moved or renamed keep their analysis results and custom fields.
+			// Only files with the same size as a missing one need to be hashed.
+			std::vector<std::pair<QString, QString>> moves;	// Old and new file name
+			QStringList addedFiles;
+			for(const auto &fileName : newFiles)
+			{
+				if(stop)
+					break;
+				bool isMove = false;
+				const qint64 fileSize = QFileInfo(fileName).size();
+				QFile file(fileName);
+				if(missingFiles.contains(fileSize) && file.open(QIODevice::ReadOnly))
+				{
+					const QString hash = ModDatabase::ContentHash(file.readAll());
+					file.close();
+					for(auto missing = missingFiles.find(fileSize); missing != missingFiles.end() && missing.key() == fileSize; missing++)
+					{
+						if(missing->hash == hash)
+						{
+							moves.emplace_back(missing->fileName, fileName);
+							missingFiles.erase(missing);
+							isMove = true;
+							break;
+						}
+					}
+				}
+				if(!isMove)
+					addedFiles.push_back(fileName);
+			}
+			if(!moves.empty())
+			{
+				QSqlDatabase &db = database.GetDB();
+				db.transaction();
+				bool movesFailed = false;
+				for(const auto &move : moves)
+				{
+					if(database.MoveModule(move.first, move.second))
+						moved++;
+					else
+						movesFailed = true;
+				}
+				if(movesFailed || !db.commit())
+				{
+					// Moves are only recognized as such while both the old and the new file name are known, so try all of them again
+					if(!movesFailed)
+						qDebug() << db.lastError();
+					db.rollback();
+					moved = 0;
+					for(const auto &move : moves)
+					{
+						retryFolders.insert(QFileInfo(move.first).absolutePath());
+						retryLater(move.second);
+					}
+				}
+			}
+			for(const auto &fileName : addedFiles)
+			{
+				if(stop)
+					break;
+				const ModDatabase::AddResult result = database.AddModule(fileName);
+				if(result == ModDatabase::Added)
+				{
+					added++;
+					unrejectQuery.bindValue(":filename", fileName);
+					unrejectQuery.exec();
+				} else if(result == ModDatabase::NotAdded)
+				{
+					reject(QFileInfo(fileName));
+				} else if(result == ModDatabase::Busy)
+				{
+					retryLater(fileName);
+				}
+			}
+			if(!stop)
+			{
+				for(const auto &missing : missingFiles)
+				{
+					if(database.RemoveModule(missing.fileName))
+						removed++;
+					else
+						retryLater(missing.fileName);
+				}
+			}
+			if(failed)
+			{
+				qDebug() << "Cannot update" << failed << "files in the library, trying again in" << RETRY_INTERVAL.count() << "seconds";
+			}
+			if(added || updated || moved || removed || failed)
+			{
+				emit libraryUpdated(added, updated, moved, removed, failed);
+			}
+
+			lock.lock();
+		}
+	} catch(ModDatabase::Exception &e)
+	{
+		qDebug() << e.what();
+	}
+	QSqlDatabase::removeDatabase(connectionName);
+}
@@ -0,0 +1,68 @@
+/*
+ * librarywatcher.h
+ * ----------------
+ * Purpose: Keeps the library up to date with the files in the library folders.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QFileSystemWatcher>
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+#include <QTimer>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+
+// Watches all library folders and their subfolders for changes.
+// Changed folders are collected until things have calmed down, and then compared with the library on a separate thread and database connection.
+// Only the files in those folders that are new, have been modified or have disappeared are analyzed, moved or removed.
+class LibraryWatcher : public QObject
+{
+	Q_OBJECT
+
+protected:
+	QFileSystemWatcher watcher;
+	QTimer debounceTimer;
+	QSet<QString> changedFolders;	// Waiting for the debounce timer
+
+	// Folders waiting to be compared with the library, shared with the update thread
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::deque<QString> queue;
+	QStringList startRoots;	// Library folders whose folders according to the library still need to be compared
+	std::atomic<bool> stop;
+	std::thread thread;
+
+public:
+	LibraryWatcher(QObject *parent = nullptr);
+	~LibraryWatcher();
+
+	// Watch all folders that have been added to the library so far, and pick up any changes made while the program was not running
+	void Start();
+	// Add a folder to the library folders and watch it from now on
+	void AddFolder(const QString &path);
+	// Compare all watched folders and the given other folders with the library, e.g. to find out where missing files have been moved to
+	void Rescan(const QStringList &extraFolders);
+
+signals:
+	// Emitted from the update thread after a batch of changes has been applied. Failed files are tried again later.
+	void libraryUpdated(int added, int updated, int moved, int removed, int failed);
+
+protected slots:
+	void OnDirectoryChanged(const QString &path);
+	void OnDebounceTimeout();
+
+protected:
+	// Watch a folder and all its subfolders. Returns the folders that were not watched before.
+	QStringList Watch(const QString &path);
+	void Enqueue(const QStringList &folders);
+	void Run();
+};
@@ -0,0 +1,537 @@
+/*
+ * melody.cpp
+ * ----------
+ * Purpose: Note n-gram index, approximate matching and near-duplicate detection based on note data.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "melody.h"
+#include <QSqlError>
+#include <QStringList>
+#include <QVariant>
+#include <QDebug>
+#include <QHash>
+#include <QSettings>
+#include <QtEndian>
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstring>
+#include <numeric>
+
+
+std::vector<uint32_t> Melody::NGrams(const char *notes, int length)
+{
+	std::vector<uint32_t> grams;
+	if(length < NGRAM_LENGTH)
+	{
+		return grams;
+	}
+	grams.reserve(length - NGRAM_LENGTH + 1);
+	uint32_t gram = 0;
+	for(int i = 0; i < length; i++)
+	{
+		gram = (gram << 8) | static_cast<uint8_t>(notes[i]);
+		if(i >= NGRAM_LENGTH - 1)
+		{
+			grams.push_back(gram);
+		}
+	}
+	std::sort(grams.begin(), grams.end());
+	grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+	return grams;
+}
+
+
+bool Melody::UpdateIndex(QSqlQuery &query, qint64 id, const QByteArray &notes)
+{
+	const auto grams = NGrams(notes);
+	if(grams.empty())
+	{
+		return true;
+	}
+	QVariantList gramList, idList;
+	gramList.reserve(static_cast<int>(grams.size()));
+	idList.reserve(static_cast<int>(grams.size()));
+	for(const auto gram : grams)
+	{
+		gramList << gram;
+		idList << id;
+	}
+	query.bindValue(0, gramList);
+	query.bindValue(1, idList);
+	if(!query.execBatch())
+	{
+		qDebug() << query.lastError();
+		return false;
+	}
+	return true;
+}
+
+
+QString Melody::IndexCondition(QSqlDatabase &db, const QByteArray &melody)
+{
+	const auto grams = NGrams(melody);
+	if(grams.empty())
+	{
+		return QString();
+	}
+
+	// Drive the lookup from the rarest n-gram and check the others with cheap primary key lookups.
+	// Counting is capped so that estimating the frequency of very common n-grams stays fast.
+	static constexpr int MAX_COUNT = 10000;
+	static constexpr size_t MAX_CHECKED_GRAMS = 8;
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	query.prepare("SELECT COUNT(*) FROM (SELECT 1 FROM `modlib_note_ngrams` WHERE `gram` = :gram LIMIT " + QString::number(MAX_COUNT) + ")");
+	std::vector<std::pair<int, uint32_t>> frequency;
+	for(const auto gram : grams)
+	{
+		query.bindValue(":gram", gram);
+		if(!query.exec() || !query.next())
+		{
+			qDebug() << query.lastError();
+			return QString();
+		}
+		const int count = query.value(0).toInt();
+		if(count == 0)
+		{
+			// This n-gram doesn't appear anywhere, so the melody can't be found either.
+			return "0";
+		}
+		frequency.emplace_back(count, gram);
+	}
+	std::sort(frequency.begin(), frequency.end());
+
+	QString condition = "(`modlib_modules`.`id` IN (SELECT `module_id` FROM `modlib_note_ngrams` WHERE `gram` = " + QString::number(frequency.front().second) + ")";
+	for(size_t i = 1; i < std::min(frequency.size(), MAX_CHECKED_GRAMS); i++)
+	{
+		if(frequency[i].first >= MAX_COUNT)
+			break;
+		condition += " AND EXISTS (SELECT 1 FROM `modlib_note_ngrams` WHERE `gram` = " + QString::number(frequency[i].second) + " AND `module_id` = `modlib_modules`.`id`)";
+	}
+	condition += ")";
+	return condition;
+}
+
+
+QString Melody::FuzzyIndexCondition(QSqlDatabase &db, const QByteArray &melody, int maxDistance)
+{
+	// If the melody is split into maxDistance + 1 pieces, at least one of them must appear unchanged in the note data.
+	const int numPieces = maxDistance + 1;
+	const int pieceLength = melody.size() / numPieces;
+	if(pieceLength < NGRAM_LENGTH)
+	{
+		return QString();
+	}
+	QStringList conditions;
+	for(int i = 0; i < numPieces; i++)
+	{
+		const int offset = i * pieceLength;
+		const QString condition = IndexCondition(db, melody.mid(offset, (i == numPieces - 1) ? -1 : pieceLength));
+		if(condition.isEmpty())
+		{
+			return QString();
+		} else if(condition != "0")
+		{
+			conditions << condition;
+		}
+	}
+	if(conditions.isEmpty())
+	{
+		return "0";
+	}
+	return "(" + conditions.join(" OR ") + ")";
+}
+
+
+Melody::Pattern::Pattern(const QByteArray &melody) : melody(melody)
+{
+	std::fill(std::begin(peq), std::end(peq), 0);
+	for(int i = 0; i < std::min(melody.size(), 64); i++)
+	{
+		peq[static_cast<uint8_t>(melody[i])] |= uint64_t(1) << i;
+	}
+}
+
+
+int Melody::Pattern::Distance(const char *notes, int length) const
+{
+	const int m = melody.size();
+	if(m == 0)
+	{
+		return 0;
+	}
+
+	if(m > 64)
+	{
+		// Too long for a single machine word, fall back to the classic dynamic programming approach
+		std::vector<int> column(m + 1);
+		for(int i = 0; i <= m; i++)
+		{
+			column[i] = i;
+		}
+		int best = m;
+		for(int j = 0; j < length && best > 0; j++)
+		{
+			int diagonal = column[0];
+			for(int i = 1; i <= m; i++)
+			{
+				const int above = column[i];
+				column[i] = std::min({ above + 1, column[i - 1] + 1, diagonal + (melody[i - 1] != notes[j] ? 1 : 0) });
+				diagonal = above;
+			}
+			best = std::min(best, column[m]);
+		}
+		return best;
+	}
+
+	// Column-wise bit vectors of vertical deltas (+1 / -1), see G. Myers: "A fast bit-vector algorithm for approximate string matching based on dynamic programming"
+	const uint64_t lastBit = uint64_t(1) << (m - 1);
+	uint64_t pv = ~uint64_t(0), mv = 0;
+	int score = m, best = m;
+	for(int j = 0; j < length && best > 0; j++)
+	{
+		const uint64_t eq = peq[static_cast<uint8_t>(notes[j])];
+		const uint64_t xv = eq | mv;
+		const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint64_t ph = mv | ~(xh | pv);
+		uint64_t mh = pv & xh;
+		if(ph & lastBit)
+			score++;
+		else if(mh & lastBit)
+			score--;
+		// No carry-in at the top row: A match may start anywhere in the note data
+		ph <<= 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+		best = std::min(best, score);
+	}
+	return best;
+}
+
+
+bool Melody::FuzzySearch(QSqlQuery &candidates, const std::vector<QByteArray> &melodies, int maxDistance, std::vector<FuzzyMatch> &result, const ProgressCallback &progress)
+{
+	std::vector<Pattern> patterns;
+	int totalLength = 0;
+	for(const auto &melody : melodies)
+	{
+		patterns.emplace_back(melody);
+		totalLength += melody.size();
+	}
+	if(!totalLength)
+	{
+		return true;
+	}
+
+	// Process the candidates in chunks so that memory usage stays constant
+	static constexpr size_t CHUNK_SIZE = 4096;
+	std::vector<qint64> ids;
+	std::vector<QByteArray> notes;
+	std::vector<int> distances;
+	bool hasMore = true;
+	while(hasMore)
+	{
+		ids.clear();
+		notes.clear();
+		while(ids.size() < CHUNK_SIZE && (hasMore = candidates.next()))
+		{
+			ids.push_back(candidates.value(0).toLongLong());
+			notes.push_back(candidates.value(1).toByteArray());
+		}
+		distances.assign(ids.size(), 0);
+
+		if(!ParallelFor(static_cast<int>(ids.size()), QObject::tr("Searching melodies..."), progress, [&](int i, int)
+		{
+			int distance = 0;
+			for(const auto &pattern : patterns)
+			{
+				const int patternDistance = pattern.Distance(notes[i].constData(), notes[i].size());
+				if(patternDistance > maxDistance)
+				{
+					distance = INT_MAX;
+					break;
+				}
+				distance += patternDistance;
+			}
+			distances[i] = distance;
+		}))
+		{
+			return false;
+		}
+
+		for(size_t i = 0; i < ids.size(); i++)
+		{
+			if(distances[i] != INT_MAX)
+			{
+				result.push_back({ ids[i], distances[i], (100 * std::max(0, totalLength - distances[i])) / totalLength });
+			}
+		}
+	}
+	return true;
+}
+
+
+static constexpr int SIGNATURE_SIZE = Melody::MINHASH_SIZE * static_cast<int>(sizeof(uint32_t));
+
+
+static uint64_t MixBits(uint64_t x)
+{
+	// SplitMix64 finalizer
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+
+QByteArray Melody::MinHash(const QByteArray &notes)
+{
+	if(notes.size() < SHINGLE_LENGTH)
+	{
+		return QByteArray();
+	}
+
+	// Each shingle fits into a 64-bit integer. Repeated patterns produce many identical shingles, so only hash each of them once.
+	static_assert(SHINGLE_LENGTH <= 8, "Shingles must fit into 64 bits");
+	std::vector<uint64_t> shingles;
+	shingles.reserve(notes.size() - SHINGLE_LENGTH + 1);
+	uint64_t shingle = 0;
+	for(int i = 0; i < notes.size(); i++)
+	{
+		shingle = (shingle << 8) | static_cast<uint8_t>(notes[i]);
+		if(i >= SHINGLE_LENGTH - 1)
+		{
+			shingles.push_back(shingle);
+		}
+	}
+	std::sort(shingles.begin(), shingles.end());
+	shingles.erase(std::unique(shingles.begin(), shingles.end()), shingles.end());
+
+	// Hash functions of the form (a * x + b) >> 32, with fixed pseudo-random coefficients so that signatures stay comparable
+	static const auto coefficients = []()
+	{
+		std::array<std::pair<uint64_t, uint64_t>, MINHASH_SIZE> c;
+		uint64_t seed = 0;
+		for(auto &coeff : c)
+		{
+			coeff.first = MixBits(seed += 0x9E3779B97F4A7C15ull) | 1;
+			coeff.second = MixBits(seed += 0x9E3779B97F4A7C15ull);
+		}
+		return c;
+	}();
+
+	std::array<uint32_t, MINHASH_SIZE> minimum;
+	minimum.fill(UINT32_MAX);
+	for(const auto s : shingles)
+	{
+		const uint64_t x = MixBits(s);
+		for(int i = 0; i < MINHASH_SIZE; i++)
+		{
+			minimum[i] = std::min(minimum[i], static_cast<uint32_t>((coefficients[i].first * x + coefficients[i].second) >> 32));
+		}
+	}
+
+	QByteArray signature(SIGNATURE_SIZE, 0);
+	for(int i = 0; i < MINHASH_SIZE; i++)
+	{
+		qToLittleEndian(minimum[i], signature.data() + i * sizeof(uint32_t));
+	}
+	return signature;
+}
+
+
+int Melody::Similarity(const QByteArray &signature1, const QByteArray &signature2)
+{
+	if(signature1.size() != SIGNATURE_SIZE || signature2.size() != SIGNATURE_SIZE)
+	{
+		return 0;
+	}
+	// The fraction of identical hash minimums is an estimate for the Jaccard similarity of the shingle sets
+	int matches = 0;
+	for(int i = 0; i < SIGNATURE_SIZE; i += sizeof(uint32_t))
+	{
+		if(!std::memcmp(signature1.constData() + i, signature2.constData() + i, sizeof(uint32_t)))
+			matches++;
+	}
+	return (100 * matches) / MINHASH_SIZE;
+}
+
+
+bool Melody::UpdateLSH(QSqlQuery &query, qint64 id, const QByteArray &signature)
+{
+	if(signature.size() != SIGNATURE_SIZE)
+	{
+		return true;
+	}
+	static constexpr uint64_t FNV1a_BASIS = 14695981039346656037ull;
+	static constexpr uint64_t FNV1a_PRIME = 1099511628211ull;
+	static constexpr int BAND_SIZE = LSH_ROWS * sizeof(uint32_t);
+	QVariantList bandList, bucketList, idList;
+	for(int band = 0; band < LSH_BANDS; band++)
+	{
+		uint64_t hash = FNV1a_BASIS;
+		for(int i = band * BAND_SIZE; i < (band + 1) * BAND_SIZE; i++)
+		{
+			hash = (hash ^ static_cast<uint8_t>(signature[i])) * FNV1a_PRIME;
+		}
+		bandList << band;
+		bucketList << static_cast<qint64>(hash);	// Integers are signed in sqlite
+		idList << id;
+	}
+	query.bindValue(0, bandList);
+	query.bindValue(1, bucketList);
+	query.bindValue(2, idList);
+	if(!query.execBatch())
+	{
+		qDebug() << query.lastError();
+		return false;
+	}
+	return true;
+}
+
+
+int Melody::DuplicateThreshold()
+{
+	return QSettings().value("Duplicates/noteThreshold", 70).toInt();
+}
+
+
+int Melody::FindNearDuplicates(QSqlDatabase &db, std::vector<qint64> &resultIds, std::vector<int> &resultScores)
+{
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	if(!query.exec("SELECT `id`, `note_minhash` FROM `modlib_modules` WHERE `note_minhash` IS NOT NULL"))
+	{
+		qDebug() << query.lastError();
+		return -1;
+	}
+	std::vector<qint64> ids;
+	std::vector<QByteArray> signatures;
+	QHash<qint64, int> indices;
+	while(query.next())
+	{
+		indices.insert(query.value(0).toLongLong(), static_cast<int>(ids.size()));
+		ids.push_back(query.value(0).toLongLong());
+		signatures.push_back(query.value(1).toByteArray());
+	}
+	const int numModules = static_cast<int>(ids.size());
+
+	// Merge matches into groups. The root of each group is always the module with the lowest ID.
+	std::vector<int> parent(numModules);
+	std::iota(parent.begin(), parent.end(), 0);
+	const auto findRoot = [&parent](int i)
+	{
+		while(parent[i] != i)
+		{
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	};
+	const int threshold = DuplicateThreshold();
+	const auto compare = [&](int i, int j)
+	{
+		const int a = findRoot(i), b = findRoot(j);
+		if(a == b || Similarity(signatures[i], signatures[j]) < threshold)
+			return;
+		if(ids[a] < ids[b])
+			parent[b] = a;
+		else
+			parent[a] = b;
+	};
+
+	// Only modules that share at least one LSH bucket are compared.
+	// Buckets are visited in index order, so only the members of one bucket need to be kept in memory.
+	static constexpr size_t MAX_PAIRWISE = 32;
+	std::vector<int> bucket;
+	const auto processBucket = [&]()
+	{
+		if(bucket.size() <= MAX_PAIRWISE)
+		{
+			for(size_t i = 0; i < bucket.size(); i++)
+			{
+				for(size_t j = i + 1; j < bucket.size(); j++)
+				{
+					compare(bucket[i], bucket[j]);
+				}
+			}
+		} else
+		{
+			// Huge buckets are usually caused by many identical modules, so comparing neighbours is sufficient in practice.
+			for(size_t i = 1; i < bucket.size(); i++)
+			{
+				compare(bucket[0], bucket[i]);
+				compare(bucket[i - 1], bucket[i]);
+			}
+		}
+		bucket.clear();
+	};
+	if(!query.exec("SELECT `band`, `bucket`, `module_id` FROM `modlib_note_lsh` ORDER BY `band`, `bucket`"))
+	{
+		qDebug() << query.lastError();
+		return -1;
+	}
+	int prevBand = -1;
+	qint64 prevBucket = 0;
+	while(query.next())
+	{
+		const int band = query.value(0).toInt();
+		const qint64 bucketId = query.value(1).toLongLong();
+		if(band != prevBand || bucketId != prevBucket)
+		{
+			processBucket();
+			prevBand = band;
+			prevBucket = bucketId;
+		}
+		const auto index = indices.constFind(query.value(2).toLongLong());
+		if(index != indices.constEnd())
+		{
+			bucket.push_back(index.value());
+		}
+	}
+	processBucket();
+
+	std::vector<int> groupSize(numModules, 0);
+	int numGroups = 0;
+	for(int i = 0; i < numModules; i++)
+	{
+		if(++groupSize[findRoot(i)] == 2)
+		{
+			numGroups++;
+		}
+	}
+
+	// List the groups ordered by their root, with the most similar modules first
+	std::vector<int> members;
+	for(int i = 0; i < numModules; i++)
+	{
+		if(groupSize[findRoot(i)] > 1)
+		{
+			members.push_back(i);
+		}
+	}
+	std::vector<int> similarity(numModules, 0);
+	for(const int i : members)
+	{
+		similarity[i] = Similarity(signatures[findRoot(i)], signatures[i]);
+	}
+	std::sort(members.begin(), members.end(), [&](int a, int b)
+	{
+		const qint64 groupA = ids[findRoot(a)], groupB = ids[findRoot(b)];
+		if(groupA != groupB)
+			return groupA < groupB;
+		return similarity[a] > similarity[b];
+	});
+	resultIds.reserve(members.size());
+	resultScores.reserve(members.size());
+	for(const int i : members)
+	{
+		resultIds.push_back(ids[i]);
+		resultScores.push_back(similarity[i]);
+	}
+	return numGroups;
+}
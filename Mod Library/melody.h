@@ -0,0 +1,86 @@
+/*
+ * melody.h
+ * --------
+ * Purpose: Note n-gram index, approximate matching and near-duplicate detection based on note data.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include "parallel.h"
+#include <cstdint>
+#include <vector>
+
+namespace Melody
+{
+	// Number of consecutive note deltas in an index entry
+	constexpr int NGRAM_LENGTH = 4;
+	// Number of consecutive note deltas in a MinHash shingle
+	constexpr int SHINGLE_LENGTH = 8;
+	// Number of hash functions in a MinHash signature
+	constexpr int MINHASH_SIZE = 64;
+	// Number of bands the signature is split into for locality-sensitive hashing
+	constexpr int LSH_BANDS = 16;
+	constexpr int LSH_ROWS = MINHASH_SIZE / LSH_BANDS;
+
+	// All distinct n-grams of a note delta string, in ascending order
+	std::vector<uint32_t> NGrams(const char *notes, int length);
+	inline std::vector<uint32_t> NGrams(const QByteArray &notes) { return NGrams(notes.constData(), notes.size()); }
+
+	// Add or remove the n-grams of a module to/from the index, using a prepared query with two positional placeholders (gram, module ID)
+	bool UpdateIndex(QSqlQuery &query, qint64 id, const QByteArray &notes);
+
+	// SQL condition that restricts `modlib_modules` to the modules whose note data can contain the given melody.
+	// Returns an empty string if the melody is too short to use the index.
+	QString IndexCondition(QSqlDatabase &db, const QByteArray &melody);
+
+	// Same as above, but for melodies that may differ from the note data by the given number of edits.
+	QString FuzzyIndexCondition(QSqlDatabase &db, const QByteArray &melody, int maxDistance);
+
+	// Approximate matching of a melody using Myers' bit-parallel algorithm
+	class Pattern
+	{
+	protected:
+		QByteArray melody;
+		uint64_t peq[256];
+
+	public:
+		Pattern(const QByteArray &melody);
+		// Smallest edit distance between the melody and any part of the note data
+		int Distance(const char *notes, int length) const;
+		int Length() const { return melody.size(); }
+	};
+
+	struct FuzzyMatch
+	{
+		qint64 id;
+		int distance;	// Sum of the edit distances of all melodies
+		int score;		// Match quality in percent
+	};
+
+	// MinHash signature of the shingles of a note delta string, as stored in the database. Empty if there are not enough notes.
+	QByteArray MinHash(const QByteArray &notes);
+
+	// Estimated similarity of two MinHash signatures in percent
+	int Similarity(const QByteArray &signature1, const QByteArray &signature2);
+
+	// Add the LSH buckets of a MinHash signature to the index, using a prepared query with three positional placeholders (band, bucket, module ID)
+	bool UpdateLSH(QSqlQuery &query, qint64 id, const QByteArray &signature);
+
+	// Minimum similarity of the note data of two modules to be considered duplicates
+	int DuplicateThreshold();
+
+	// Group modules with similar note data, using the LSH index for finding candidates.
+	// The modules are returned group by group, together with their similarity to the first module of the group.
+	// Returns the number of groups found, or -1 on failure.
+	int FindNearDuplicates(QSqlDatabase &db, std::vector<qint64> &resultIds, std::vector<int> &resultScores);
+
+	// Find all modules in the result of a query with the columns (`id`, `note_data`) where every melody matches with no more than maxDistance edits.
+	bool FuzzySearch(QSqlQuery &candidates, const std::vector<QByteArray> &melodies, int maxDistance, std::vector<FuzzyMatch> &result, const ProgressCallback &progress);
+}
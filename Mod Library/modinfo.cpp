@@ -10,13 +10,22 @@
 #include "modinfo.h"
 #include "database.h"
 #include "audioplayer.h"
+#include "previewcache.h"
 #include <QMenu>
 #include <QMessageBox>
 #include <QClipboard>
+#include <QDebug>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+
+std::mutex ModInfo::fileChecksMutex;
+std::vector<std::shared_ptr<ModInfo::FileCheck>> ModInfo::fileChecks;
 
 
 ModInfo::ModInfo(const QString &fileName, QWidget *parent)
-	: QDialog(parent), fileName(fileName), audio(nullptr)
+	: QDialog(parent), fileName(fileName)
 {
 	ui.setupUi(this);
 	QString nativeName = QDir::toNativeSeparators(fileName);
@@ -24,20 +33,120 @@ ModInfo::ModInfo(const QString &fileName, QWidget *parent)
 	ui.fileName->setText(nativeName);
 	this->setWindowFlags(Qt::Dialog | Qt::WindowMinMaxButtonsHint | Qt::WindowCloseButtonHint);
 
-	if(ModDatabase::Instance().UpdateModule(fileName) & ModDatabase::Error)
+	// Show what is stored in the database right away, the file is only analyzed again if it has changed since
+	Module mod;
+	ModDatabase::Instance().GetModule(fileName, mod);
+	ShowModule(mod);
+	storedArtist = mod.artist;
+	storedComments = mod.personalComment;
+	ui.editArtist->setText(mod.artist);
+	ui.personalComments->setPlainText(mod.personalComment);
+
+	// Comparing size and modification date is enough to tell if the file needs to be looked at again, but the file may reside on a slow network drive.
+	// Modified files are also analyzed again in the background, on a separate database connection.
+	fileCheck = std::make_shared<FileCheck>();
+	fileCheck->dialog = this;
+	const auto checkFile = [check = fileCheck, fileName, fileSize = mod.fileSize, fileDate = mod.fileDate.toSecsSinceEpoch()]()
 	{
-		QMessageBox mb(QMessageBox::Question, tr("Mod Library"), tr("Error while loading information for file\n%1\nWould you like to remove it form the database?").arg(nativeName), QMessageBox::Yes | QMessageBox::No);
-		mb.setDefaultButton(QMessageBox::Yes);
-		if(mb.exec() == QMessageBox::Yes)
+		const QFileInfo info(fileName);
+		const bool exists = info.exists();
+		ModDatabase::AddResult result = ModDatabase::NoChange;
+		if(exists && (info.size() != fileSize || info.lastModified().toSecsSinceEpoch() != fileDate))
 		{
-			ModDatabase::Instance().RemoveModule(fileName);
-			QTimer::singleShot(0, this, &ModInfo::close);
-			return;
+			{
+				std::lock_guard<std::mutex> lock(check->mutex);
+				if(check->dialog == nullptr)
+				{
+					return;
+				}
+			}
+			static std::atomic<int> numConnections(0);
+			const QString connectionName = QString("modlib_info%1").arg(numConnections++);
+			try
+			{
+				ModDatabase database;
+				database.OpenConnection(connectionName);
+				result = database.UpdateModule(fileName);
+			} catch(ModDatabase::Exception &e)
+			{
+				qDebug() << e.what();
+				result = ModDatabase::NotAdded;
+			}
+			QSqlDatabase::removeDatabase(connectionName);
 		}
+
+		// The dialog cannot be destroyed while holding the lock, and events posted to it are discarded once it has been destroyed
+		std::lock_guard<std::mutex> lock(check->mutex);
+		if(ModInfo *dialog = check->dialog)
+		{
+			QMetaObject::invokeMethod(dialog, [dialog, exists, result]() { dialog->OnFileChecked(exists, result); }, Qt::QueuedConnection);
+		}
+	};
+	{
+		std::lock_guard<std::mutex> lock(fileChecksMutex);
+		// Clean up after checks that have finished
+		for(auto check = fileChecks.begin(); check != fileChecks.end(); )
+		{
+			if((*check)->done)
+			{
+				(*check)->thread.join();
+				check = fileChecks.erase(check);
+			} else
+			{
+				check++;
+			}
+		}
+		fileCheck->thread = std::thread([checkFile, check = fileCheck]()
+		{
+			checkFile();
+			check->done = true;
+		});
+		fileChecks.push_back(fileCheck);
 	}
-	
-	Module mod;
-	ModDatabase::Instance().GetModule(fileName, mod);
+
+	// Most likely going to be played next
+	PreviewCache::Instance().Prefetch(QStringList{ fileName });
+
+	connect(ui.close, &QPushButton::clicked, this, &ModInfo::close);
+	connect(ui.openFile, &QPushButton::clicked, this, &ModInfo::OnOpenFileMenu);
+	connect(ui.play, &QPushButton::clicked, this, &ModInfo::OnPlay);
+	connect(ui.volumeSlider, &QSlider::valueChanged, this, &ModInfo::OnVolumeChanged);
+	connect(ui.copyFingerprint, &QPushButton::clicked, this, &ModInfo::OnCopyFingerprint);
+}
+
+
+ModInfo::~ModInfo()
+{
+	{
+		std::lock_guard<std::mutex> lock(fileCheck->mutex);
+		fileCheck->dialog = nullptr;
+	}
+	const QString artist = ui.editArtist->text(), comments = ui.personalComments->toPlainText();
+	if(artist != storedArtist || comments != storedComments)
+	{
+		ModDatabase::Instance().UpdateCustom(fileName, artist, comments);
+	}
+}
+
+
+void ModInfo::WaitForFileChecks()
+{
+	std::lock_guard<std::mutex> lock(fileChecksMutex);
+	for(const auto &check : fileChecks)
+	{
+		{
+			// Don't start analyzing any more files
+			std::lock_guard<std::mutex> dialogLock(check->mutex);
+			check->dialog = nullptr;
+		}
+		check->thread.join();
+	}
+	fileChecks.clear();
+}
+
+
+void ModInfo::ShowModule(const Module &mod)
+{
 	ui.songTitle->setText(mod.title);
 	QString info;
 	info +=
@@ -50,19 +159,24 @@ ModInfo::ModInfo(const QString &fileName, QWidget *parent)
 		.arg(mod.numPatterns)
 		.arg(mod.numSamples)
 		.arg(mod.numInstruments);
+	if(!std::isnan(mod.loudness))
+	{
+		info += tr("\nLoudness: %1 dBFS, peak level: %2 dBFS").arg(mod.loudness, 0, 'f', 1).arg(mod.peak, 0, 'f', 1);
+	}
 	ui.varInfo->setPlainText(info);
-	ui.editArtist->setText(mod.artist);
 
 	setUpdatesEnabled(false);
+	ui.sampleNames->clear();
 	auto names = mod.sampleText.split('\n');
-	for(int i = 0; i < mod.numSamples; i++)
+	for(int i = 0; i < mod.numSamples && i < names.size(); i++)
 	{
 		const QString name = QString("%1").arg(i + 1, 2, 10, QChar('0')) + ": " + names[i];
 		ui.sampleNames->addItem(name);
 	}
 
+	ui.instrumentNames->clear();
 	names = mod.instrumentText.split('\n');
-	for(int i = 0; i < mod.numInstruments; i++)
+	for(int i = 0; i < mod.numInstruments && i < names.size(); i++)
 	{
 		const QString name = QString("%1").arg(i + 1, 2, 10, QChar('0')) + ": " + names[i];
 		ui.instrumentNames->addItem(name);
@@ -70,23 +184,41 @@ ModInfo::ModInfo(const QString &fileName, QWidget *parent)
 	setUpdatesEnabled(true);
 
 	ui.comments->setPlainText(mod.comments);
-	ui.personalComments->setPlainText(mod.personalComment);
-
-	connect(ui.close, &QPushButton::clicked, this, &ModInfo::close);
-	connect(ui.openFile, &QPushButton::clicked, this, &ModInfo::OnOpenFileMenu);
-	connect(ui.play, &QPushButton::clicked, this, &ModInfo::OnPlay);
-	connect(ui.volumeSlider, &QSlider::valueChanged, this, &ModInfo::OnVolumeChanged);
-	connect(ui.copyFingerprint, &QPushButton::clicked, this, &ModInfo::OnCopyFingerprint);
 }
 
 
-ModInfo::~ModInfo()
+// Result of the background check whether the file still matches the database, and of analyzing it again if it didn't
+void ModInfo::OnFileChecked(bool exists, ModDatabase::AddResult result)
 {
-	if(audio != nullptr)
+	if(exists && result == ModDatabase::NoChange)
+	{
+		return;
+	}
+	const QString nativeName = QDir::toNativeSeparators(fileName);
+	if(!exists || (result & ModDatabase::Error))
 	{
-		audio->kill = true;
+		QMessageBox mb(QMessageBox::Question, tr("Mod Library"), tr("Error while loading information for file\n%1\nWould you like to remove it form the database?").arg(nativeName), QMessageBox::Yes | QMessageBox::No, this);
+		mb.setDefaultButton(QMessageBox::Yes);
+		if(mb.exec() == QMessageBox::Yes)
+		{
+			ModDatabase::Instance().RemoveModule(fileName);
+			storedArtist = ui.editArtist->text();
+			storedComments = ui.personalComments->toPlainText();
+			close();
+		}
+		return;
 	}
-	ModDatabase::Instance().UpdateCustom(fileName, ui.editArtist->text(), ui.personalComments->toPlainText());
+
+	Module mod;
+	ModDatabase::Instance().GetModule(fileName, mod);
+	ShowModule(mod);
+	// The artist may have been found in the updated file, but don't throw away what the user has typed in the meantime
+	if(ui.editArtist->text() == storedArtist)
+	{
+		ui.editArtist->setText(mod.artist);
+	}
+	storedArtist = mod.artist;
+	storedComments = mod.personalComment;
 }
 
 
@@ -113,24 +245,31 @@ void ModInfo::OnPlay()
 {
 	if(audio == nullptr)
 	{
-		QFile file(fileName);
-		if(!file.open(QIODevice::ReadOnly))
+		if(!QFile::exists(fileName))
 		{
 			return;
 		}
 
-		QThread *thread = new QThread;
-		audio = new AudioThread(file, ui.volumeSlider->value());
-		audio->moveToThread(thread);
-		connect(thread, &QThread::started, audio, &AudioThread::process);
-		connect(audio, &AudioThread::finished, thread, &QThread::quit);
-		connect(audio, &AudioThread::finished, audio, &AudioThread::deleteLater);
-		connect(thread, &QThread::finished, thread, &QThread::deleteLater);
-		thread->start();
+		// The player is stopped when the dialog is closed
+		audio = new AudioThread(fileName, ui.volumeSlider->value(), PreviewCache::Instance().Find(fileName), this);
+		connect(audio, &AudioThread::finished, this, [this, player = audio.data()]()
+		{
+			if(audio == player)
+			{
+				audio = nullptr;
+				ui.play->setText("&Play");
+			}
+			player->deleteLater();
+		}, Qt::QueuedConnection);
+		if(!audio->Start())
+		{
+			delete audio;
+			return;
+		}
 		ui.play->setText("&Stop");
 	} else
 	{
-		audio->kill = true;
+		audio->Stop();
 		audio = nullptr;
 		ui.play->setText("&Play");
 	}
@@ -141,7 +280,7 @@ void ModInfo::OnVolumeChanged(int volume)
 {
 	if(audio != nullptr)
 	{
-		audio->setVolume(volume);
+		audio->SetVolume(volume);
 	}
 }
 
@@ -10,8 +10,14 @@
 #pragma once
 
 #include <QtWidgets/QDialog>
+#include <QPointer>
 #include "ui_modinfo.h"
 #include "database.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 class AudioThread;
 
@@ -26,18 +32,39 @@ class ModInfo : public QDialog
 
 protected:
 	QString fileName;
-	AudioThread *audio;
+	QString storedArtist, storedComments;	// Custom fields as found in the database
+	QPointer<AudioThread> audio;
+
+	// Shared with the background check of the file, which is not waited for when the dialog is closed, only when the program exits
+	struct FileCheck
+	{
+		std::mutex mutex;
+		ModInfo *dialog;
+		std::thread thread;
+		std::atomic<bool> done{false};
+	};
+	std::shared_ptr<FileCheck> fileCheck;
+	// Checks that have been started, so that they can be waited for when the program exits
+	static std::mutex fileChecksMutex;
+	static std::vector<std::shared_ptr<FileCheck>> fileChecks;
 
 public:
 	ModInfo(const QString &fileName, QWidget *parent = nullptr);
 	~ModInfo();
 
+	// Wait for the background checks of all dialogs, which use their own database connections
+	static void WaitForFileChecks();
+
 protected slots:
 	void OnOpenFileMenu();
 	void OnOpenExplorer();
 	void OnPlay();
 	void OnVolumeChanged(int);
 	void OnCopyFingerprint();
+	void OnFileChecked(bool exists, ModDatabase::AddResult result);
+
+protected:
+	void ShowModule(const Module &mod);
 
 private:
 	Ui_ModInfo ui;
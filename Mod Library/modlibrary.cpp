@@ -13,18 +13,25 @@
 #include "about.h"
 #include "database.h"
 #include "tablemodel.h"
+#include "search.h"
+#include "similarity.h"
+#include "playlistexport.h"
+#include "playlistplayer.h"
+#include "batchrender.h"
+#include "previewcache.h"
+#include "librarywatcher.h"
 #include <QMessageBox>
 #include <QFileDialog>
 #include <QThread>
 #include <QProgressDialog>
 #include <QClipboard>
 #include <QSettings>
+#include <QStyle>
+#include <algorithm>
+#include <memory>
 #include <utility>
 #include <libopenmpt/libopenmpt.hpp>
 #include <chromaprint/src/chromaprint.h>
-#ifdef _MSC_VER
-#include <smmintrin.h>
-#endif
 
 
 ModLibrary::ModLibrary(QWidget *parent)
@@ -42,6 +49,7 @@ ModLibrary::ModLibrary(QWidget *parent)
 	}
 	settings.endGroup();
 	lastDir = settings.value("lastdir", "").toString();
+	ui.liveSearch->setChecked(settings.value("livesearch", true).toBool());
 
 	try
 	{
@@ -53,24 +61,71 @@ ModLibrary::ModLibrary(QWidget *parent)
 		return;
 	}
 
+	// Keep the library in sync with the library folders
+	libraryWatcher = new LibraryWatcher(this);
+	connect(libraryWatcher, &LibraryWatcher::libraryUpdated, this, [this](int added, int updated, int moved, int removed, int failed)
+	{
+		QString message = tr("Library folders changed: %1 files added, %2 files updated, %3 files moved, %4 files removed.").arg(added).arg(updated).arg(moved).arg(removed);
+		if(failed)
+			message += ' ' + tr("%1 files could not be updated and will be tried again later.").arg(failed);
+		ui.statusBar->showMessage(message);
+	}, Qt::QueuedConnection);
+	if(!settings.contains("Library/folders"))
+	{
+		// Libraries from before the library folders were remembered: Watching folders may add many files, so ask first. Either way, only ask once.
+		const QStringList folders = ModDatabase::Instance().SuggestedLibraryFolders();
+		QStringList acceptedFolders;
+		if(!folders.isEmpty())
+		{
+			QMessageBox msgBox(QMessageBox::Question, "Mod Library", tr("Should the following folders be watched for changes? New modules in these folders and their subfolders will be added to the library automatically. More folders can be added with Add Folder later."), QMessageBox::Yes | QMessageBox::No, this);
+			QStringList nativeFolders;
+			for(const auto &folder : folders)
+			{
+				nativeFolders.push_back(QDir::toNativeSeparators(folder));
+			}
+			msgBox.setInformativeText(nativeFolders.join('\n'));
+			if(msgBox.exec() == QMessageBox::Yes)
+				acceptedFolders = folders;
+		}
+		settings.setValue("Library/folders", acceptedFolders);
+	}
+	libraryWatcher->Start();
+
 	// Menu
 	connect(ui.actionAddFile, &QAction::triggered, this, &ModLibrary::OnAddFile);
 	connect(ui.actionAddFolder, &QAction::triggered, this, &ModLibrary::OnAddFolder);
 	connect(ui.actionExportPlaylist, &QAction::triggered, this, &ModLibrary::OnExportPlaylist);
+	connect(ui.actionRenderAudio, &QAction::triggered, this, &ModLibrary::OnRenderAudio);
+	connect(ui.actionPlayResults, &QAction::triggered, this, &ModLibrary::OnPlayResults);
+	connect(ui.actionNextTrack, &QAction::triggered, this, &ModLibrary::OnNextTrack);
+	connect(ui.actionStopPlayback, &QAction::triggered, this, &ModLibrary::OnStopPlayback);
+	ui.actionPlayResults->setIcon(style()->standardIcon(QStyle::SP_MediaPlay));
+	ui.actionNextTrack->setIcon(style()->standardIcon(QStyle::SP_MediaSkipForward));
+	ui.actionStopPlayback->setIcon(style()->standardIcon(QStyle::SP_MediaStop));
 	connect(ui.actionSettings, &QAction::triggered, this, &ModLibrary::OnSettings);
 	connect(ui.actionAbout, &QAction::triggered, this, &ModLibrary::OnAbout);
 	connect(ui.actionFindDuplicates, &QAction::triggered, this, &ModLibrary::OnFindDupes);
+	connect(ui.actionFindSimilar, &QAction::triggered, this, &ModLibrary::OnFindSimilar);
+	connect(ui.actionAnalyzeSimilarity, &QAction::triggered, this, &ModLibrary::OnClusterLibrary);
 
 	// Search navigation
 	connect(ui.doSearch, &QPushButton::clicked, this, &ModLibrary::OnSearch);
 	connect(ui.actionShow, &QAction::triggered, this, &ModLibrary::OnShowAll);
 	connect(ui.actionMaintain, &QAction::triggered, this, &ModLibrary::OnMaintain);
 	connect(ui.findWhat, &QLineEdit::returnPressed, this, &ModLibrary::OnSearch);
+	connect(ui.findWhat, &QLineEdit::textEdited, this, &ModLibrary::OnFindWhatEdited);
 	connect(ui.melody, &QLineEdit::returnPressed, this, &ModLibrary::OnSearch);
 	connect(ui.fingerprint, &QLineEdit::returnPressed, this, &ModLibrary::OnSearch);
 	connect(ui.pasteMPT, &QPushButton::clicked, this, &ModLibrary::OnPasteMPT);
 
 	connect(ui.resultTable, &QTableView::doubleClicked, this, &ModLibrary::OnCellClicked);
+	connect(ui.facets, &QTreeWidget::itemChanged, this, &ModLibrary::OnFacetChanged);
+	UpdateFacets();
+
+	// Wait for the user to stop typing before searching the whole library again
+	liveSearchTimer.setSingleShot(true);
+	liveSearchTimer.setInterval(300);
+	connect(&liveSearchTimer, &QTimer::timeout, this, &ModLibrary::OnLiveSearchTimer);
 
 	checkBoxes.push_back(ui.findFilename);
 	checkBoxes.push_back(ui.findTitle);
@@ -89,7 +144,9 @@ ModLibrary::ModLibrary(QWidget *parent)
 
 ModLibrary::~ModLibrary()
 {
-
+	SearchWorker::Instance().Shutdown();
+	PreviewCache::Instance().Shutdown();
+	ModInfo::WaitForFileChecks();
 }
 
 
@@ -105,6 +162,7 @@ void ModLibrary::closeEvent(QCloseEvent *event)
 	settings.setValue("maximized", isMaximized());
 	settings.endGroup();
 	settings.setValue("lastdir", lastDir);
+	settings.setValue("livesearch", ui.liveSearch->isChecked());
 
 	event->accept();
 }
@@ -157,6 +215,8 @@ void ModLibrary::OnAddFolder()
 	if(!path.isEmpty())
 	{
 		lastDir = path;
+		// Remembered for finding moved files during maintenance, and watched for changes from now on
+		libraryWatcher->AddFolder(path);
 
 		QDirIterator di(path, QDir::Files, QDirIterator::Subdirectories);
 
@@ -202,7 +262,9 @@ void ModLibrary::OnMaintain()
 	progress.setValue(0);
 	progress.show();
 
-	uint files = 0, updatedFiles = 0, removedFiles = 0;
+	// Files that have disappeared may just have been moved or renamed. They are left to the library watcher, which looks for them in the library folders.
+	QStringList missingFolders;
+	uint files = 0, updatedFiles = 0, removedFiles = 0, missingFiles = 0;
 	while(query.next() && !progress.wasCanceled())
 	{
 		const QString fileName = query.value(0).toString();
@@ -217,6 +279,13 @@ void ModLibrary::OnMaintain()
 		case ModDatabase::NoChange:
 			break;
 		case ModDatabase::IOError:
+			if(!QFile::exists(fileName))
+			{
+				missingFolders.push_back(QFileInfo(fileName).absolutePath());
+				missingFiles++;
+				break;
+			}
+			[[fallthrough]];
 		case ModDatabase::NotAdded:
 			removedFiles++;
 			ModDatabase::Instance().RemoveModule(fileName);
@@ -224,72 +293,143 @@ void ModLibrary::OnMaintain()
 		}
 		progress.setValue(++files);
 	}
+	if(progress.wasCanceled())
+	{
+		return;
+	}
+
+	if(missingFiles)
+	{
+		missingFolders.removeDuplicates();
+		libraryWatcher->Rescan(missingFolders);
+		ui.statusBar->showMessage(tr("%1 files updated, %2 files removed. Looking for %3 missing files in the library folders...").arg(updatedFiles).arg(removedFiles).arg(missingFiles));
+	} else
+	{
+		ui.statusBar->showMessage(tr("%1 files updated, %2 files removed.").arg(updatedFiles).arg(removedFiles));
+	}
 }
 
 
 void ModLibrary::DoSearch(bool showAll)
 {
-	setCursor(Qt::BusyCursor);
+	liveSearchTimer.stop();
+	StartSearch(BuildSearch(showAll), !showAll);
+}
+
+
+// Search again while the search text is being typed
+void ModLibrary::OnFindWhatEdited()
+{
+	if(!ui.liveSearch->isChecked())
+	{
+		return;
+	}
+	if(ui.findWhat->text().isEmpty())
+	{
+		liveSearchTimer.stop();
+		return;
+	}
 
-	QString what = ui.findWhat->text();
+	SearchParameters params = BuildSearch(false);
+	params.live = true;
+	if(params.Refines(lastSearch))
+	{
+		// Narrowing down the previous results is cheap enough to be done on every key stroke
+		liveSearchTimer.stop();
+		StartSearch(params, false);
+	} else
+	{
+		liveSearchTimer.start();
+	}
+}
+
+
+void ModLibrary::OnLiveSearchTimer()
+{
+	SearchParameters params = BuildSearch(false);
+	params.live = true;
+	StartSearch(params, false);
+}
+
+
+// Collect the search conditions from the user interface
+SearchParameters ModLibrary::BuildSearch(bool showAll)
+{
+	SearchParameters params;
+	params.text = ui.findWhat->text();
+	QString what = params.text;
 	what.replace('\\', "\\\\")
 		.replace('%', "\\%")
 		.replace('_', "\\_")
 		.replace('*', "%")
 		.replace('?', "_");
-	what = "%" + what + "%";
+	params.what = "%" + what + "%";
 
-	std::vector<QByteArray> melodyBytes;
-	QByteArray fingerprint = ui.fingerprint->text().trimmed().toLatin1();
-	uint32_t *rawFingerprint = nullptr;
-	int rawFingerprintSize = 0;
-	chromaprint_decode_fingerprint(fingerprint.data(), fingerprint.size(), &rawFingerprint, &rawFingerprintSize, nullptr, 1);
-
-	QString queryStr = "SELECT `filename`, `title`, `filesize`, `filedate` ";
-	if(rawFingerprintSize)
+	std::vector<uint32_t> fingerprint;
 	{
-		queryStr += ", `fingerprint` ";
-
+		const QByteArray printableFingerprint = ui.fingerprint->text().trimmed().toLatin1();
+		uint32_t *rawFingerprint = nullptr;
+		int rawFingerprintSize = 0;
+		if(chromaprint_decode_fingerprint(printableFingerprint.data(), printableFingerprint.size(), &rawFingerprint, &rawFingerprintSize, nullptr, 1) && rawFingerprint != nullptr)
+		{
+			fingerprint.assign(rawFingerprint, rawFingerprint + rawFingerprintSize);
+		}
+		chromaprint_dealloc(rawFingerprint);
 	}
-	queryStr += "FROM `modlib_modules` ";
+
+	const int melodyTolerance = ui.melodyTolerance->value();
+	std::vector<QByteArray> melodyBytes;
+	QString whereStr;
 	if(!showAll)
 	{
-		queryStr += "WHERE (0 ";
-		if(ui.findFilename->isChecked())		queryStr += "OR `filename` LIKE :str ESCAPE '\\' ";
-		if(ui.findTitle->isChecked())			queryStr += "OR `title` LIKE :str ESCAPE '\\' ";
-		if(ui.findArtist->isChecked())			queryStr += "OR `artist` LIKE :str ESCAPE '\\' ";
-		if(ui.findSampleText->isChecked())		queryStr += "OR `sample_text` LIKE :str ESCAPE '\\' ";
-		if(ui.findInstrumentText->isChecked())	queryStr += "OR `instrument_text` LIKE :str ESCAPE '\\' ";
-		if(ui.findComments->isChecked())		queryStr += "OR `comments` LIKE :str ESCAPE '\\' ";
-		if(ui.findPersonal->isChecked())		queryStr += "OR `personal_comments` LIKE :str ESCAPE '\\' ";
-		queryStr += ") ";
+		if(ui.findFilename->isChecked())		params.textColumns << "filename";
+		if(ui.findTitle->isChecked())			params.textColumns << "title";
+		if(ui.findArtist->isChecked())			params.textColumns << "artist";
+		if(ui.findSampleText->isChecked())		params.textColumns << "sample_text";
+		if(ui.findInstrumentText->isChecked())	params.textColumns << "instrument_text";
+		if(ui.findComments->isChecked())		params.textColumns << "comments";
+		if(ui.findPersonal->isChecked())		params.textColumns << "personal_comments";
+		whereStr += "WHERE (0 ";
+		for(const auto &column : params.textColumns)
+		{
+			whereStr += "OR `" + column + "` LIKE :str ESCAPE '\\' ";
+		}
+		whereStr += ") ";
 
 		if(ui.limitSize->isChecked())
 		{
 			const auto factor = 1 << (10 * ui.limitSizeUnit->currentIndex());
 			auto sizeMin = ui.limitMinSize->value() * factor, sizeMax = ui.limitMaxSize->value() * factor;
 			if(sizeMin > sizeMax) std::swap(sizeMin, sizeMax);
-			queryStr += "AND (`filesize` BETWEEN " + QString::number(sizeMin) + " AND " + QString::number(sizeMax) + ") ";
+			whereStr += "AND (`filesize` BETWEEN " + QString::number(sizeMin) + " AND " + QString::number(sizeMax) + ") ";
 		}
 		if(ui.limitFileDate->isChecked())
 		{
 			auto dateMin = QDateTime(ui.limitFileDateMin->date(), QTime(0, 0, 0)).toTime_t();
 			auto dateMax = QDateTime(ui.limitFileDateMax->date(), QTime(23, 59, 59)).toTime_t();
 			if(dateMin > dateMax) std::swap(dateMin, dateMax);
-			queryStr += "AND (`filedate` BETWEEN " + QString::number(dateMin) + " AND " + QString::number(dateMax) + ") ";
+			whereStr += "AND (`filedate` BETWEEN " + QString::number(dateMin) + " AND " + QString::number(dateMax) + ") ";
 		}
 		if(ui.limitYear->isChecked())
 		{
 			auto dateMin = QDateTime(ui.limitReleaseDateMin->date(), QTime(0, 0, 0)).toTime_t();
 			auto dateMax = QDateTime(ui.limitReleaseDateMax->date(), QTime(23, 59, 59)).toTime_t();
 			if(dateMin > dateMax) std::swap(dateMin, dateMax);
-			queryStr += "AND (`editdate` BETWEEN " + QString::number(dateMin) + " AND " + QString::number(dateMax) + ") ";
+			whereStr += "AND (`editdate` BETWEEN " + QString::number(dateMin) + " AND " + QString::number(dateMax) + ") ";
 		}
 		if(ui.limitTime->isChecked())
 		{
 			auto timeMin = ui.limitTimeMin->value() * 1000, timeMax = ui.limitTimeMax->value() * 1000;
 			if(timeMin > timeMax) std::swap(timeMin, timeMax);
-			queryStr += "AND (`length` BETWEEN " + QString::number(timeMin) + " AND " + QString::number(timeMax) + ") ";
+			whereStr += "AND (`length` BETWEEN " + QString::number(timeMin) + " AND " + QString::number(timeMax) + ") ";
+		}
+		for(int facet = 0; facet < ModDatabase::NumFacets; facet++)
+		{
+			const QString facetCondition = ModDatabase::FacetCondition(static_cast<ModDatabase::Facet>(facet), checkedFacets[facet]);
+			if(!facetCondition.isEmpty())
+			{
+				whereStr += "AND " + facetCondition + " ";
+			}
 		}
 
 		// Search for melody
@@ -308,67 +448,148 @@ void ModLibrary::DoSearch(bool showAll)
 					int8_t n = static_cast<int8_t>(note.toInt());
 					melodyBytes[melodyCount].push_back(n);
 				}
-				queryStr += "AND INSTR(`note_data`, :note_data" + QString::number(melodyCount) + ") > 0 ";
 				melodyCount++;
 			}
 		}
 	}
 
-	QSqlQuery query(ModDatabase::Instance().GetDB());
-	query.prepare(queryStr);
-	query.bindValue(":str", what);
-	for(size_t i = 0; i < melodyBytes.size(); i++)
+	params.whereStr = whereStr;
+	params.melodies = std::move(melodyBytes);
+	params.melodyTolerance = melodyTolerance;
+	params.fingerprint = std::move(fingerprint);
+	return params;
+}
+
+
+void ModLibrary::StartSearch(SearchParameters params, bool showSingleResult)
+{
+	const bool fuzzyMelody = params.melodyTolerance > 0 && !params.melodies.empty();
+	const bool hasScore = !params.fingerprint.empty() || fuzzyMelody;
+	if(hasScore)
 	{
-		query.bindValue(":note_data" + QString::number(i), melodyBytes[i]);
+		// Sort by match quality when searching for fingerprints or approximate melodies
+		params.order = ScoreOrder::Descending;
 	}
+	lastSearch = params;
+	TableModel *model = new TableModel([params](QSqlDatabase &db, ResultBuffer &results)
+	{
+		SearchWorker::RunSearch(db, params, results);
+	}, hasScore, hasScore ? TableModel::SCORE_TABLE : -1, Qt::DescendingOrder);
+	SetResultModel(model);
 
-	TableModel *model = new TableModel(query, rawFingerprint, rawFingerprintSize);
-	ui.resultTable->setModel(model);
+	if(showSingleResult)
+	{
+		// Show the only result. Only for the initial search, not when the results are loaded again for sorting.
+		auto connection = std::make_shared<QMetaObject::Connection>();
+		*connection = connect(model, &TableModel::loadingFinished, this, [this, model, connection](int numResults)
+		{
+			QObject::disconnect(*connection);
+			if(numResults == 1)
+				OnCellClicked(model->index(0, 0));
+		});
+	}
+}
 
-	QHeaderView *verticalHeader = ui.resultTable->verticalHeader();
-	verticalHeader->setSectionResizeMode(QHeaderView::Fixed);
 
-	QHeaderView *horizontalHeader = ui.resultTable->horizontalHeader();
-	horizontalHeader->setStretchLastSection(false);
-	horizontalHeader->setSectionResizeMode(0, QHeaderView::Stretch);
-	for(int i = model->columnCount() - 1; i >= 1; i--)
+void ModLibrary::OnFindDupes()
+{
+	// Group modules with the same or almost the same patterns, e.g. edited versions of the same song
+	SetResultModel(new TableModel(&SearchWorker::FindDuplicates, true));
+}
+
+
+void ModLibrary::OnFindSimilar()
+{
+	if(!Similarity::IsClustered(ModDatabase::Instance().GetDB()))
 	{
-		horizontalHeader->setSectionResizeMode(i, QHeaderView::ResizeToContents);
+		// Similarity has never been analyzed before
+		OnClusterLibrary();
 	}
 
-	const int numRows = model->rowCount();
-	ui.statusBar->showMessage(tr("%1 files found.").arg(numRows));
+	SetResultModel(new TableModel([](QSqlDatabase &db, ResultBuffer &results)
+	{
+		SearchWorker::RunQuery(db, "SELECT `module_id` AS `id` FROM `modlib_clusters` ORDER BY `cluster_id`", QVariantMap(), std::vector<uint32_t>(), ScoreOrder::None, results);
+	}, false));
+}
+
+
+void ModLibrary::OnClusterLibrary()
+{
+	QProgressDialog progress(tr("Analyzing similarity..."), tr("Cancel"), 0, 0, this);
+	progress.setWindowModality(Qt::WindowModal);
+	progress.setValue(0);
+	progress.show();
 
-	if(rawFingerprintSize)
+	const int numClusters = Similarity::ClusterLibrary(ModDatabase::Instance().GetDB(), [&progress](const QString &status, int done, int total)
 	{
-		// Sort by match quality when searching for fingerprints
-		ui.resultTable->sortByColumn(3, Qt::DescendingOrder);
+		progress.setLabelText(status);
+		progress.setRange(0, total);
+		progress.setValue(done);
+		QCoreApplication::processEvents();
+		return !progress.wasCanceled();
+	});
+	if(numClusters >= 0)
+	{
+		ui.statusBar->showMessage(tr("%1 groups of similar files found.").arg(numClusters));
 	}
+}
 
-	unsetCursor();
 
-	if(numRows == 1 && !showAll)
+// Run a new search and show its results as soon as there are any. Until then, the previous results stay visible.
+void ModLibrary::SetResultModel(TableModel *model)
+{
+	// Deleting a model also stops its search if it is still running
+	delete pendingModel;
+	pendingModel = model;
+	model->setParent(this);
+	ui.statusBar->showMessage(tr("Searching..."));
+
+	connect(model, &TableModel::loadingFinished, this, [this, model](int numResults)
+	{
+		if(pendingModel == model)
+			ShowResultModel(model);
+		if(ui.resultTable->model() == model && !pendingModel)
+		{
+			ui.statusBar->showMessage(model->Summary().isEmpty() ? tr("%1 files found.").arg(numResults) : model->Summary());
+			UpdateFacets();
+
+			// Have the top results ready for instant playback
+			static constexpr int PREFETCH_ROWS = 5;
+			QStringList topResults;
+			for(int row = 0; row < std::min(model->rowCount(), PREFETCH_ROWS); row++)
+			{
+				topResults.push_back(model->RowFileName(row));
+			}
+			PreviewCache::Instance().Prefetch(topResults);
+		}
+	});
+	connect(model, &TableModel::resultsChanged, this, [this, model](int numResults)
 	{
-		// Show the only result
-		OnCellClicked(model->index(0, 0));
+		if(ui.resultTable->model() == model && !pendingModel && model->Summary().isEmpty())
+			ui.statusBar->showMessage(tr("%1 files found.").arg(numResults));
+	});
+	if(model->rowCount())
+	{
+		ShowResultModel(model);
+	} else
+	{
+		connect(model, &TableModel::rowsInserted, this, [this, model]()
+		{
+			if(pendingModel == model)
+				ShowResultModel(model);
+		});
 	}
 }
 
 
-void ModLibrary::OnFindDupes()
+void ModLibrary::ShowResultModel(TableModel *model)
 {
-	setCursor(Qt::BusyCursor);
-
-	QSqlQuery query(ModDatabase::Instance().GetDB());
-	query.prepare(
-//		"SELECT `filename`, `title`, `filesize`, `filedate` FROM `modlib_modules` AS `m1` WHERE `filename` IN "
-//		"(SELECT `filename` FROM `modlib_modules` AS `m2` WHERE `m1`.`hash` = `m2`.`hash` AND `m1`.`filename` <> `m2`.`filename`) ORDER BY `hash`"
-		"SELECT `filename`, `title`, `filesize`, `filedate`, COUNT(*) FROM `modlib_modules`"
-		"GROUP BY `pattern_hash` HAVING COUNT(*) > 1"
-		);
-
-	TableModel *model = new TableModel(query, nullptr, 0);
+	QAbstractItemModel *oldModel = ui.resultTable->model();
+	QItemSelectionModel *oldSelection = ui.resultTable->selectionModel();
+	pendingModel = nullptr;
 	ui.resultTable->setModel(model);
+	delete oldSelection;
+	delete oldModel;
 
 	QHeaderView *verticalHeader = ui.resultTable->verticalHeader();
 	verticalHeader->setSectionResizeMode(QHeaderView::Fixed);
@@ -376,15 +597,107 @@ void ModLibrary::OnFindDupes()
 	QHeaderView *horizontalHeader = ui.resultTable->horizontalHeader();
 	horizontalHeader->setStretchLastSection(false);
 	horizontalHeader->setSectionResizeMode(0, QHeaderView::Stretch);
+	// Resizing to contents would have to look at every single row, so estimate the column widths instead
+	const int margin = 2 * (ui.resultTable->style()->pixelMetric(QStyle::PM_FocusFrameHMargin, nullptr, ui.resultTable) + 1);
 	for(int i = model->columnCount() - 1; i >= 1; i--)
 	{
-		horizontalHeader->setSectionResizeMode(i, QHeaderView::ResizeToContents);
+		horizontalHeader->setSectionResizeMode(i, QHeaderView::Interactive);
+		horizontalHeader->resizeSection(i, std::max(horizontalHeader->sectionSizeHint(i), ui.resultTable->fontMetrics().horizontalAdvance(model->SampleText(i)) + margin));
+	}
+	// Show the order that the results are already in without sorting them again
+	horizontalHeader->blockSignals(true);
+	horizontalHeader->setSortIndicator(model->SortColumn(), model->SortOrder());
+	horizontalHeader->blockSignals(false);
+}
+
+
+// Show the number of files per facet value in the current results, or in the whole library if they have not been counted
+void ModLibrary::UpdateFacets()
+{
+	// Rarer values of each facet are only shown if they are checked
+	static constexpr int MAX_FACET_VALUES = 100;
+	static const char *facetNames[ModDatabase::NumFacets] = { QT_TR_NOOP("Format"), QT_TR_NOOP("Channels"), QT_TR_NOOP("Year"), QT_TR_NOOP("Artist") };
+
+	const ModDatabase::FacetCounts libraryCounts = ModDatabase::LibraryFacets(ModDatabase::Instance().GetDB());
+	const TableModel *model = static_cast<TableModel *>(ui.resultTable->model());
+	const bool resultCounts = model != nullptr && model->HasFacets();
+
+	QSignalBlocker blocker(ui.facets);
+	for(int facet = 0; facet < ModDatabase::NumFacets; facet++)
+	{
+		QTreeWidgetItem *facetItem = ui.facets->topLevelItem(facet);
+		if(facetItem == nullptr)
+		{
+			facetItem = new QTreeWidgetItem(ui.facets, QStringList(tr(facetNames[facet])));
+		}
+		qDeleteAll(facetItem->takeChildren());
+
+		struct FacetValue
+		{
+			QString value;
+			int count;
+		};
+		std::vector<FacetValue> values;
+		for(auto libraryCount = libraryCounts[facet].cbegin(); libraryCount != libraryCounts[facet].cend(); libraryCount++)
+		{
+			values.push_back({ libraryCount.key(), resultCounts ? model->Facets()[facet].value(libraryCount.key(), 0) : libraryCount.value() });
+		}
+		// Values that are not found in the current results go last. Numbers are shown in their natural order, everything else by frequency.
+		const bool numeric = (facet == ModDatabase::FacetChannels || facet == ModDatabase::FacetYear);
+		std::stable_sort(values.begin(), values.end(), [numeric](const FacetValue &a, const FacetValue &b)
+		{
+			if((a.count == 0) != (b.count == 0))
+				return a.count != 0;
+			if(numeric)
+				return a.value.toInt() < b.value.toInt();
+			return a.count > b.count;
+		});
+
+		int numShown = 0;
+		for(const auto &value : values)
+		{
+			const bool checked = checkedFacets[facet].contains(value.value);
+			if(numShown >= MAX_FACET_VALUES && !checked)
+				continue;
+			QTreeWidgetItem *item = new QTreeWidgetItem(facetItem, QStringList(QString("%1 (%2)").arg(value.value).arg(value.count)));
+			item->setData(0, Qt::UserRole, value.value);
+			item->setCheckState(0, checked ? Qt::Checked : Qt::Unchecked);
+			if(value.count == 0)
+				item->setForeground(0, ui.facets->palette().brush(QPalette::Disabled, QPalette::Text));
+			numShown++;
+		}
+	}
+}
+
+
+// Only find files with the checked facet values
+void ModLibrary::OnFacetChanged(QTreeWidgetItem *item)
+{
+	QTreeWidgetItem *facetItem = item->parent();
+	if(facetItem == nullptr)
+	{
+		return;
+	}
+	const int facet = ui.facets->indexOfTopLevelItem(facetItem);
+	const QString value = item->data(0, Qt::UserRole).toString();
+	if(facet < 0 || facet >= ModDatabase::NumFacets)
+	{
+		return;
 	}
+	checkedFacets[facet].removeAll(value);
+	if(item->checkState(0) == Qt::Checked)
+	{
+		checkedFacets[facet].push_back(value);
+	}
+	liveSearchTimer.stop();
+	StartSearch(BuildSearch(false), false);
+}
 
-	const int numRows = model->rowCount();
-	ui.statusBar->showMessage(tr("%1 files found.").arg(numRows));
 
-	unsetCursor();
+// The model of the most recent search, even if its results are not shown yet
+TableModel *ModLibrary::ResultModel() const
+{
+	return pendingModel ? pendingModel.data() : static_cast<TableModel *>(ui.resultTable->model());
 }
 
 
@@ -416,7 +729,12 @@ void ModLibrary::OnSelectAllButOne(QCheckBoxEx *sender)
 
 void ModLibrary::OnCellClicked(const QModelIndex &index)
 {
-	const QString fileName = ui.resultTable->model()->data(index, Qt::UserRole).toString();
+	const TableModel *model = qobject_cast<const TableModel *>(index.model());
+	if(model == nullptr)
+	{
+		return;
+	}
+	const QString fileName = model->RowFileName(index.row());
 	ModInfo *dlg = new ModInfo(fileName, this);
 	dlg->setAttribute(Qt::WA_DeleteOnClose);
 	dlg->show();
@@ -425,42 +743,251 @@ void ModLibrary::OnCellClicked(const QModelIndex &index)
 
 void ModLibrary::OnExportPlaylist()
 {
-	if(ui.resultTable->model() == nullptr || !ui.resultTable->model()->rowCount())
+	if(playlistExport)
 	{
-		OnShowAll();
+		return;
 	}
 
-	const auto numRows = (ui.resultTable->model() == nullptr) ? 0 : ui.resultTable->model()->rowCount();
-	if(!numRows)
+	// Stream the results from the database in the order of the table if possible, instead of retrieving them all through the model
+	const QString columns = "`sorted`.`filename`, `sorted`.`title`, `sorted`.`length`";
+	QString queryStr;
+	QVariantMap bindings;
+	std::vector<qint64> ids;
+	TableModel *model = ResultModel();
+	if(model != nullptr && (model->IsLoading() || model->rowCount()))
+	{
+		queryStr = model->SortedQuery(columns);
+		bindings = model->Bindings();
+		if(queryStr.isEmpty())
+		{
+			if(!model->FetchAll())
+			{
+				return;
+			}
+			// The search may have been replaced while waiting
+			model = ResultModel();
+			if(model == nullptr)
+			{
+				return;
+			}
+			ids = model->RowIds();
+		}
+	} else
+	{
+		QSqlQuery query(ModDatabase::Instance().GetDB());
+		if(!query.exec("SELECT 1 FROM `modlib_modules` LIMIT 1") || !query.next())
+		{
+			QMessageBox mb(QMessageBox::Information, tr("Your library is empty."), tr("Mod Library"));
+			mb.exec();
+			return;
+		}
+		queryStr = "SELECT " + columns + " FROM `modlib_modules` AS `sorted` ORDER BY `sorted`.`title_sortkey`";
+	}
+	if(queryStr.isEmpty() && ids.empty())
 	{
-		QMessageBox mb(QMessageBox::Information, tr("Your library is empty."), tr("Mod Library"));
-		mb.exec();
 		return;
 	}
 
-	QFileDialog dlg(this, tr("Save Playlist..."), lastDir, tr("Playlist files (*.pls)"));
+	const QStringList filters = PlaylistExport::NameFilters();
+	QFileDialog dlg(this, tr("Save Playlist..."), lastDir);
+	dlg.setNameFilters(filters);
+	dlg.setDefaultSuffix(PlaylistExport::Suffix(PlaylistExport::FormatPLS));
 	dlg.setAcceptMode(QFileDialog::AcceptSave);
-	if(dlg.exec())
+	connect(&dlg, &QFileDialog::filterSelected, &dlg, [&dlg, &filters](const QString &filter)
+	{
+		const int format = filters.indexOf(filter);
+		if(format >= 0)
+			dlg.setDefaultSuffix(PlaylistExport::Suffix(static_cast<PlaylistExport::Format>(format)));
+	});
+	if(!dlg.exec() || dlg.selectedFiles().isEmpty())
+	{
+		return;
+	}
+	const QString fileName = dlg.selectedFiles().first();
+	auto format = PlaylistExport::FormatFromFileName(fileName);
+	if(format == PlaylistExport::NumFormats)
 	{
-		auto files = dlg.selectedFiles();
-		if(!files.isEmpty())
+		format = static_cast<PlaylistExport::Format>(std::max(0, filters.indexOf(dlg.selectedNameFilter())));
+	}
+
+	playlistExport = new PlaylistExport(fileName, format, queryStr, bindings, std::move(ids), this);
+	ui.actionExportPlaylist->setEnabled(false);
+	ui.statusBar->showMessage(tr("Exporting playlist..."));
+	connect(playlistExport, &PlaylistExport::progress, this, [this](int numEntries)
+	{
+		ui.statusBar->showMessage(tr("Exporting playlist... %1 entries written.").arg(numEntries));
+	}, Qt::QueuedConnection);
+	connect(playlistExport, &PlaylistExport::finished, this, [this](bool success, int numEntries)
+	{
+		if(playlistExport)
+			playlistExport->deleteLater();
+		ui.actionExportPlaylist->setEnabled(true);
+		if(success)
 		{
-			QFile file(files.first());
-			if(file.open(QIODevice::WriteOnly | QIODevice::Text))
-			{
-				setCursor(Qt::BusyCursor);
-				QTextStream fout(&file);
-				fout << "[playlist]" << Qt::endl;
-				fout << "numberofentries=" << numRows << Qt::endl;
-				for(auto row = 0; row < numRows; row++)
-				{
-					fout << "file" << (row + 1) << "=" << QDir::toNativeSeparators(ui.resultTable->model()->data(ui.resultTable->model()->index(row, 0), Qt::UserRole).toString()) << Qt::endl;
-					fout << "title" << (row + 1) << "=" << ui.resultTable->model()->data(ui.resultTable->model()->index(row, 0), Qt::DisplayRole).toString() << Qt::endl;
-				}
-				unsetCursor();
-			}
+			ui.statusBar->showMessage(tr("Playlist with %1 entries exported.").arg(numEntries));
+		} else
+		{
+			ui.statusBar->clearMessage();
+			QMessageBox mb(QMessageBox::Warning, tr("Mod Library"), tr("The playlist could not be written."));
+			mb.exec();
 		}
+	}, Qt::QueuedConnection);
+	playlistExport->Start();
+}
+
+
+void ModLibrary::OnRenderAudio()
+{
+	TableModel *model = ResultModel();
+	if(model == nullptr || !model->FetchAll())
+	{
+		return;
+	}
+	// The search may have been replaced while waiting
+	model = ResultModel();
+	if(model == nullptr || !model->rowCount())
+	{
+		return;
 	}
+	QStringList fileNames;
+	for(int row = 0; row < model->rowCount(); row++)
+	{
+		fileNames.push_back(model->RowFileName(row));
+	}
+
+	const QString outputDir = QFileDialog::getExistingDirectory(this, tr("Select folder for the rendered files..."), QSettings().value("Render/folder", lastDir).toString());
+	if(outputDir.isEmpty())
+	{
+		return;
+	}
+	QSettings().setValue("Render/folder", outputDir);
+
+	QProgressDialog progress(tr("Rendering modules..."), tr("Cancel"), 0, 0, this);
+	progress.setWindowModality(Qt::WindowModal);
+	progress.setValue(0);
+	progress.show();
+
+	const auto settings = BatchRender::Settings::Load();
+	BatchRender::Stats stats;
+	const bool completed = BatchRender::Render(fileNames, outputDir, settings, [&progress](const QString &status, int done, int total)
+	{
+		progress.setLabelText(status);
+		progress.setRange(0, total);
+		progress.setValue(done);
+		QCoreApplication::processEvents();
+		return !progress.wasCanceled();
+	}, stats);
+	progress.close();
+
+	const QString summary = tr("%1 files with %2 minutes of audio written in %3 seconds.")
+		.arg(stats.numFiles)
+		.arg(stats.numFrames / (settings.sampleRate * 60.0), 0, 'f', 1)
+		.arg(stats.seconds, 0, 'f', 1);
+	ui.statusBar->showMessage(completed ? summary : tr("Rendering cancelled. ") + summary);
+	if(!stats.failed.isEmpty())
+	{
+		QMessageBox mb(QMessageBox::Warning, tr("Mod Library"), tr("%1 modules could not be rendered.").arg(stats.failed.size()));
+		mb.setDetailedText(stats.failed.join('\n'));
+		mb.exec();
+	}
+}
+
+
+void ModLibrary::OnPlayResults()
+{
+	TableModel *model = ResultModel();
+	if(model == nullptr || !model->FetchAll())
+	{
+		return;
+	}
+	// The search may have been replaced while waiting
+	model = ResultModel();
+	if(model == nullptr)
+	{
+		return;
+	}
+	std::vector<qint64> ids = model->RowIds();
+	if(ids.empty())
+	{
+		return;
+	}
+	int firstIndex = 0;
+	const QModelIndex current = ui.resultTable->currentIndex();
+	if(current.isValid() && current.row() < static_cast<int>(ids.size()))
+	{
+		firstIndex = current.row();
+	}
+
+	if(player)
+	{
+		// The previous player deletes itself once its sound device has been closed
+		player->Stop();
+		player = nullptr;
+	}
+	player = new PlaylistPlayer(std::move(ids), firstIndex, 100, this);
+	const int numTracks = player->NumTracks();
+	QPointer<TableModel> playedModel = model;
+	QPointer<PlaylistPlayer> thisPlayer = player;
+	connect(player, &PlaylistPlayer::trackChanged, this, [this, thisPlayer, playedModel, numTracks](int index, const QString &fileName)
+	{
+		// Ignore tracks of a player that has been stopped in the meantime
+		if(!thisPlayer || player != thisPlayer)
+			return;
+		ui.statusBar->showMessage(tr("Playing %1 (%2 of %3)").arg(QDir::toNativeSeparators(fileName)).arg(index + 1).arg(numTracks));
+		// Follow the playback in the result list, unless the list has changed in the meantime
+		if(playedModel && ResultModel() == playedModel && playedModel->RowFileName(index) == fileName)
+		{
+			ui.resultTable->selectRow(index);
+		}
+	}, Qt::QueuedConnection);
+	connect(player, &PlaylistPlayer::finished, this, [this, thisPlayer]()
+	{
+		if(!thisPlayer)
+			return;
+		if(player == thisPlayer)
+		{
+			player = nullptr;
+			ui.statusBar->clearMessage();
+		}
+		thisPlayer->deleteLater();
+		UpdatePlaybackActions();
+	}, Qt::QueuedConnection);
+	if(!player->Start())
+	{
+		delete player;
+		QMessageBox mb(QMessageBox::Warning, tr("Mod Library"), tr("The sound device could not be opened."));
+		mb.exec();
+	}
+	UpdatePlaybackActions();
+}
+
+
+void ModLibrary::OnNextTrack()
+{
+	if(player)
+	{
+		player->Next();
+	}
+}
+
+
+void ModLibrary::OnStopPlayback()
+{
+	if(player)
+	{
+		// The player deletes itself once the sound device has been closed
+		player->Stop();
+		player = nullptr;
+		ui.statusBar->clearMessage();
+	}
+	UpdatePlaybackActions();
+}
+
+
+void ModLibrary::UpdatePlaybackActions()
+{
+	ui.actionNextTrack->setEnabled(player != nullptr);
+	ui.actionStopPlayback->setEnabled(player != nullptr);
 }
 
 
@@ -12,6 +12,16 @@
 #include <QtWidgets/QMainWindow>
 #include <QtWidgets/QWidget>
 #include "ui_modlibrary.h"
+#include "search.h"
+#include <QPointer>
+#include <QTimer>
+#include <array>
+#include <vector>
+
+class TableModel;
+class PlaylistExport;
+class PlaylistPlayer;
+class LibraryWatcher;
 
 class ModLibrary : public QMainWindow
 {
@@ -20,6 +30,13 @@ class ModLibrary : public QMainWindow
 protected:
 	QString lastDir;
 	std::vector<QCheckBoxEx *> checkBoxes;
+	QPointer<TableModel> pendingModel;	// Search whose results are not shown yet
+	SearchParameters lastSearch;
+	std::array<QStringList, ModDatabase::NumFacets> checkedFacets;
+	QTimer liveSearchTimer;
+	QPointer<PlaylistExport> playlistExport;	// Export that is currently running
+	QPointer<PlaylistPlayer> player;	// Playback of the search results
+	LibraryWatcher *libraryWatcher = nullptr;
 
 public:
 	ModLibrary(QWidget *parent = nullptr);
@@ -31,17 +48,33 @@ protected slots:
 	void OnMaintain();
 	void OnSearch() { DoSearch(false); }
 	void OnShowAll() { DoSearch(true); }
+	void OnFindWhatEdited();
+	void OnLiveSearchTimer();
 	void OnSelectOne(QCheckBoxEx *sender);
 	void OnSelectAllButOne(QCheckBoxEx *sender);
 	void OnCellClicked(const QModelIndex &index);
+	void OnFacetChanged(QTreeWidgetItem *item);
 	void OnFindDupes();
+	void OnFindSimilar();
+	void OnClusterLibrary();
 	void OnExportPlaylist();
+	void OnRenderAudio();
+	void OnPlayResults();
+	void OnNextTrack();
+	void OnStopPlayback();
 	void OnPasteMPT();
 	void OnSettings();
 	void OnAbout();
 
 protected:
 	void DoSearch(bool showAll);
+	SearchParameters BuildSearch(bool showAll);
+	void StartSearch(SearchParameters params, bool showSingleResult);
+	void SetResultModel(TableModel *model);
+	void ShowResultModel(TableModel *model);
+	TableModel *ResultModel() const;
+	void UpdateFacets();
+	void UpdatePlaybackActions();
 	void closeEvent(QCloseEvent *event);
 
 private:
@@ -0,0 +1,78 @@
+/*
+ * parallel.h
+ * ----------
+ * Purpose: Helper for running batch jobs on all available cores.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QString>
+#include <QThread>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Called regularly from the calling thread while a batch job is running. Return false to cancel the job.
+using ProgressCallback = std::function<bool(const QString &status, int done, int total)>;
+
+inline int ParallelWorkers()
+{
+	return std::max(1, QThread::idealThreadCount());
+}
+
+// Run func(index, worker) for all indices in [0, count) on all available cores, with worker in [0, ParallelWorkers()).
+// The calling thread is only used for reporting progress. Returns false if the job was cancelled.
+template<typename Func>
+bool ParallelFor(int count, const QString &status, const ProgressCallback &progress, const Func &func)
+{
+	std::atomic<int> next(0), done(0);
+	std::atomic<bool> cancel(false);
+	std::mutex mutex;
+	std::condition_variable finished;
+	const int numWorkers = std::min(ParallelWorkers(), count);
+	int running = numWorkers;
+
+	std::vector<std::thread> workers;
+	for(int w = 0; w < numWorkers; w++)
+	{
+		workers.emplace_back([&, w]()
+		{
+			int i;
+			while(!cancel && (i = next++) < count)
+			{
+				func(i, w);
+				done++;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			if(--running == 0)
+			{
+				finished.notify_all();
+			}
+		});
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while(!finished.wait_for(lock, std::chrono::milliseconds(50), [&running]() { return running == 0; }))
+	{
+		lock.unlock();
+		if(!cancel && !progress(status, done, count))
+		{
+			cancel = true;
+		}
+		lock.lock();
+	}
+	lock.unlock();
+	for(auto &worker : workers)
+	{
+		worker.join();
+	}
+	return !cancel;
+}
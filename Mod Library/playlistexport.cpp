@@ -0,0 +1,316 @@
+/*
+ * playlistexport.cpp
+ * ------------------
+ * Purpose: Writes search results to playlist files in the background.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "playlistexport.h"
+#include "database.h"
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QUrl>
+#include <QDebug>
+#include <algorithm>
+#include <iterator>
+
+// Output is written to the file in blocks of this size
+static constexpr int WRITE_BUFFER_SIZE = 64 * 1024;
+// Number of modules that are looked up at once when exporting a list of module IDs
+static constexpr size_t ID_BATCH_SIZE = 512;
+
+
+// Collects the output in memory and writes it to the file in large blocks
+class BufferedWriter
+{
+protected:
+	QFile &file;
+	QByteArray buffer;
+	bool ok;
+
+public:
+	BufferedWriter(QFile &file) : file(file), ok(true)
+	{
+		buffer.reserve(WRITE_BUFFER_SIZE * 2);
+	}
+
+	void Write(const QByteArray &data)
+	{
+		buffer += data;
+		if(buffer.size() >= WRITE_BUFFER_SIZE)
+			Flush();
+	}
+
+	bool Flush()
+	{
+		if(!buffer.isEmpty() && file.write(buffer) != buffer.size())
+		{
+			qDebug() << file.errorString();
+			ok = false;
+		}
+		buffer.resize(0);
+		return ok;
+	}
+};
+
+
+// Quoted CSV field as described in RFC 4180
+static QByteArray CSVField(const QString &str)
+{
+	QByteArray field = str.toUtf8();
+	field.replace('"', "\"\"");
+	return '"' + field + '"';
+}
+
+
+// Text that can be placed in an XML element
+static QByteArray XMLText(const QString &str)
+{
+	return str.toHtmlEscaped().toUtf8();
+}
+
+
+PlaylistExport::PlaylistExport(const QString &fileName, Format format, const QString &queryStr, const QVariantMap &bindings, std::vector<qint64> ids, QObject *parent)
+	: QObject(parent), fileName(fileName), format(format), queryStr(queryStr), bindings(bindings), ids(std::move(ids)), cancel(false)
+{
+}
+
+
+PlaylistExport::~PlaylistExport()
+{
+	cancel = true;
+	if(thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+
+void PlaylistExport::Start()
+{
+	// Database connections cannot be shared between threads
+	sourceConnection = ModDatabase::Instance().GetDB().connectionName();
+	thread = std::thread(&PlaylistExport::Run, this);
+}
+
+
+QStringList PlaylistExport::NameFilters()
+{
+	return QStringList
+	{
+		tr("PLS playlists (*.pls)"),
+		tr("M3U playlists (*.m3u)"),
+		tr("M3U8 playlists (*.m3u8)"),
+		tr("XSPF playlists (*.xspf)"),
+		tr("CSV files (*.csv)"),
+	};
+}
+
+
+QString PlaylistExport::Suffix(Format format)
+{
+	static const char *suffixes[] = { "pls", "m3u", "m3u8", "xspf", "csv" };
+	static_assert(std::size(suffixes) == NumFormats);
+	return suffixes[format];
+}
+
+
+PlaylistExport::Format PlaylistExport::FormatFromFileName(const QString &fileName)
+{
+	const QString suffix = QFileInfo(fileName).suffix().toLower();
+	for(int i = 0; i < NumFormats; i++)
+	{
+		if(suffix == Suffix(static_cast<Format>(i)))
+			return static_cast<Format>(i);
+	}
+	return NumFormats;
+}
+
+
+void PlaylistExport::Run()
+{
+	const QString connectionName = "modlib_export";
+	bool success = false;
+	int numEntries = 0;
+	{
+		QSqlDatabase db = QSqlDatabase::cloneDatabase(sourceConnection, connectionName);
+		if(db.open())
+		{
+			success = Write(db, numEntries);
+		} else
+		{
+			qDebug() << db.lastError();
+		}
+	}
+	QSqlDatabase::removeDatabase(connectionName);
+	if(!success)
+	{
+		// Don't leave an incomplete playlist behind
+		QFile::remove(fileName);
+	}
+	emit finished(success, numEntries);
+}
+
+
+bool PlaylistExport::Write(QSqlDatabase &db, int &numEntries)
+{
+	QFile file(fileName);
+	if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+	{
+		qDebug() << file.errorString();
+		return false;
+	}
+	BufferedWriter out(file);
+	// Plain M3U files use the system's code page, everything else is written as UTF-8
+	const auto encode = [this](const QString &str) { return format == FormatM3U ? str.toLocal8Bit() : str.toUtf8(); };
+
+	switch(format)
+	{
+	case FormatPLS:
+		out.Write("[playlist]\n");
+		break;
+	case FormatM3U:
+	case FormatM3U8:
+		out.Write("#EXTM3U\n");
+		break;
+	case FormatXSPF:
+		out.Write("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\">\n\t<trackList>\n");
+		break;
+	case FormatCSV:
+		out.Write("\"File\",\"Title\",\"Length\"\n");
+		break;
+	case NumFormats:
+		return false;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+	const auto writeEntry = [&](const QString &path, QString title, int length)
+	{
+		if(title.isEmpty())
+		{
+			title = QFileInfo(path).fileName();
+		}
+		// Line breaks and other control characters in module titles would break the playlist structure
+		for(QChar &c : title)
+		{
+			if(c.unicode() < 0x20)
+				c = ' ';
+		}
+		const QString nativePath = QDir::toNativeSeparators(path);
+		const QByteArray number = QByteArray::number(++numEntries);
+		const QByteArray seconds = QByteArray::number((length + 500) / 1000);
+		switch(format)
+		{
+		case FormatPLS:
+			out.Write("File" + number + "=" + encode(nativePath) + "\nTitle" + number + "=" + encode(title) + "\nLength" + number + "=" + seconds + "\n");
+			break;
+		case FormatM3U:
+		case FormatM3U8:
+			out.Write("#EXTINF:" + seconds + "," + encode(title) + "\n" + encode(nativePath) + "\n");
+			break;
+		case FormatXSPF:
+			out.Write("\t\t<track>\n\t\t\t<location>" + XMLText(QString::fromLatin1(QUrl::fromLocalFile(path).toEncoded())) + "</location>\n"
+				"\t\t\t<title>" + XMLText(title) + "</title>\n"
+				"\t\t\t<duration>" + QByteArray::number(length) + "</duration>\n\t\t</track>\n");
+			break;
+		case FormatCSV:
+			out.Write(CSVField(nativePath) + "," + CSVField(title) + "," + seconds + "\n");
+			break;
+		case NumFormats:
+			break;
+		}
+		if(timer.elapsed() >= 100)
+		{
+			emit progress(numEntries);
+			timer.restart();
+		}
+	};
+
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	if(!queryStr.isEmpty())
+	{
+		query.prepare(queryStr);
+		for(auto binding = bindings.cbegin(); binding != bindings.cend(); binding++)
+		{
+			query.bindValue(binding.key(), binding.value());
+		}
+		if(!query.exec())
+		{
+			qDebug() << query.lastError();
+			return false;
+		}
+		while(!cancel && query.next())
+		{
+			writeEntry(query.value(0).toString(), query.value(1).toString(), query.value(2).toInt());
+		}
+	} else
+	{
+		struct Entry
+		{
+			QString path, title;
+			int length = 0;
+		};
+		std::vector<Entry> entries;
+		for(size_t i = 0; i < ids.size() && !cancel; i += ID_BATCH_SIZE)
+		{
+			const size_t batchSize = std::min(ID_BATCH_SIZE, ids.size() - i);
+			QString idList;
+			QHash<qint64, int> entryIndex;
+			for(size_t j = 0; j < batchSize; j++)
+			{
+				entryIndex.insert(ids[i + j], static_cast<int>(j));
+				if(j)
+					idList += ',';
+				idList += QString::number(ids[i + j]);
+			}
+			if(!query.exec("SELECT `id`, `filename`, `title`, `length` FROM `modlib_modules` WHERE `id` IN (" + idList + ")"))
+			{
+				qDebug() << query.lastError();
+				return false;
+			}
+			entries.assign(batchSize, Entry());
+			while(query.next())
+			{
+				const auto index = entryIndex.constFind(query.value(0).toLongLong());
+				if(index == entryIndex.constEnd())
+					continue;
+				Entry &entry = entries[index.value()];
+				entry.path = query.value(1).toString();
+				entry.title = query.value(2).toString();
+				entry.length = query.value(3).toInt();
+			}
+			for(const auto &entry : entries)
+			{
+				// Modules that have been removed from the database in the meantime are skipped
+				if(!entry.path.isEmpty())
+					writeEntry(entry.path, entry.title, entry.length);
+			}
+		}
+	}
+	if(cancel)
+	{
+		return false;
+	}
+
+	switch(format)
+	{
+	case FormatPLS:
+		out.Write("NumberOfEntries=" + QByteArray::number(numEntries) + "\nVersion=2\n");
+		break;
+	case FormatXSPF:
+		out.Write("\t</trackList>\n</playlist>\n");
+		break;
+	default:
+		break;
+	}
+	return out.Flush();
+}
@@ -0,0 +1,72 @@
+/*
+ * playlistexport.h
+ * ----------------
+ * Purpose: Writes search results to playlist files in the background.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QSqlDatabase>
+#include <QString>
+#include <QVariantMap>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+
+// Streams the file names of a search result from the database into a playlist file on its own thread and database connection.
+// Only one entry is kept in memory at a time, unless the results are given as a list of module IDs.
+class PlaylistExport : public QObject
+{
+	Q_OBJECT
+
+public:
+	enum Format
+	{
+		FormatPLS = 0,
+		FormatM3U,
+		FormatM3U8,
+		FormatXSPF,
+		FormatCSV,
+
+		NumFormats
+	};
+
+protected:
+	QString fileName;
+	Format format;
+	// Query that returns the columns (`filename`, `title`, `length`) in the order in which they should be exported...
+	QString queryStr;
+	QVariantMap bindings;
+	// ...or the IDs of the modules to export if no such query is available
+	std::vector<qint64> ids;
+	QString sourceConnection;
+	std::thread thread;
+	std::atomic<bool> cancel;
+
+public:
+	PlaylistExport(const QString &fileName, Format format, const QString &queryStr, const QVariantMap &bindings, std::vector<qint64> ids, QObject *parent = nullptr);
+	~PlaylistExport();
+
+	void Start();
+	void Cancel() { cancel = true; }
+
+	// File dialog filters for all formats, in the same order as the Format enum
+	static QStringList NameFilters();
+	static QString Suffix(Format format);
+	// Format belonging to a file name, or NumFormats if the extension is unknown
+	static Format FormatFromFileName(const QString &fileName);
+
+signals:
+	// Emitted from the export thread
+	void progress(int numEntries);
+	void finished(bool success, int numEntries);
+
+protected:
+	void Run();
+	bool Write(QSqlDatabase &db, int &numEntries);
+};
@@ -0,0 +1,349 @@
+/*
+ * playlistplayer.cpp
+ * ------------------
+ * Purpose: Plays a list of modules back to back without gaps.
+ * Notes  : As with the single module player, the PortAudio callback only ever reads from the ring buffer and looks at atomic flags.
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "playlistplayer.h"
+#include "database.h"
+#include <QFile>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QDebug>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+// Rendered audio that is kept ready for the callback, about 170ms
+static constexpr size_t BUFFER_FRAMES = 8192;
+// Number of frames rendered at once
+static constexpr size_t RENDER_BLOCK = 512;
+// Length of the beginning of the next module that is rendered ahead of time, one second
+static constexpr size_t HEAD_FRAMES = AudioThread::SAMPLE_RATE;
+
+
+PlaylistPlayer::PlaylistPlayer(std::vector<qint64> ids, int firstIndex, int volume, QObject *parent)
+	: QObject(parent), ids(std::move(ids)), firstIndex(firstIndex), frames(BUFFER_FRAMES), commands(64), stream(nullptr), stopRequested(false), flushRequested(false), volume(volume), requestedIndex(-1)
+{
+}
+
+
+PlaylistPlayer::~PlaylistPlayer()
+{
+	Stop();
+	if(renderThread.joinable())
+	{
+		renderThread.join();
+	}
+	if(loaderThread.joinable())
+	{
+		loaderThread.join();
+	}
+}
+
+
+bool PlaylistPlayer::Start()
+{
+	if(stream != nullptr)
+	{
+		return true;
+	}
+	if(ids.empty() || !AudioThread::InitializeAudio())
+	{
+		return false;
+	}
+	PaStreamParameters streamparameters;
+	std::memset(&streamparameters, 0, sizeof(PaStreamParameters));
+	streamparameters.device = Pa_GetDefaultOutputDevice();
+	if(streamparameters.device == paNoDevice)
+	{
+		return false;
+	}
+	streamparameters.channelCount = 2;
+	streamparameters.sampleFormat = paFloat32;
+	streamparameters.suggestedLatency = Pa_GetDeviceInfo(streamparameters.device)->defaultLowOutputLatency;
+	const PaError result = Pa_OpenStream(&stream, nullptr, &streamparameters, AudioThread::SAMPLE_RATE, paFramesPerBufferUnspecified, paNoFlag, &PlaylistPlayer::Callback, this);
+	if(result != paNoError)
+	{
+		qDebug() << Pa_GetErrorText(result);
+		stream = nullptr;
+		return false;
+	}
+
+	// Database connections cannot be shared between threads
+	sourceConnection = ModDatabase::Instance().GetDB().connectionName();
+	loaderThread = std::thread(&PlaylistPlayer::Load, this);
+	renderThread = std::thread(&PlaylistPlayer::Render, this);
+	Pa_StartStream(stream);
+	return true;
+}
+
+
+void PlaylistPlayer::Next()
+{
+	commands.Push(Command{ Command::Next, 0 });
+}
+
+
+void PlaylistPlayer::Previous()
+{
+	commands.Push(Command{ Command::Previous, 0 });
+}
+
+
+void PlaylistPlayer::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(loaderMutex);
+		stopRequested = true;
+	}
+	loaderWakeUp.notify_all();
+	commands.Push(Command{ Command::Stop, 0 });
+}
+
+
+void PlaylistPlayer::SetVolume(int newVolume)
+{
+	volume = newVolume;
+	commands.Push(Command{ Command::SetVolume, newVolume });
+}
+
+
+// Loads the requested modules on its own thread and database connection
+void PlaylistPlayer::Load()
+{
+	// A stopped player may still be closing its connection while the next one opens its own
+	static std::atomic<int> numConnections(0);
+	const QString connectionName = QString("modlib_player%1").arg(numConnections++);
+	{
+		QSqlDatabase db = QSqlDatabase::cloneDatabase(sourceConnection, connectionName);
+		if(!db.open())
+		{
+			qDebug() << db.lastError();
+		}
+		QSqlQuery query(db);
+		query.prepare("SELECT `filename` FROM `modlib_modules` WHERE `id` = :id");
+
+		std::unique_lock<std::mutex> lock(loaderMutex);
+		while(true)
+		{
+			loaderWakeUp.wait(lock, [this]() { return stopRequested || (requestedIndex >= 0 && (!loadedTrack || loadedTrack->index != requestedIndex)); });
+			if(stopRequested)
+			{
+				break;
+			}
+			const int index = requestedIndex;
+			lock.unlock();
+
+			auto track = std::make_unique<Track>();
+			track->index = index;
+			query.bindValue(":id", ids[index]);
+			if(query.exec() && query.next())
+			{
+				track->fileName = query.value(0).toString();
+			}
+			query.finish();
+
+			QFile file(track->fileName);
+			if(!track->fileName.isEmpty() && file.open(QIODevice::ReadOnly))
+			{
+				const QByteArray content = file.readAll();
+				file.close();
+				try
+				{
+					track->mod = std::make_unique<openmpt::module>(content.begin(), content.end());
+					AudioThread::PrepareModule(*track->mod);
+					// Every module is only played once
+					track->mod->set_repeat_count(0);
+					track->head.resize(HEAD_FRAMES);
+					track->head.resize(track->mod->read_interleaved_stereo(AudioThread::SAMPLE_RATE, HEAD_FRAMES, &track->head[0].left));
+				} catch(openmpt::exception &e)
+				{
+					qDebug() << e.what();
+					track->mod.reset();
+				}
+			}
+
+			lock.lock();
+			if(requestedIndex == index)
+			{
+				loadedTrack = std::move(track);
+				loaderWakeUp.notify_all();
+			}
+		}
+	}
+	QSqlDatabase::removeDatabase(connectionName);
+}
+
+
+// Wait for the loader to load a module, skipping modules that cannot be played in the given direction.
+// The loader then continues with the module after it. Returns null if there are no more modules to play.
+std::unique_ptr<PlaylistPlayer::Track> PlaylistPlayer::TakeTrack(int index, int direction)
+{
+	std::unique_lock<std::mutex> lock(loaderMutex);
+	while(index >= 0 && index < NumTracks())
+	{
+		if(!loadedTrack || loadedTrack->index != index)
+		{
+			loadedTrack.reset();
+			requestedIndex = index;
+			loaderWakeUp.notify_all();
+			loaderWakeUp.wait(lock, [this, index]() { return stopRequested || (loadedTrack && loadedTrack->index == index); });
+			if(stopRequested)
+			{
+				return nullptr;
+			}
+		}
+		std::unique_ptr<Track> track = std::move(loadedTrack);
+		requestedIndex = (index + 1 < NumTracks()) ? (index + 1) : -1;
+		loaderWakeUp.notify_all();
+		if(track->mod)
+		{
+			return track;
+		}
+		index += direction;
+	}
+	return nullptr;
+}
+
+
+// Drop all rendered audio that has not been played yet
+void PlaylistPlayer::Flush()
+{
+	flushRequested = true;
+	// Wait for the callback to do it, but don't hang if the sound device stalls
+	for(int i = 0; i < 20 && flushRequested; i++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+}
+
+
+void PlaylistPlayer::Render()
+{
+	std::unique_ptr<Track> track;
+	int currentIndex = firstIndex;
+	const auto startTrack = [&](std::unique_ptr<Track> newTrack)
+	{
+		track = std::move(newTrack);
+		if(track)
+		{
+			currentIndex = track->index;
+			track->mod->set_render_param(openmpt::module::RENDER_MASTERGAIN_MILLIBEL, AudioThread::VolumeToMillibel(volume));
+			emit trackChanged(track->index, track->fileName);
+		}
+	};
+	startTrack(TakeTrack(firstIndex, 1));
+
+	bool stop = false;
+	while(!stop)
+	{
+		int skip = 0;
+		Command command;
+		while(commands.Pop(command))
+		{
+			switch(command.type)
+			{
+			case Command::SetVolume:
+				if(track)
+					track->mod->set_render_param(openmpt::module::RENDER_MASTERGAIN_MILLIBEL, AudioThread::VolumeToMillibel(command.value));
+				break;
+			case Command::Next:
+				skip++;
+				break;
+			case Command::Previous:
+				skip--;
+				break;
+			case Command::Stop:
+				stop = true;
+				break;
+			}
+		}
+		if(stop || stopRequested)
+		{
+			stop = true;
+			break;
+		}
+
+		if(skip != 0)
+		{
+			// The next module has most likely been loaded already
+			Flush();
+			startTrack(TakeTrack(std::max(currentIndex + skip, 0), skip > 0 ? 1 : -1));
+			continue;
+		}
+
+		if(track && frames.WriteAvailable() >= RENDER_BLOCK)
+		{
+			AudioFrame block[RENDER_BLOCK];
+			size_t count = 0;
+			if(track->headPos < track->head.size())
+			{
+				const float gain = std::pow(10.0f, AudioThread::VolumeToMillibel(volume) / 2000.0f);
+				count = std::min(RENDER_BLOCK, track->head.size() - track->headPos);
+				for(size_t i = 0; i < count; i++)
+				{
+					const AudioFrame &frame = track->head[track->headPos + i];
+					block[i] = AudioFrame{ frame.left * gain, frame.right * gain };
+				}
+				track->headPos += count;
+			} else
+			{
+				count = track->mod->read_interleaved_stereo(AudioThread::SAMPLE_RATE, RENDER_BLOCK, &block[0].left);
+			}
+			if(count == 0)
+			{
+				// Continue with the next module without any gap
+				startTrack(TakeTrack(track->index + 1, 1));
+				continue;
+			}
+			frames.Write(block, count);
+			continue;
+		}
+		if(!track && frames.WriteAvailable() == frames.Capacity())
+		{
+			// Everything has been played
+			break;
+		}
+		// The ring buffer is full, wait for the callback to make some room
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(loaderMutex);
+		stopRequested = true;
+	}
+	loaderWakeUp.notify_all();
+	if(stop)
+		Pa_AbortStream(stream);
+	else
+		Pa_StopStream(stream);
+	Pa_CloseStream(stream);
+	emit finished();
+}
+
+
+int PlaylistPlayer::Callback(const void *, void *output, unsigned long frameCount, const PaStreamCallbackTimeInfo *, PaStreamCallbackFlags, void *userData)
+{
+	PlaylistPlayer &that = *static_cast<PlaylistPlayer *>(userData);
+	AudioFrame *out = static_cast<AudioFrame *>(output);
+	if(that.flushRequested)
+	{
+		that.frames.Skip(that.frames.ReadAvailable());
+		that.flushRequested = false;
+	}
+	const bool stopRequested = that.stopRequested;
+	size_t count = 0;
+	if(!stopRequested)
+	{
+		count = that.frames.Read(out, frameCount);
+	}
+	// Play silence if the renderer cannot keep up
+	std::fill(out + count, out + frameCount, AudioFrame{ 0.0f, 0.0f });
+	return stopRequested ? paComplete : paContinue;
+}
@@ -0,0 +1,97 @@
+/*
+ * playlistplayer.h
+ * ----------------
+ * Purpose: Plays a list of modules back to back without gaps.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include "audioplayer.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Plays modules from the library one after another through a single output stream.
+// While a module is playing, the next one is loaded and its beginning is rendered on a separate thread,
+// so that the render thread can continue with it as soon as the current module ends.
+class PlaylistPlayer : public QObject
+{
+	Q_OBJECT
+
+public:
+	struct Command
+	{
+		enum Type
+		{
+			SetVolume,
+			Next,
+			Previous,
+			Stop,
+		};
+		Type type;
+		int value;
+	};
+
+protected:
+	struct Track
+	{
+		int index;
+		QString fileName;
+		std::unique_ptr<openmpt::module> mod;	// Null if the module could not be loaded
+		std::vector<AudioFrame> head;			// Beginning of the module at full volume, already rendered by the loader
+		size_t headPos = 0;
+	};
+
+	const std::vector<qint64> ids;
+	const int firstIndex;
+	QString sourceConnection;
+	RingBuffer<AudioFrame> frames;
+	RingBuffer<Command> commands;
+	PaStream *stream;
+	std::thread renderThread, loaderThread;
+	std::atomic<bool> stopRequested;
+	std::atomic<bool> flushRequested;	// Makes the callback drop everything that has been rendered so far
+	std::atomic<int> volume;
+
+	// Track that the loader is asked for, and the track that it has loaded
+	std::mutex loaderMutex;
+	std::condition_variable loaderWakeUp;
+	int requestedIndex;
+	std::unique_ptr<Track> loadedTrack;
+
+public:
+	// Play the modules with the given IDs, starting at firstIndex
+	PlaylistPlayer(std::vector<qint64> ids, int firstIndex, int volume, QObject *parent = nullptr);
+	~PlaylistPlayer();
+
+	// Open the sound device and start playing. Returns false if no sound device could be opened.
+	bool Start();
+	void Next();
+	void Previous();
+	// Silence the output immediately and end playback. finished() is emitted once the sound device has been closed.
+	void Stop();
+	void SetVolume(int volume);
+	int NumTracks() const { return static_cast<int>(ids.size()); }
+
+signals:
+	// Emitted from the render thread when it starts rendering a module
+	void trackChanged(int index, const QString &fileName);
+	// Emitted from the render thread
+	void finished();
+
+protected:
+	void Render();
+	void Load();
+	std::unique_ptr<Track> TakeTrack(int index, int direction);
+	void Flush();
+	static int Callback(const void *input, void *output, unsigned long frameCount, const PaStreamCallbackTimeInfo *timeInfo, PaStreamCallbackFlags statusFlags, void *userData);
+};
@@ -0,0 +1,306 @@
+/*
+ * previewcache.cpp
+ * ----------------
+ * Purpose: Keeps the beginning of recently viewed and top-ranked modules rendered, so that playback can start instantly.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "previewcache.h"
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSettings>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+
+// Length of the rendered beginning of each module
+static constexpr int PREVIEW_SECONDS = 10;
+// Size limits for compressed previews in memory and on disk
+static constexpr size_t MAX_MEMORY_SIZE = 32 * 1024 * 1024;
+static constexpr qint64 MAX_DISK_SIZE = 256 * 1024 * 1024;
+// Maximum number of modules waiting to be rendered
+static constexpr size_t MAX_QUEUE_LENGTH = 16;
+// Identifies the file format of stored previews
+static constexpr quint32 PREVIEW_MAGIC = 0x4D4C5056;	// MLPV
+static constexpr quint32 PREVIEW_VERSION = 1;
+
+
+PreviewCache::PreviewCache()
+	: memorySize(0), stop(false)
+{
+	// Stored next to the database
+	directory = QFileInfo(QSettings().fileName()).absoluteDir().absolutePath() + "/Previews/";
+	QDir().mkpath(directory);
+}
+
+
+PreviewCache &PreviewCache::Instance()
+{
+	static PreviewCache cache;
+	return cache;
+}
+
+
+PreviewCache::~PreviewCache()
+{
+	Shutdown();
+}
+
+
+void PreviewCache::Shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		queue.clear();
+	}
+	wakeUp.notify_one();
+	if(thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+
+// Previews become invalid as soon as the module file is modified
+QString PreviewCache::Key(const QString &fileName)
+{
+	const QFileInfo info(fileName);
+	const QString identity = info.absoluteFilePath() + '|' + QString::number(info.size()) + '|' + QString::number(info.lastModified().toMSecsSinceEpoch());
+	return QString::fromLatin1(QCryptographicHash::hash(identity.toUtf8(), QCryptographicHash::Sha1).toHex());
+}
+
+
+QString PreviewCache::FilePath(const QString &key) const
+{
+	return directory + key + ".preview";
+}
+
+
+std::shared_ptr<const Preview> PreviewCache::Find(const QString &fileName)
+{
+	const QString key = Key(fileName);
+	QByteArray data;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto entry = std::find_if(entries.begin(), entries.end(), [&key](const Entry &entry) { return entry.key == key; });
+		if(entry != entries.end())
+		{
+			entries.splice(entries.begin(), entries, entry);
+			data = entry->data;
+		}
+	}
+	if(data.isEmpty())
+	{
+		QFile file(FilePath(key));
+		if(!file.exists() || !file.open(QIODevice::ReadWrite))
+		{
+			return nullptr;
+		}
+		data = file.readAll();
+		// The modification time tells which previews on disk have been used least recently
+		file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+		file.close();
+		// Damaged previews are removed so that they are rendered again
+		auto preview = Decode(data);
+		if(preview == nullptr)
+		{
+			QFile::remove(FilePath(key));
+			return nullptr;
+		}
+		Store(key, data);
+		return preview;
+	}
+	return Decode(data);
+}
+
+
+void PreviewCache::Prefetch(const QStringList &fileNames)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(stop)
+		{
+			return;
+		}
+		for(auto fileName = fileNames.crbegin(); fileName != fileNames.crend(); fileName++)
+		{
+			queue.erase(std::remove(queue.begin(), queue.end(), *fileName), queue.end());
+			queue.push_front(*fileName);
+		}
+		if(queue.size() > MAX_QUEUE_LENGTH)
+		{
+			queue.resize(MAX_QUEUE_LENGTH);
+		}
+		if(!thread.joinable())
+		{
+			thread = std::thread(&PreviewCache::Run, this);
+		}
+	}
+	wakeUp.notify_one();
+}
+
+
+void PreviewCache::Run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(true)
+	{
+		wakeUp.wait(lock, [this]() { return !queue.empty() || stop; });
+		if(stop)
+		{
+			break;
+		}
+		const QString fileName = queue.front();
+		queue.pop_front();
+		lock.unlock();
+
+		const QString key = Key(fileName);
+		if(!Contains(key))
+		{
+			const QByteArray data = Render(fileName);
+			if(!data.isEmpty())
+			{
+				// Written to a temporary file first, so that a preview is never read before it has been written completely
+				QSaveFile file(FilePath(key));
+				if(file.open(QIODevice::WriteOnly) && file.write(data) == data.size() && file.commit())
+				{
+					TrimDisk();
+				}
+				Store(key, data);
+			}
+		}
+
+		lock.lock();
+	}
+}
+
+
+bool PreviewCache::Contains(const QString &key)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(std::any_of(entries.begin(), entries.end(), [&key](const Entry &entry) { return entry.key == key; }))
+		{
+			return true;
+		}
+	}
+	return QFile::exists(FilePath(key));
+}
+
+
+// Keep a preview in memory, forgetting the least recently used ones if necessary
+void PreviewCache::Store(const QString &key, const QByteArray &data)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	const auto existing = std::find_if(entries.begin(), entries.end(), [&key](const Entry &entry) { return entry.key == key; });
+	if(existing != entries.end())
+	{
+		memorySize -= existing->data.size();
+		entries.erase(existing);
+	}
+	entries.push_front(Entry{ key, data });
+	memorySize += data.size();
+	while(memorySize > MAX_MEMORY_SIZE && entries.size() > 1)
+	{
+		memorySize -= entries.back().data.size();
+		entries.pop_back();
+	}
+}
+
+
+// Remove the least recently used previews from disk until they fit into the size limit
+void PreviewCache::TrimDisk()
+{
+	const QFileInfoList files = QDir(directory).entryInfoList(QStringList{ "*.preview" }, QDir::Files, QDir::Time);
+	qint64 totalSize = 0;
+	for(const auto &file : files)
+	{
+		totalSize += file.size();
+		if(totalSize > MAX_DISK_SIZE)
+		{
+			QFile::remove(file.absoluteFilePath());
+		}
+	}
+}
+
+
+QByteArray PreviewCache::Render(const QString &fileName)
+{
+	QFile file(fileName);
+	if(!file.open(QIODevice::ReadOnly))
+	{
+		return QByteArray();
+	}
+	const QByteArray content = file.readAll();
+	file.close();
+
+	std::vector<int16_t> samples;
+	try
+	{
+		openmpt::module mod(content.begin(), content.end());
+		AudioThread::PrepareModule(mod);
+		constexpr size_t blockSize = 4096;
+		const size_t maxFrames = size_t(PREVIEW_SECONDS) * AudioThread::SAMPLE_RATE;
+		AudioFrame block[blockSize];
+		samples.reserve(maxFrames * 2);
+		while(samples.size() < maxFrames * 2)
+		{
+			const size_t count = mod.read_interleaved_stereo(AudioThread::SAMPLE_RATE, std::min(blockSize, maxFrames - samples.size() / 2), &block[0].left);
+			if(count == 0)
+			{
+				break;
+			}
+			for(size_t i = 0; i < count; i++)
+			{
+				samples.push_back(static_cast<int16_t>(std::lround(std::clamp(block[i].left, -1.0f, 32767.0f / 32768.0f) * 32768.0f)));
+				samples.push_back(static_cast<int16_t>(std::lround(std::clamp(block[i].right, -1.0f, 32767.0f / 32768.0f) * 32768.0f)));
+			}
+		}
+	} catch(openmpt::exception &e)
+	{
+		qDebug() << e.what();
+		return QByteArray();
+	}
+
+	QByteArray data;
+	QDataStream out(&data, QIODevice::WriteOnly);
+	out << PREVIEW_MAGIC << PREVIEW_VERSION << quint32(AudioThread::SAMPLE_RATE) << quint32(samples.size() / 2);
+	out << qCompress(reinterpret_cast<const uchar *>(samples.data()), static_cast<int>(samples.size() * sizeof(int16_t)));
+	return data;
+}
+
+
+std::shared_ptr<const Preview> PreviewCache::Decode(const QByteArray &data)
+{
+	QDataStream in(data);
+	quint32 magic = 0, version = 0, sampleRate = 0, numFrames = 0;
+	QByteArray compressed;
+	in >> magic >> version >> sampleRate >> numFrames >> compressed;
+	if(in.status() != QDataStream::Ok || magic != PREVIEW_MAGIC || version != PREVIEW_VERSION || sampleRate != AudioThread::SAMPLE_RATE)
+	{
+		return nullptr;
+	}
+	const QByteArray raw = qUncompress(compressed);
+	if(static_cast<size_t>(raw.size()) != numFrames * 2 * sizeof(int16_t))
+	{
+		return nullptr;
+	}
+
+	auto preview = std::make_shared<Preview>();
+	preview->frames.resize(numFrames);
+	const int16_t *samples = reinterpret_cast<const int16_t *>(raw.constData());
+	for(quint32 i = 0; i < numFrames; i++)
+	{
+		preview->frames[i].left = samples[i * 2] / 32768.0f;
+		preview->frames[i].right = samples[i * 2 + 1] / 32768.0f;
+	}
+	return preview;
+}
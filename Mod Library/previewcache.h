@@ -0,0 +1,77 @@
+/*
+ * previewcache.h
+ * --------------
+ * Purpose: Keeps the beginning of recently viewed and top-ranked modules rendered, so that playback can start instantly.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include "audioplayer.h"
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// The beginning of a module, rendered in the same way as the audio player renders it at full volume
+struct Preview
+{
+	std::vector<AudioFrame> frames;
+};
+
+
+// Previews are stored as compressed 16-bit audio, both in memory and on disk.
+// Both stores are limited in size, discarding the least recently used previews first.
+class PreviewCache
+{
+protected:
+	struct Entry
+	{
+		QString key;
+		QByteArray data;
+	};
+
+	std::mutex mutex;
+	std::list<Entry> entries;	// Most recently used first
+	size_t memorySize;
+	QString directory;
+
+	// Modules whose previews are rendered in the background, most important first
+	std::thread thread;
+	std::condition_variable wakeUp;
+	std::deque<QString> queue;
+	bool stop;
+
+	PreviewCache();
+
+public:
+	static PreviewCache &Instance();
+	~PreviewCache();
+
+	// Cached preview of a module, or nullptr if there is none
+	std::shared_ptr<const Preview> Find(const QString &fileName);
+	// Render the previews of the given modules in the background unless they are cached already.
+	// They are rendered before all modules that have been requested earlier.
+	void Prefetch(const QStringList &fileNames);
+	// Stop rendering previews and wait for the background thread to exit
+	void Shutdown();
+
+protected:
+	void Run();
+	bool Contains(const QString &key);
+	void Store(const QString &key, const QByteArray &data);
+	void TrimDisk();
+	QString FilePath(const QString &key) const;
+	static QString Key(const QString &fileName);
+	static QByteArray Render(const QString &fileName);
+	static std::shared_ptr<const Preview> Decode(const QByteArray &data);
+};
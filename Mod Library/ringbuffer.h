@@ -0,0 +1,89 @@
+/*
+ * ringbuffer.h
+ * ------------
+ * Purpose: Lock-free queue for passing data from one thread to another.
+ * Notes  : Safe for exactly one producer thread and one consumer thread. Neither side ever blocks or allocates memory.
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+template<typename T>
+class RingBuffer
+{
+protected:
+	std::vector<T> buffer;
+	size_t mask;
+	// Positions only ever increase, the buffer index is obtained by masking them
+	alignas(64) std::atomic<size_t> readPos;
+	alignas(64) std::atomic<size_t> writePos;
+
+public:
+	// The capacity is rounded up to the next power of two
+	explicit RingBuffer(size_t capacity) : readPos(0), writePos(0)
+	{
+		size_t size = 1;
+		while(size < capacity)
+			size *= 2;
+		buffer.resize(size);
+		mask = size - 1;
+	}
+
+	size_t Capacity() const { return buffer.size(); }
+
+	// Only to be called by the consumer
+	size_t ReadAvailable() const
+	{
+		return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_relaxed);
+	}
+
+	// Only to be called by the producer
+	size_t WriteAvailable() const
+	{
+		return buffer.size() - (writePos.load(std::memory_order_relaxed) - readPos.load(std::memory_order_acquire));
+	}
+
+	// Add as many of the given elements as there is space for, returns the number of elements that were added
+	size_t Write(const T *data, size_t count)
+	{
+		const size_t pos = writePos.load(std::memory_order_relaxed);
+		count = std::min(count, WriteAvailable());
+		for(size_t i = 0; i < count; i++)
+		{
+			buffer[(pos + i) & mask] = data[i];
+		}
+		writePos.store(pos + count, std::memory_order_release);
+		return count;
+	}
+
+	// Remove up to count elements, returns the number of elements that were removed
+	size_t Read(T *data, size_t count)
+	{
+		const size_t pos = readPos.load(std::memory_order_relaxed);
+		count = std::min(count, ReadAvailable());
+		for(size_t i = 0; i < count; i++)
+		{
+			data[i] = buffer[(pos + i) & mask];
+		}
+		readPos.store(pos + count, std::memory_order_release);
+		return count;
+	}
+
+	// Remove up to count elements without looking at them, returns the number of elements that were removed
+	size_t Skip(size_t count)
+	{
+		const size_t pos = readPos.load(std::memory_order_relaxed);
+		count = std::min(count, ReadAvailable());
+		readPos.store(pos + count, std::memory_order_release);
+		return count;
+	}
+
+	bool Push(const T &value) { return Write(&value, 1) == 1; }
+	bool Pop(T &value) { return Read(&value, 1) == 1; }
+};
@@ -0,0 +1,746 @@
+/*
+ * search.cpp
+ * ----------
+ * Purpose: Runs searches in the background on a separate database connection.
+ * Notes  : Cancelled jobs are aborted from within SQLite through a progress handler on the worker's connection,
+ *          which requires Qt to use the same SQLite library as Mod Library (-system-sqlite).
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "search.h"
+#include "database.h"
+#include "melody.h"
+#include "similarity.h"
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QSqlDriver>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QDebug>
+#include <sqlite3.h>
+#include <algorithm>
+#include <list>
+#include <numeric>
+
+// Maximum number of rows that are handed to the model at once
+static constexpr size_t PUBLISH_SIZE = 1024;
+// Maximum number of characters kept in memory for narrowing down live search results
+static constexpr size_t MAX_LIVE_TEXT = 16 * 1024 * 1024;
+// Number of searches whose results are kept in memory, and maximum number of results of a single search to be kept
+static constexpr size_t CACHE_ENTRIES = 16;
+static constexpr size_t CACHE_MAX_RESULTS = 1024 * 1024;
+// Number of SQLite virtual machine instructions after which a running statement checks whether its job has been cancelled
+static constexpr int PROGRESS_INSTRUCTIONS = 10000;
+
+
+// Searchable text of all results of the most recent live search. Only accessed by the worker thread.
+static struct
+{
+	SearchParameters params;
+	quint64 generation = 0;
+	std::vector<qint64> ids;
+	std::vector<QString> fields;	// One entry per searched column and module
+	bool valid = false;
+} liveResults;
+
+
+// Results of recent searches, most recently used first. Only accessed by the worker thread.
+struct CachedResults
+{
+	QString key;
+	quint64 generation;		// Database write generation at the time of the search
+	std::vector<qint64> ids;
+	std::vector<int> scores;
+	QString query;
+	QVariantMap bindings;
+	std::vector<uint32_t> fingerprint;
+	ModDatabase::FacetCounts facets;
+	bool hasFacets;
+};
+static std::list<CachedResults> resultCache;
+
+
+SearchWorker::SearchWorker()
+	: lastJob(0), lastTask(0), stop(false)
+{
+}
+
+
+SearchWorker &SearchWorker::Instance()
+{
+	static SearchWorker worker;
+	return worker;
+}
+
+
+SearchWorker::~SearchWorker()
+{
+	Shutdown();
+}
+
+
+quint64 SearchWorker::Start(const std::shared_ptr<ResultBuffer> &results, SearchJob job)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	StartThread();
+	if(running)
+	{
+		running->cancel = true;
+	}
+	quint64 skippedJob = 0;
+	if(pending)
+	{
+		pending->cancel = true;
+		skippedJob = pending->job;
+	}
+	results->job = ++lastJob;
+	pending = results;
+	pendingJob = std::move(job);
+	lock.unlock();
+	wakeUp.notify_one();
+
+	if(skippedJob)
+	{
+		// Never started, but whoever is waiting for it still needs to know that it's over
+		emit finished(skippedJob);
+	}
+	return results->job;
+}
+
+
+quint64 SearchWorker::Post(SearchTask task)
+{
+	quint64 id;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		StartThread();
+		id = ++lastTask;
+		tasks.emplace_back(id, std::move(task));
+	}
+	wakeUp.notify_one();
+	return id;
+}
+
+
+// Must be called with the mutex locked
+void SearchWorker::StartThread()
+{
+	if(!thread.joinable())
+	{
+		// Database connections cannot be shared between threads
+		sourceConnection = ModDatabase::Instance().GetDB().connectionName();
+		stop = false;
+		thread = std::thread(&SearchWorker::Run, this);
+	}
+}
+
+
+void SearchWorker::Shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		if(running)
+			running->cancel = true;
+		if(pending)
+			pending->cancel = true;
+		tasks.clear();
+	}
+	wakeUp.notify_one();
+	if(thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+
+void SearchWorker::Run()
+{
+	const QString connectionName = "modlib_search";
+	{
+		QSqlDatabase db = QSqlDatabase::cloneDatabase(sourceConnection, connectionName);
+		if(!db.open())
+		{
+			qDebug() << db.lastError();
+		}
+		// Stale searches are cancelled in the middle of a statement, e.g. while scanning the whole library for a text, and not just between result rows
+		const QVariant handle = db.driver()->handle();
+		if(handle.isValid() && qstrcmp(handle.typeName(), "sqlite3*") == 0)
+		{
+			sqlite3 *sqliteHandle = *static_cast<sqlite3 *const *>(handle.data());
+			if(sqliteHandle)
+				sqlite3_progress_handler(sqliteHandle, PROGRESS_INSTRUCTIONS, &SearchWorker::OnProgress, this);
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true)
+		{
+			wakeUp.wait(lock, [this]() { return pending || !tasks.empty() || stop; });
+			if(stop)
+			{
+				break;
+			}
+			if(!tasks.empty())
+			{
+				auto task = std::move(tasks.front());
+				tasks.pop_front();
+				lock.unlock();
+
+				if(db.isOpen())
+				{
+					task.second(db);
+				}
+				emit taskFinished(task.first);
+
+				lock.lock();
+				continue;
+			}
+			running = std::move(pending);
+			SearchJob job = std::move(pendingJob);
+			pendingJob = nullptr;
+			lock.unlock();
+
+			if(!running->cancel && db.isOpen())
+			{
+				job(db, *running);
+			}
+			emit finished(running->job);
+
+			lock.lock();
+			running.reset();
+		}
+	}
+	QSqlDatabase::removeDatabase(connectionName);
+}
+
+
+int SearchWorker::OnProgress(void *worker)
+{
+	// Only the worker thread changes which job is running, and this is only called on that thread
+	const auto *that = static_cast<const SearchWorker *>(worker);
+	return (that->running && that->running->cancel) ? 1 : 0;
+}
+
+
+void SearchWorker::Publish(ResultBuffer &results, std::vector<qint64> &ids, std::vector<int> &scores)
+{
+	if(ids.empty() || results.cancel)
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(results.mutex);
+		results.ids.insert(results.ids.end(), ids.begin(), ids.end());
+		results.scores.insert(results.scores.end(), scores.begin(), scores.end());
+	}
+	if(results.keepAll)
+	{
+		if(results.allIds.size() + ids.size() <= CACHE_MAX_RESULTS)
+		{
+			results.allIds.insert(results.allIds.end(), ids.begin(), ids.end());
+			results.allScores.insert(results.allScores.end(), scores.begin(), scores.end());
+		} else
+		{
+			// Too large to be cached
+			results.keepAll = false;
+			results.allIds = std::vector<qint64>();
+			results.allScores = std::vector<int>();
+		}
+	}
+	ids.clear();
+	scores.clear();
+	emit Instance().rowsAvailable(results.job);
+}
+
+
+static void SortByScore(std::vector<qint64> &ids, std::vector<int> &scores, ScoreOrder order)
+{
+	std::vector<int> indices(ids.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	if(order == ScoreOrder::Descending)
+		std::stable_sort(indices.begin(), indices.end(), [&scores](int a, int b) { return scores[a] > scores[b]; });
+	else
+		std::stable_sort(indices.begin(), indices.end(), [&scores](int a, int b) { return scores[a] < scores[b]; });
+
+	std::vector<qint64> sortedIds(ids.size());
+	std::vector<int> sortedScores(scores.size());
+	for(size_t i = 0; i < indices.size(); i++)
+	{
+		sortedIds[i] = ids[indices[i]];
+		sortedScores[i] = scores[indices[i]];
+	}
+	ids.swap(sortedIds);
+	scores.swap(sortedScores);
+}
+
+
+void SearchWorker::RunQuery(QSqlDatabase &db, const QString &queryStr, const QVariantMap &bindings, const std::vector<uint32_t> &fingerprint, ScoreOrder order, ResultBuffer &results)
+{
+	{
+		std::lock_guard<std::mutex> lock(results.mutex);
+		results.query = queryStr;
+		results.bindings = bindings;
+		results.fingerprint = fingerprint;
+	}
+
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	query.prepare(queryStr);
+	for(auto binding = bindings.cbegin(); binding != bindings.cend(); binding++)
+	{
+		query.bindValue(binding.key(), binding.value());
+	}
+	if(!query.exec())
+	{
+		qDebug() << query.lastError();
+		return;
+	}
+
+	// Match quality is not known to the database, so all results have to be known before they can be sorted by it
+	const bool sortByScore = !fingerprint.empty() && order != ScoreOrder::None;
+	std::vector<qint64> ids;
+	std::vector<int> scores;
+	QElapsedTimer timer;
+	timer.start();
+	while(!results.cancel && query.next())
+	{
+		ids.push_back(query.value(0).toLongLong());
+		if(!fingerprint.empty())
+		{
+			const auto modFingerprint = Fingerprint::Decode(query.value(1).toByteArray());
+			scores.push_back(Fingerprint::Compare(fingerprint.data(), static_cast<int>(fingerprint.size()), modFingerprint.data(), static_cast<int>(modFingerprint.size())));
+		}
+		if(!sortByScore && (ids.size() >= PUBLISH_SIZE || timer.elapsed() >= 50))
+		{
+			Publish(results, ids, scores);
+			timer.restart();
+		}
+	}
+	if(sortByScore && !results.cancel)
+	{
+		SortByScore(ids, scores, order);
+	}
+	Publish(results, ids, scores);
+}
+
+
+bool SearchWorker::MatchQuery(QSqlDatabase &db, const QString &queryStr, const QVariantMap &bindings, const std::vector<uint32_t> &fingerprint, const std::vector<qint64> &candidates, std::vector<qint64> &ids, std::vector<int> &scores)
+{
+	ids.clear();
+	scores.clear();
+	if(candidates.empty())
+	{
+		return true;
+	}
+	QString idList;
+	for(const qint64 id : candidates)
+	{
+		if(!idList.isEmpty())
+			idList += ',';
+		idList += QString::number(id);
+	}
+
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	query.prepare("SELECT `results`.* FROM (" + queryStr + ") AS `results` WHERE `results`.`id` IN (" + idList + ")");
+	for(auto binding = bindings.cbegin(); binding != bindings.cend(); binding++)
+	{
+		query.bindValue(binding.key(), binding.value());
+	}
+	if(!query.exec())
+	{
+		qDebug() << query.lastError();
+		return false;
+	}
+	while(query.next())
+	{
+		ids.push_back(query.value(0).toLongLong());
+		if(!fingerprint.empty())
+		{
+			const auto modFingerprint = Fingerprint::Decode(query.value(1).toByteArray());
+			scores.push_back(Fingerprint::Compare(fingerprint.data(), static_cast<int>(fingerprint.size()), modFingerprint.data(), static_cast<int>(modFingerprint.size())));
+		}
+	}
+	return true;
+}
+
+
+// Same semantics as SQLite's LIKE operator with a backslash as escape character: Only ASCII letters are case-insensitive.
+static bool MatchLike(const QString &pattern, const QString &text)
+{
+	if(text.isNull())
+	{
+		return false;
+	}
+	const auto fold = [](QChar c) { return c.unicode() < 128 ? c.toLower() : c; };
+	const int patternLength = pattern.size(), textLength = text.size();
+	int p = 0, t = 0, wildcardP = -1, wildcardT = 0;
+	while(t < textLength)
+	{
+		if(p < patternLength && pattern[p] == '%')
+		{
+			wildcardP = ++p;
+			wildcardT = t;
+			continue;
+		}
+		if(p < patternLength)
+		{
+			QChar c = pattern[p];
+			int length = 1;
+			if(c == '\\' && p + 1 < patternLength)
+			{
+				c = pattern[p + 1];
+				length = 2;
+			} else if(c == '_')
+			{
+				p++;
+				t++;
+				continue;
+			}
+			if(fold(c) == fold(text[t]))
+			{
+				p += length;
+				t++;
+				continue;
+			}
+		}
+		// Mismatch, let the last wildcard consume one more character
+		if(wildcardP < 0)
+		{
+			return false;
+		}
+		p = wildcardP;
+		t = ++wildcardT;
+	}
+	while(p < patternLength && pattern[p] == '%')
+	{
+		p++;
+	}
+	return p == patternLength;
+}
+
+
+// Text search that keeps the searched columns of all results, so that the results can be narrowed down in memory while the search text is being typed
+static void RunLiveSearch(QSqlDatabase &db, const SearchParameters &params, ResultBuffer &results)
+{
+	const QString queryStr = "SELECT `id` FROM `modlib_modules` " + params.whereStr;
+	QVariantMap bindings;
+	bindings[":str"] = params.what;
+	{
+		// Allows the results to be sorted by the database
+		std::lock_guard<std::mutex> lock(results.mutex);
+		results.query = queryStr;
+		results.bindings = bindings;
+	}
+
+	const int numColumns = params.textColumns.size();
+	std::vector<qint64> ids;
+	std::vector<int> scores;
+	if(liveResults.valid && liveResults.generation == ModDatabase::Instance().WriteGeneration() && params.Refines(liveResults.params))
+	{
+		size_t numMatches = 0;
+		for(size_t i = 0; i < liveResults.ids.size() && !results.cancel; i++)
+		{
+			const QString *fields = liveResults.fields.data() + i * numColumns;
+			if(std::any_of(fields, fields + numColumns, [&params](const QString &field) { return MatchLike(params.what, field); }))
+			{
+				// Only keep what is needed for the next refinement
+				liveResults.ids[numMatches] = liveResults.ids[i];
+				std::move(fields, fields + numColumns, liveResults.fields.begin() + numMatches * numColumns);
+				numMatches++;
+				ids.push_back(liveResults.ids[i]);
+			}
+		}
+		if(results.cancel)
+		{
+			liveResults.valid = false;
+			return;
+		}
+		liveResults.ids.resize(numMatches);
+		liveResults.fields.resize(numMatches * numColumns);
+		liveResults.params = params;
+		SearchWorker::Publish(results, ids, scores);
+		return;
+	}
+
+	liveResults.valid = false;
+	liveResults.generation = ModDatabase::Instance().WriteGeneration();
+	liveResults.ids.clear();
+	liveResults.fields.clear();
+	QString columnsStr;
+	for(const auto &column : params.textColumns)
+	{
+		columnsStr += ", `" + column + "`";
+	}
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	query.prepare("SELECT `id`" + columnsStr + " FROM `modlib_modules` " + params.whereStr);
+	query.bindValue(":str", params.what);
+	if(!query.exec())
+	{
+		qDebug() << query.lastError();
+		return;
+	}
+
+	bool keepText = true;
+	size_t textSize = 0;
+	QElapsedTimer timer;
+	timer.start();
+	while(!results.cancel && query.next())
+	{
+		const qint64 id = query.value(0).toLongLong();
+		ids.push_back(id);
+		if(keepText)
+		{
+			liveResults.ids.push_back(id);
+			for(int i = 1; i <= numColumns; i++)
+			{
+				liveResults.fields.push_back(query.value(i).toString());
+				textSize += liveResults.fields.back().size();
+			}
+			if(textSize > MAX_LIVE_TEXT)
+			{
+				// Too much text, live searches have to ask the database again
+				keepText = false;
+				liveResults.ids = std::vector<qint64>();
+				liveResults.fields = std::vector<QString>();
+			}
+		}
+		if(ids.size() >= PUBLISH_SIZE || timer.elapsed() >= 50)
+		{
+			SearchWorker::Publish(results, ids, scores);
+			timer.restart();
+		}
+	}
+	SearchWorker::Publish(results, ids, scores);
+	if(keepText && !results.cancel)
+	{
+		liveResults.params = params;
+		liveResults.valid = true;
+	}
+}
+
+
+// Count the facet values of the given modules
+static bool CountFacets(QSqlDatabase &db, const std::vector<qint64> &ids, ModDatabase::FacetCounts &counts, const std::atomic<bool> &cancel)
+{
+	QSqlQuery query(db);
+	query.setForwardOnly(true);
+	for(size_t i = 0; i < ids.size(); i += 512)
+	{
+		if(cancel)
+		{
+			return false;
+		}
+		QString idList;
+		for(size_t j = i; j < std::min(i + 512, ids.size()); j++)
+		{
+			if(j != i)
+				idList += ',';
+			idList += QString::number(ids[j]);
+		}
+		if(!query.exec("SELECT `format`, `num_channels`, `editdate`, `artist` FROM `modlib_modules` WHERE `id` IN (" + idList + ")"))
+		{
+			qDebug() << query.lastError();
+			return false;
+		}
+		while(query.next())
+		{
+			const QStringList values = ModDatabase::FacetValues(query);
+			for(int facet = 0; facet < ModDatabase::NumFacets; facet++)
+			{
+				if(!values[facet].isEmpty())
+					counts[facet][values[facet]]++;
+			}
+		}
+	}
+	return true;
+}
+
+
+// Searches with the same key always find the same results, as long as the database has not been modified in the meantime
+static QString CacheKey(const SearchParameters &params)
+{
+	// LIKE is only case-insensitive for ASCII letters
+	QString what = params.what;
+	for(auto &c : what)
+	{
+		if(c.unicode() < 128)
+			c = c.toLower();
+	}
+	QString key = params.whereStr + '\n' + what + '\n' + QString::number(params.melodyTolerance) + '\n' + QString::number(static_cast<int>(params.order)) + '\n';
+	for(const auto &melody : params.melodies)
+	{
+		key += melody.toHex() + ' ';
+	}
+	if(!params.fingerprint.empty())
+	{
+		const QByteArray fingerprint(reinterpret_cast<const char *>(params.fingerprint.data()), static_cast<int>(params.fingerprint.size() * sizeof(uint32_t)));
+		key += '\n' + QCryptographicHash::hash(fingerprint, QCryptographicHash::Sha1).toHex();
+	}
+	return key;
+}
+
+
+void SearchWorker::RunSearch(QSqlDatabase &db, const SearchParameters &params, ResultBuffer &results)
+{
+	const QString key = CacheKey(params);
+	const quint64 generation = ModDatabase::Instance().WriteGeneration();
+	for(auto entry = resultCache.begin(); entry != resultCache.end(); entry++)
+	{
+		if(entry->key != key)
+			continue;
+		if(entry->generation != generation)
+		{
+			// The database has been modified since
+			resultCache.erase(entry);
+			break;
+		}
+		resultCache.splice(resultCache.begin(), resultCache, entry);
+		{
+			std::lock_guard<std::mutex> lock(results.mutex);
+			results.query = entry->query;
+			results.bindings = entry->bindings;
+			results.fingerprint = entry->fingerprint;
+			results.facets = entry->facets;
+			results.hasFacets = entry->hasFacets;
+		}
+		std::vector<qint64> ids = entry->ids;
+		std::vector<int> scores = entry->scores;
+		Publish(results, ids, scores);
+		return;
+	}
+
+	results.keepAll = true;
+	RunUncachedSearch(db, params, results);
+	if(!results.keepAll || results.cancel)
+	{
+		return;
+	}
+	CachedResults entry;
+	// The library-wide facet counts are already known without looking at the results
+	entry.hasFacets = !params.whereStr.isEmpty() && CountFacets(db, results.allIds, entry.facets, results.cancel);
+	if(results.cancel)
+	{
+		return;
+	}
+	entry.key = key;
+	entry.generation = generation;
+	entry.ids = std::move(results.allIds);
+	entry.scores = std::move(results.allScores);
+	{
+		std::lock_guard<std::mutex> lock(results.mutex);
+		entry.query = results.query;
+		entry.bindings = results.bindings;
+		entry.fingerprint = results.fingerprint;
+		results.facets = entry.facets;
+		results.hasFacets = entry.hasFacets;
+	}
+	resultCache.push_front(std::move(entry));
+	if(resultCache.size() > CACHE_ENTRIES)
+	{
+		resultCache.pop_back();
+	}
+}
+
+
+void SearchWorker::RunUncachedSearch(QSqlDatabase &db, const SearchParameters &params, ResultBuffer &results)
+{
+	if(params.live && params.melodies.empty() && params.fingerprint.empty() && !params.textColumns.isEmpty())
+	{
+		RunLiveSearch(db, params, results);
+		return;
+	}
+
+	const bool fuzzyMelody = params.melodyTolerance > 0 && !params.melodies.empty();
+	QString whereStr = params.whereStr;
+	QVariantMap bindings;
+	bindings[":str"] = params.what;
+	for(size_t i = 0; i < params.melodies.size() && !results.cancel; i++)
+	{
+		if(fuzzyMelody)
+		{
+			// Only scan the note data of modules that contain at least one part of the melody without errors
+			const QString indexCondition = Melody::FuzzyIndexCondition(db, params.melodies[i], params.melodyTolerance);
+			if(!indexCondition.isEmpty())
+			{
+				whereStr += "AND " + indexCondition + " ";
+			}
+		} else
+		{
+			// Only scan the note data of modules that contain all n-grams of the melody
+			const QString indexCondition = Melody::IndexCondition(db, params.melodies[i]);
+			if(!indexCondition.isEmpty())
+			{
+				whereStr += "AND " + indexCondition + " ";
+			}
+			whereStr += "AND INSTR(`note_data`, :note_data" + QString::number(i) + ") > 0 ";
+			bindings[":note_data" + QString::number(i)] = params.melodies[i];
+		}
+	}
+	if(results.cancel)
+	{
+		return;
+	}
+
+	if(!fuzzyMelody)
+	{
+		QString queryStr = "SELECT `id` ";
+		if(!params.fingerprint.empty())
+		{
+			queryStr += ", `fingerprint` ";
+		}
+		queryStr += "FROM `modlib_modules` " + whereStr;
+		RunQuery(db, queryStr, bindings, params.fingerprint, params.order, results);
+		return;
+	}
+
+	// Approximate melody matches are ranked by their own match quality
+	QSqlQuery candidates(db);
+	candidates.setForwardOnly(true);
+	candidates.prepare("SELECT `id`, `note_data` FROM `modlib_modules` " + whereStr);
+	candidates.bindValue(":str", params.what);
+	if(!candidates.exec())
+	{
+		qDebug() << candidates.lastError();
+		return;
+	}
+	std::vector<Melody::FuzzyMatch> matches;
+	if(!Melody::FuzzySearch(candidates, params.melodies, params.melodyTolerance, matches, [&results](const QString &, int, int) { return !results.cancel; }))
+	{
+		return;
+	}
+	std::vector<qint64> ids;
+	std::vector<int> scores;
+	ids.reserve(matches.size());
+	scores.reserve(matches.size());
+	for(const auto &match : matches)
+	{
+		ids.push_back(match.id);
+		scores.push_back(match.score);
+	}
+	if(params.order != ScoreOrder::None)
+	{
+		SortByScore(ids, scores, params.order);
+	}
+	Publish(results, ids, scores);
+}
+
+
+void SearchWorker::FindDuplicates(QSqlDatabase &db, ResultBuffer &results)
+{
+	// Group modules with the same or almost the same patterns, e.g. edited versions of the same song
+	std::vector<qint64> ids;
+	std::vector<int> scores;
+	const int numGroups = Melody::FindNearDuplicates(db, ids, scores);
+	if(numGroups < 0)
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(results.mutex);
+		results.summary = QObject::tr("%1 files in %2 groups of duplicates found.").arg(ids.size()).arg(numGroups);
+	}
+	Publish(results, ids, scores);
+}
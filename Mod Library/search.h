@@ -0,0 +1,139 @@
+/*
+ * search.h
+ * --------
+ * Purpose: Runs searches in the background on a separate database connection.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QSqlDatabase>
+#include <QStringList>
+#include <QVariantMap>
+#include "database.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Module IDs found by a search, shared between the search worker and the table model
+struct ResultBuffer
+{
+	std::mutex mutex;
+	std::vector<qint64> ids;
+	std::vector<int> scores;
+	// Query that produced the results, if any, so that they can be retrieved again in a different order
+	QString query;
+	QVariantMap bindings;
+	std::vector<uint32_t> fingerprint;
+	QString summary;	// Status message to show instead of the number of results
+	ModDatabase::FacetCounts facets;	// Facet values of all results, if they have been counted
+	bool hasFacets;
+	std::atomic<bool> cancel;
+	quint64 job;
+	// All results handed out so far, only maintained by the worker if they are going to be cached
+	std::vector<qint64> allIds;
+	std::vector<int> allScores;
+	bool keepAll;
+
+	ResultBuffer() : hasFacets(false), cancel(false), job(0), keepAll(false) { }
+};
+
+
+// Order in which results with a match quality are handed out
+enum class ScoreOrder { None, Ascending, Descending };
+
+
+// Everything the main window asks for when searching the library
+struct SearchParameters
+{
+	QString whereStr;	// Text, size and date conditions, using the :str placeholder
+	QString text;		// Search text as entered by the user
+	QString what;		// Search text as LIKE pattern
+	QStringList textColumns;
+	std::vector<QByteArray> melodies;
+	int melodyTolerance = 0;
+	std::vector<uint32_t> fingerprint;
+	ScoreOrder order = ScoreOrder::None;
+	bool live = false;	// Search while typing, keeps the searched text of all results in memory
+
+	// Can the results of this search be found by only looking at the results of the previous search?
+	bool Refines(const SearchParameters &previous) const
+	{
+		return live && previous.live && !previous.text.isEmpty() && text.contains(previous.text)
+			&& whereStr == previous.whereStr && melodies.empty() && fingerprint.empty() && previous.melodies.empty() && previous.fingerprint.empty();
+	}
+};
+
+
+// A job receives the worker's database connection and hands its results out through SearchWorker::Publish
+using SearchJob = std::function<void(QSqlDatabase &db, ResultBuffer &results)>;
+// Other work on the worker's database connection that must not block the user interface, e.g. lookups for the table model
+using SearchTask = std::function<void(QSqlDatabase &db)>;
+
+
+// Runs one search job at a time on its own thread and database connection.
+// Starting a new job cancels the one that is currently running, so only the most recent search is ever waited for.
+// Tasks are never cancelled and run in the order they were posted, before the next search job.
+class SearchWorker : public QObject
+{
+	Q_OBJECT
+
+protected:
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::shared_ptr<ResultBuffer> running, pending;
+	SearchJob pendingJob;
+	std::deque<std::pair<quint64, SearchTask>> tasks;
+	QString sourceConnection;
+	quint64 lastJob, lastTask;
+	bool stop;
+
+	SearchWorker();
+
+public:
+	static SearchWorker &Instance();
+	~SearchWorker();
+
+	// Run a job in the background and return its ID. Any job that is still running or waiting is cancelled.
+	quint64 Start(const std::shared_ptr<ResultBuffer> &results, SearchJob job);
+	// Run a task in the background without cancelling any job and return its ID
+	quint64 Post(SearchTask task);
+	// Cancel all jobs and wait for the worker thread to exit
+	void Shutdown();
+
+	// The following functions are only to be called from within a job.
+	// Run a query that returns the module ID in a column called `id`, and its encoded fingerprint in the second column if a fingerprint to compare against is given.
+	static void RunQuery(QSqlDatabase &db, const QString &queryStr, const QVariantMap &bindings, const std::vector<uint32_t> &fingerprint, ScoreOrder order, ResultBuffer &results);
+	static void RunSearch(QSqlDatabase &db, const SearchParameters &params, ResultBuffer &results);
+	static void FindDuplicates(QSqlDatabase &db, ResultBuffer &results);
+	// Hand modules found so far to the model
+	static void Publish(ResultBuffer &results, std::vector<qint64> &ids, std::vector<int> &scores);
+
+	// Find out which of the given modules are returned by a query as passed to RunQuery, together with their match quality.
+	// Can also be called from within a task. Returns false on failure.
+	static bool MatchQuery(QSqlDatabase &db, const QString &queryStr, const QVariantMap &bindings, const std::vector<uint32_t> &fingerprint, const std::vector<qint64> &candidates, std::vector<qint64> &ids, std::vector<int> &scores);
+
+signals:
+	// Emitted from the worker thread
+	void rowsAvailable(quint64 job);
+	void finished(quint64 job);
+	void taskFinished(quint64 task);
+
+protected:
+	void StartThread();
+	void Run();
+	// Called by SQLite while a statement is executed on the worker's connection, aborts the statement if the running job has been cancelled
+	static int OnProgress(void *worker);
+	static void RunUncachedSearch(QSqlDatabase &db, const SearchParameters &params, ResultBuffer &results);
+};
@@ -8,8 +8,43 @@
  */
 
 #include "settings.h"
+#include "batchrender.h"
+#include <algorithm>
 
 SettingsDialog::SettingsDialog(QWidget *parent) : QDialog(parent)
 {
 	ui.setupUi(this);
+
+	const BatchRender::Settings render = BatchRender::Settings::Load();
+	for(const int sampleRate : { 22050, 44100, 48000, 96000, 192000 })
+	{
+		ui.renderSampleRate->addItem(tr("%1 Hz").arg(sampleRate), sampleRate);
+	}
+	if(ui.renderSampleRate->findData(render.sampleRate) < 0)
+	{
+		ui.renderSampleRate->addItem(tr("%1 Hz").arg(render.sampleRate), render.sampleRate);
+	}
+	ui.renderSampleRate->setCurrentIndex(ui.renderSampleRate->findData(render.sampleRate));
+
+	ui.renderInterpolation->addItem(tr("None"), 1);
+	ui.renderInterpolation->addItem(tr("Linear"), 2);
+	ui.renderInterpolation->addItem(tr("Cubic"), 4);
+	ui.renderInterpolation->addItem(tr("Windowed sinc"), 8);
+	ui.renderInterpolation->setCurrentIndex(std::max(0, ui.renderInterpolation->findData(render.interpolation)));
+
+	ui.renderSubsongs->addItem(tr("First subsong only"), BatchRender::FirstSubsong);
+	ui.renderSubsongs->addItem(tr("All subsongs in one file"), BatchRender::AllSubsongs);
+	ui.renderSubsongs->addItem(tr("Each subsong in its own file"), BatchRender::SeparateSubsongs);
+	ui.renderSubsongs->setCurrentIndex(ui.renderSubsongs->findData(render.subsongs));
+}
+
+
+void SettingsDialog::accept()
+{
+	BatchRender::Settings render;
+	render.sampleRate = ui.renderSampleRate->currentData().toInt();
+	render.interpolation = ui.renderInterpolation->currentData().toInt();
+	render.subsongs = static_cast<BatchRender::SubsongMode>(ui.renderSubsongs->currentData().toInt());
+	render.Save();
+	QDialog::accept();
 }
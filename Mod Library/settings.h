@@ -19,6 +19,8 @@ class SettingsDialog : public QDialog
 public:
 	SettingsDialog(QWidget *parent = nullptr);
 
+	void accept() override;
+
 private:
 	Ui_Settings ui;
 };
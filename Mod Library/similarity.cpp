@@ -0,0 +1,369 @@
+/*
+ * similarity.cpp
+ * --------------
+ * Purpose: Fingerprint comparison and library-wide near-duplicate detection.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "similarity.h"
+#include "parallel.h"
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QSettings>
+#include <QDebug>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <numeric>
+#include <chromaprint/src/chromaprint.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <smmintrin.h>
+#endif
+
+
+static const uint8_t BitsSetTable256[256] =
+{
+#	define B2(n) n,     n+1,     n+1,     n+2
+#	define B4(n) B2(n), B2(n+1), B2(n+1), B2(n+2)
+#	define B6(n) B4(n), B4(n+1), B4(n+1), B4(n+2)
+	B6(0), B6(1), B6(1), B6(2)
+};
+
+
+static int CountDifferences(const uint32_t *fp1, const uint32_t *fp2, int length)
+{
+	int differences = 0;
+#ifdef _MSC_VER
+	static const bool hasPopCnt = []()
+	{
+		int CPUInfo[4];
+		__cpuid(CPUInfo, 1);
+		return (CPUInfo[2] & (1 << 23)) != 0;
+	}();
+	if(hasPopCnt)
+	{
+		for(int i = 0; i < length; i++)
+		{
+			differences += _mm_popcnt_u32(fp1[i] ^ fp2[i]);
+		}
+	} else
+#elif defined(__GNUC__)
+	for(int i = 0; i < length; i++)
+	{
+		differences += __builtin_popcount(fp1[i] ^ fp2[i]);
+	}
+	if(0)
+#endif
+	{
+		for(int i = 0; i < length; i++)
+		{
+			union { uint32_t u32; uint8_t u8[4]; } v;
+			v.u32 = fp1[i] ^ fp2[i];
+			differences += BitsSetTable256[v.u8[0]]
+			+ BitsSetTable256[v.u8[1]]
+			+ BitsSetTable256[v.u8[2]]
+			+ BitsSetTable256[v.u8[3]];
+		}
+	}
+	return differences;
+}
+
+
+std::vector<uint32_t> Fingerprint::Decode(const QByteArray &encoded)
+{
+	std::vector<uint32_t> fp;
+	uint32_t *rawFingerprint = nullptr;
+	int rawFingerprintSize = 0;
+	if(!encoded.isEmpty() && chromaprint_decode_fingerprint(encoded.constData(), encoded.size(), &rawFingerprint, &rawFingerprintSize, nullptr, 0) && rawFingerprint != nullptr)
+	{
+		fp.assign(rawFingerprint, rawFingerprint + rawFingerprintSize);
+	}
+	chromaprint_dealloc(rawFingerprint);
+	return fp;
+}
+
+
+int Fingerprint::Compare(const uint32_t *fp1, int size1, const uint32_t *fp2, int size2)
+{
+	const int compareLength = std::min(size1, size2);
+	const int maxMatches = 32 * std::max(size1, size2);
+	if(!maxMatches)
+	{
+		return 0;
+	}
+	int bestDifference = INT_MAX;
+
+	for(int offset = 0; offset < 32 && bestDifference > 0; offset++)
+	{
+		const int thisLength = compareLength - offset;
+		int differences = 32 * std::abs(size1 - size2);
+		if(thisLength > 0)
+		{
+			differences += CountDifferences(fp1 + offset, fp2, thisLength);
+		}
+		bestDifference = std::min(differences, bestDifference);
+	}
+
+	return (100 * (maxMatches - bestDifference)) / maxMatches;
+}
+
+
+std::vector<uint32_t> Fingerprint::IndexKeys(const uint32_t *fp, int size)
+{
+	std::vector<uint32_t> keys;
+	for(int i = 0; i < size; i++)
+	{
+		// Ignore the lowest bits to make the index a bit more forgiving, and only keep
+		// a deterministic sample of all values so that the index stays reasonably small.
+		const uint32_t key = fp[i] >> 4;
+		if(((key * 0x9E3779B1u) >> 29) == 0)
+		{
+			keys.push_back(key);
+		}
+	}
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	return keys;
+}
+
+
+int Fingerprint::MinSharedKeys(size_t numKeys1, size_t numKeys2)
+{
+	return std::max(2, static_cast<int>(std::min(numKeys1, numKeys2) / 10));
+}
+
+
+int Fingerprint::MaxPostingLength(int numModules)
+{
+	return std::max(64, numModules / 50);
+}
+
+
+int Fingerprint::DuplicateThreshold()
+{
+	return QSettings().value("Duplicates/threshold", 85).toInt();
+}
+
+
+int Similarity::ClusterLibrary(QSqlDatabase &db, const ProgressCallback &progress)
+{
+	std::vector<qint64> ids;
+	std::vector<QByteArray> fingerprints;
+	{
+		QSqlQuery query(db);
+		query.setForwardOnly(true);
+		if(!query.exec("SELECT `id`, `fingerprint` FROM `modlib_modules`"))
+		{
+			qDebug() << query.lastError();
+			return -1;
+		}
+		while(query.next())
+		{
+			ids.push_back(query.value(0).toLongLong());
+			fingerprints.push_back(query.value(1).toByteArray());
+			if((ids.size() % 1024u) == 0 && !progress(QObject::tr("Reading fingerprints..."), 0, 0))
+			{
+				return -1;
+			}
+		}
+	}
+	const int numModules = static_cast<int>(ids.size());
+	const int numWorkers = ParallelWorkers();
+
+	std::vector<std::vector<uint32_t>> keys(numModules);
+	if(!ParallelFor(numModules, QObject::tr("Indexing fingerprints..."), progress, [&](int i, int)
+	{
+		const auto fp = Fingerprint::Decode(fingerprints[i]);
+		keys[i] = Fingerprint::IndexKeys(fp.data(), static_cast<int>(fp.size()));
+	}))
+	{
+		return -1;
+	}
+
+	// Inverted index (key -> module) as a sorted list
+	using Posting = std::pair<uint32_t, int>;
+	std::vector<Posting> postings;
+	{
+		size_t numPostings = 0;
+		for(const auto &k : keys)
+		{
+			numPostings += k.size();
+		}
+		postings.reserve(numPostings);
+		for(int i = 0; i < numModules; i++)
+		{
+			for(const auto key : keys[i])
+			{
+				postings.emplace_back(key, i);
+			}
+		}
+		std::sort(postings.begin(), postings.end());
+	}
+	struct KeyLess
+	{
+		bool operator() (const Posting &p, uint32_t key) const { return p.first < key; }
+		bool operator() (uint32_t key, const Posting &p) const { return key < p.first; }
+	};
+	const ptrdiff_t maxPostingLength = Fingerprint::MaxPostingLength(numModules);
+
+	// Only compare module pairs that share a minimum number of index keys
+	struct WorkerState
+	{
+		std::vector<uint32_t> sharedKeys;
+		std::vector<int> candidates;
+		std::vector<std::pair<int, int>> matches;
+	};
+	std::vector<WorkerState> workerState(numWorkers);
+	const int threshold = Fingerprint::DuplicateThreshold();
+	if(!ParallelFor(numModules, QObject::tr("Comparing fingerprints..."), progress, [&](int i, int w)
+	{
+		WorkerState &state = workerState[w];
+		if(state.sharedKeys.empty())
+		{
+			state.sharedKeys.resize(numModules, 0);
+		}
+		for(const auto key : keys[i])
+		{
+			const auto range = std::equal_range(postings.cbegin(), postings.cend(), key, KeyLess());
+			if(range.second - range.first > maxPostingLength)
+			{
+				continue;
+			}
+			for(auto p = range.first; p != range.second; p++)
+			{
+				// Only look at each pair once
+				const int j = p->second;
+				if(j > i && state.sharedKeys[j]++ == 0)
+				{
+					state.candidates.push_back(j);
+				}
+			}
+		}
+
+		std::vector<uint32_t> fp1;
+		for(const int j : state.candidates)
+		{
+			if(state.sharedKeys[j] >= static_cast<uint32_t>(Fingerprint::MinSharedKeys(keys[i].size(), keys[j].size())))
+			{
+				if(fp1.empty())
+				{
+					fp1 = Fingerprint::Decode(fingerprints[i]);
+				}
+				const auto fp2 = Fingerprint::Decode(fingerprints[j]);
+				if(Fingerprint::Compare(fp1.data(), static_cast<int>(fp1.size()), fp2.data(), static_cast<int>(fp2.size())) >= threshold)
+				{
+					state.matches.emplace_back(i, j);
+				}
+			}
+			state.sharedKeys[j] = 0;
+		}
+		state.candidates.clear();
+	}))
+	{
+		return -1;
+	}
+
+	// Merge matches into clusters. The root of each cluster is always the module with the lowest ID.
+	std::vector<int> parent(numModules);
+	std::iota(parent.begin(), parent.end(), 0);
+	const auto findRoot = [&parent](int i)
+	{
+		while(parent[i] != i)
+		{
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	};
+	for(const auto &state : workerState)
+	{
+		for(const auto &match : state.matches)
+		{
+			const int a = findRoot(match.first), b = findRoot(match.second);
+			if(a == b)
+				continue;
+			if(ids[a] < ids[b])
+				parent[b] = a;
+			else
+				parent[a] = b;
+		}
+	}
+	std::vector<int> clusterSize(numModules, 0);
+	int numClusters = 0;
+	for(int i = 0; i < numModules; i++)
+	{
+		if(++clusterSize[findRoot(i)] == 2)
+		{
+			numClusters++;
+		}
+	}
+
+	// Replace the stored index and clusters
+	db.transaction();
+	QSqlQuery query(db);
+	if(!query.exec("DELETE FROM `modlib_fp_index`") || !query.exec("DELETE FROM `modlib_clusters`"))
+	{
+		qDebug() << query.lastError();
+		db.rollback();
+		return -1;
+	}
+	query.prepare("INSERT INTO `modlib_fp_index` (`key`, `module_id`) VALUES (?, ?)");
+	QVariantList keyList, idList;
+	for(int i = 0; i < numModules; i++)
+	{
+		for(const auto key : keys[i])
+		{
+			keyList << key;
+			idList << ids[i];
+		}
+		if(keyList.size() >= 4096 || i == numModules - 1)
+		{
+			query.bindValue(0, keyList);
+			query.bindValue(1, idList);
+			if(!query.execBatch() || !progress(QObject::tr("Writing fingerprint index..."), i, numModules))
+			{
+				qDebug() << query.lastError();
+				db.rollback();
+				return -1;
+			}
+			keyList.clear();
+			idList.clear();
+		}
+	}
+	query.prepare("INSERT INTO `modlib_clusters` (`module_id`, `cluster_id`) VALUES (?, ?)");
+	for(int i = 0; i < numModules; i++)
+	{
+		const int root = findRoot(i);
+		if(clusterSize[root] > 1)
+		{
+			query.bindValue(0, ids[i]);
+			query.bindValue(1, ids[root]);
+			if(!query.exec())
+			{
+				qDebug() << query.lastError();
+				db.rollback();
+				return -1;
+			}
+		}
+	}
+	// From now on, modules are added to the index and clusters as they are added or updated
+	if(!query.exec("INSERT OR REPLACE INTO `modlib_schema` (`name`, `value`) VALUES ('clustered', '1')"))
+	{
+		qDebug() << query.lastError();
+		db.rollback();
+		return -1;
+	}
+	db.commit();
+
+	return numClusters;
+}
+
+
+bool Similarity::IsClustered(QSqlDatabase &db)
+{
+	QSqlQuery query(db);
+	return query.exec("SELECT `value` FROM `modlib_schema` WHERE `name` = 'clustered'") && query.next() && query.value(0).toInt() != 0;
+}
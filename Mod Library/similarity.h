@@ -0,0 +1,48 @@
+/*
+ * similarity.h
+ * ------------
+ * Purpose: Fingerprint comparison and library-wide near-duplicate detection.
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QSqlDatabase>
+#include "parallel.h"
+#include <cstdint>
+#include <vector>
+
+namespace Fingerprint
+{
+	// Decode a fingerprint as stored in the database
+	std::vector<uint32_t> Decode(const QByteArray &encoded);
+
+	// Compare two raw fingerprints, returns the match quality in percent
+	int Compare(const uint32_t *fp1, int size1, const uint32_t *fp2, int size2);
+
+	// Sampled, sorted and unique keys of a raw fingerprint, used for looking up candidates in the fingerprint index
+	std::vector<uint32_t> IndexKeys(const uint32_t *fp, int size);
+
+	// Minimum number of index keys that two fingerprints need to share to be considered for a full comparison
+	int MinSharedKeys(size_t numKeys1, size_t numKeys2);
+
+	// Keys shared by more modules than this (e.g. silence) are useless for finding candidates
+	int MaxPostingLength(int numModules);
+
+	// Minimum match quality for two modules to be considered duplicates
+	int DuplicateThreshold();
+}
+
+
+namespace Similarity
+{
+	// Rebuild the fingerprint index and the duplicate clusters of the whole library.
+	// Returns the number of clusters found, or -1 if the job was cancelled or failed.
+	int ClusterLibrary(QSqlDatabase &db, const ProgressCallback &progress);
+
+	// True if the whole library has been clustered before. Until then, added and updated modules are not indexed one by one.
+	bool IsClustered(QSqlDatabase &db);
+}
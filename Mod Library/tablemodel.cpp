@@ -0,0 +1,896 @@
+/*
+ * tablemodel.cpp
+ * --------------
+ * Purpose: Data model for the main result table
+ * Notes  : (currently none)
+ * Authors: Johannes Schultz
+ * The Mod Library source code is released under the BSD license. Read LICENSE for more details.
+ */
+
+#include "tablemodel.h"
+#include "database.h"
+#include <QDateTime>
+#include <QEventLoop>
+#include <QFileInfo>
+#include <QHash>
+#include <QPointer>
+#include <QSet>
+#include <QDebug>
+#include <algorithm>
+#include <numeric>
+
+// Number of rows that are added to the table at once
+static constexpr size_t PAGE_SIZE = 1024;
+// Number of rows whose display data is retrieved from the database at once
+static constexpr size_t CACHE_BLOCK_SIZE = 64;
+// Size of the strings of refreshed or removed modules that is tolerated before the string arena is compacted
+static constexpr size_t MAX_UNUSED_STRINGS = 256 * 1024;
+
+
+TableModel::TableModel(SearchJob searchJob, bool hasScore, int initialSortColumn, Qt::SortOrder initialSortOrder)
+	: locale(QLocale::system()), job(0), changeTask(0), sortTask(0), sortColumn(initialSortColumn), pendingSortColumn(-1), sortOrder(initialSortOrder), pendingSortOrder(Qt::AscendingOrder), hasScore(hasScore), hasFacets(false), loading(false), fetchPending(false), cacheScheduled(false)
+{
+	const SearchWorker &worker = SearchWorker::Instance();
+	connect(&worker, &SearchWorker::rowsAvailable, this, [this](quint64 finishedJob)
+	{
+		if(finishedJob == job)
+			OnRowsAvailable();
+	}, Qt::QueuedConnection);
+	connect(&worker, &SearchWorker::finished, this, [this](quint64 finishedJob)
+	{
+		if(finishedJob == job)
+			OnJobFinished();
+	}, Qt::QueuedConnection);
+	connect(&worker, &SearchWorker::taskFinished, this, [this](quint64 finishedTask)
+	{
+		if(finishedTask == changeTask)
+			OnChangesLookedUp();
+		else if(finishedTask == sortTask)
+			OnSortKeysLoaded();
+	}, Qt::QueuedConnection);
+	connect(&ChangeNotifier::Instance(), &ChangeNotifier::modulesChanged, this, &TableModel::OnModulesChanged);
+	StartJob(std::move(searchJob));
+}
+
+
+TableModel::~TableModel()
+{
+	if(buffer)
+	{
+		// The worker may still be running the job and will notice this on the next row
+		buffer->cancel = true;
+	}
+}
+
+
+// Discard all current results and run a new search job in the background
+void TableModel::StartJob(SearchJob searchJob)
+{
+	if(buffer)
+	{
+		buffer->cancel = true;
+	}
+	buffer = std::make_shared<ResultBuffer>();
+	ids.clear();
+	scores.clear();
+	fileSizes.clear();
+	fileDates.clear();
+	stringOffsets.clear();
+	fileNameLengths.clear();
+	titleLengths.clear();
+	strings.clear();
+	order.clear();
+	pendingRows.clear();
+	// The new job sees all changes that have been looked up so far
+	changeLookup.reset();
+	sortKeys.reset();
+	changeTask = sortTask = 0;
+	loading = true;
+	fetchPending = false;
+	job = SearchWorker::Instance().Start(buffer, std::move(searchJob));
+}
+
+
+int TableModel::rowCount(const QModelIndex &parent) const
+{
+	return parent.isValid() ? 0 : static_cast<int>(order.size());
+}
+
+
+int TableModel::columnCount(const QModelIndex &) const
+{
+	return hasScore ? 4 : 3;
+}
+
+
+bool TableModel::canFetchMore(const QModelIndex &parent) const
+{
+	return !parent.isValid() && (order.size() < ids.size() || loading);
+}
+
+
+void TableModel::fetchMore(const QModelIndex &parent)
+{
+	if(parent.isValid())
+	{
+		return;
+	}
+	TakeResults();
+	if(order.size() < ids.size())
+	{
+		Publish(PAGE_SIZE);
+	} else if(loading)
+	{
+		// The view wants more rows than have been found so far, show them as soon as they arrive
+		fetchPending = true;
+	}
+}
+
+
+void TableModel::OnRowsAvailable()
+{
+	TakeResults();
+	if(ApplyPendingSort())
+	{
+		return;
+	}
+	if(fetchPending || order.empty())
+	{
+		fetchPending = false;
+		Publish(PAGE_SIZE);
+	}
+}
+
+
+void TableModel::OnJobFinished()
+{
+	TakeResults();
+	loading = false;
+	if(ApplyPendingSort() && loading)
+	{
+		// The search is run again in the requested order
+		return;
+	}
+	if(fetchPending || order.empty())
+	{
+		fetchPending = false;
+		Publish(PAGE_SIZE);
+	}
+	ApplyChanges();
+	emit loadingFinished(NumResults());
+}
+
+
+// Keep the results up to date while the library is being modified, e.g. by an import
+void TableModel::OnModulesChanged(const QVector<qint64> &inserted, const QVector<qint64> &updated, const QVector<qint64> &removed)
+{
+	changedModules.insert(changedModules.end(), inserted.begin(), inserted.end());
+	changedModules.insert(changedModules.end(), updated.begin(), updated.end());
+	removedModules.insert(removedModules.end(), removed.begin(), removed.end());
+	if(!loading)
+	{
+		// Changes that arrive during a search are applied once it has finished, as the search may or may not have seen them
+		ApplyChanges();
+	}
+}
+
+
+// Add and remove the changed modules depending on whether they are still found by the search query.
+// Results without a query can only lose modules that have been removed from the library.
+// New results are added to the end of the table, regardless of how it is sorted.
+void TableModel::ApplyChanges()
+{
+	if(changeTask || (changedModules.empty() && removedModules.empty()))
+	{
+		// Changes that arrive during a lookup are applied once it has finished
+		return;
+	}
+
+	auto lookup = std::make_shared<ChangeLookup>();
+	for(const qint64 id : changedModules)
+		lookup->changed.insert(id);
+	for(const qint64 id : removedModules)
+		lookup->removed.insert(id);
+	changedModules.clear();
+	removedModules.clear();
+	if(queryStr.isEmpty())
+	{
+		ApplyChanges(lookup->changed, lookup->removed, QHash<qint64, int>(), false);
+		return;
+	}
+
+	// Find out in the background which of the changed modules are found by the query, and with which match quality
+	std::vector<qint64> candidates(lookup->changed.cbegin(), lookup->changed.cend());
+	candidates.insert(candidates.end(), lookup->removed.cbegin(), lookup->removed.cend());
+	changeLookup = lookup;
+	changeTask = SearchWorker::Instance().Post([lookup, candidates = std::move(candidates), queryStr = queryStr, bindings = bindings, fingerprint = fingerprint](QSqlDatabase &db)
+	{
+		lookup->ok = SearchWorker::MatchQuery(db, queryStr, bindings, fingerprint, candidates, lookup->ids, lookup->scores);
+	});
+}
+
+
+void TableModel::OnChangesLookedUp()
+{
+	const auto lookup = std::move(changeLookup);
+	changeTask = 0;
+	QHash<qint64, int> matches;
+	for(size_t i = 0; i < lookup->ids.size(); i++)
+	{
+		matches.insert(lookup->ids[i], lookup->scores.empty() ? 0 : lookup->scores[i]);
+	}
+	ApplyChanges(lookup->changed, lookup->removed, std::move(matches), lookup->ok);
+	if(!loading)
+	{
+		// Changes that have arrived during the lookup
+		ApplyChanges();
+	}
+}
+
+
+// Matches contains the match quality of all changed modules that are found by the query
+void TableModel::ApplyChanges(const QSet<qint64> &changed, const QSet<qint64> &removed, QHash<qint64, int> matches, bool hasQuery)
+{
+	TakeResults();
+
+	// New index of each module, or -1 if it is no longer part of the results
+	const bool keepScores = hasScore;
+	std::vector<int> newIndex(ids.size());
+	std::vector<bool> refreshed;
+	int numKept = 0;
+	for(size_t module = 0; module < ids.size(); module++)
+	{
+		const qint64 id = ids[module];
+		bool keep = true, refresh = false;
+		if(hasQuery && (changed.contains(id) || removed.contains(id)))
+		{
+			const auto match = matches.constFind(id);
+			keep = refresh = (match != matches.constEnd());
+			if(keep)
+			{
+				if(keepScores)
+					scores[module] = match.value();
+				matches.erase(match);
+			}
+		} else if(removed.contains(id))
+		{
+			keep = false;
+		} else if(changed.contains(id))
+		{
+			refresh = true;
+		}
+		if(refresh)
+		{
+			stringOffsets[module] = NOT_CACHED;
+		}
+		newIndex[module] = keep ? numKept++ : -1;
+		if(keep)
+			refreshed.push_back(refresh);
+	}
+	const bool countChanged = (static_cast<size_t>(numKept) != ids.size()) || !matches.isEmpty();
+
+	if(static_cast<size_t>(numKept) != ids.size())
+	{
+		// Remove the rows of the modules that are gone, in contiguous blocks
+		for(int row = static_cast<int>(order.size()) - 1; row >= 0; row--)
+		{
+			if(newIndex[order[row]] >= 0)
+				continue;
+			int first = row;
+			while(first > 0 && newIndex[order[first - 1]] < 0)
+			{
+				first--;
+			}
+			beginRemoveRows(QModelIndex(), first, row);
+			order.erase(order.begin() + first, order.begin() + row + 1);
+			endRemoveRows();
+			row = first;
+		}
+		pendingRows.clear();
+
+		// Close the gaps in the module data. Published modules keep coming before all unpublished ones.
+		for(size_t module = 0; module < ids.size(); module++)
+		{
+			const int target = newIndex[module];
+			if(target < 0 || static_cast<size_t>(target) == module)
+				continue;
+			ids[target] = ids[module];
+			if(keepScores)
+				scores[target] = scores[module];
+			fileSizes[target] = fileSizes[module];
+			fileDates[target] = fileDates[module];
+			stringOffsets[target] = stringOffsets[module];
+			fileNameLengths[target] = fileNameLengths[module];
+			titleLengths[target] = titleLengths[module];
+		}
+		ids.resize(numKept);
+		if(keepScores)
+			scores.resize(numKept);
+		ResizeColumns();
+		for(int &module : order)
+		{
+			module = newIndex[module];
+		}
+	}
+
+	// Show the new data of modules that are still part of the results
+	int firstRow = -1, lastRow = -1;
+	for(int row = 0; row < static_cast<int>(order.size()); row++)
+	{
+		if(refreshed[order[row]])
+		{
+			if(firstRow < 0)
+				firstRow = row;
+			lastRow = row;
+		}
+	}
+	CompactStrings();
+	if(firstRow >= 0)
+	{
+		emit dataChanged(index(firstRow, 0), index(lastRow, columnCount() - 1));
+	}
+
+	if(hasQuery && !matches.isEmpty())
+	{
+		// Modules that are now found by the query for the first time
+		const bool allPublished = (order.size() == ids.size());
+		std::vector<qint64> newIds;
+		newIds.reserve(matches.size());
+		for(auto match = matches.cbegin(); match != matches.cend(); match++)
+		{
+			newIds.push_back(match.key());
+		}
+		std::sort(newIds.begin(), newIds.end());
+		for(const qint64 id : newIds)
+		{
+			ids.push_back(id);
+			if(keepScores)
+				scores.push_back(matches.value(id));
+		}
+		ResizeColumns();
+		if(allPublished)
+		{
+			Publish(newIds.size());
+		}
+	}
+
+	if(countChanged)
+	{
+		emit resultsChanged(NumResults());
+	}
+}
+
+
+// Sort as requested by the view while the search was still running, as soon as possible. Returns true if the results were sorted.
+bool TableModel::ApplyPendingSort()
+{
+	if(pendingSortColumn < 0 || (loading && queryStr.isEmpty()))
+	{
+		return false;
+	}
+	const int column = pendingSortColumn;
+	pendingSortColumn = -1;
+	sort(column, pendingSortOrder);
+	return true;
+}
+
+
+// Move all results found by the worker so far into the model, without showing them yet
+void TableModel::TakeResults()
+{
+	if(!buffer)
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(buffer->mutex);
+	if(queryStr.isEmpty() && !buffer->query.isEmpty())
+	{
+		queryStr = buffer->query;
+		bindings = buffer->bindings;
+		fingerprint = buffer->fingerprint;
+	}
+	if(!buffer->summary.isEmpty())
+	{
+		summary = buffer->summary;
+	}
+	if(buffer->hasFacets)
+	{
+		facets = buffer->facets;
+		hasFacets = true;
+	}
+	if(ids.empty())
+	{
+		ids.swap(buffer->ids);
+		scores.swap(buffer->scores);
+	} else
+	{
+		ids.insert(ids.end(), buffer->ids.begin(), buffer->ids.end());
+		scores.insert(scores.end(), buffer->scores.begin(), buffer->scores.end());
+		buffer->ids.clear();
+		buffer->scores.clear();
+	}
+	ResizeColumns();
+}
+
+
+void TableModel::ResizeColumns()
+{
+	fileSizes.resize(ids.size());
+	fileDates.resize(ids.size());
+	stringOffsets.resize(ids.size(), NOT_CACHED);
+	fileNameLengths.resize(ids.size());
+	titleLengths.resize(ids.size());
+}
+
+
+// Add up to maxRows of the results that have not been shown yet to the table
+void TableModel::Publish(size_t maxRows)
+{
+	const size_t first = order.size();
+	const size_t count = std::min(maxRows, ids.size() - first);
+	if(!count)
+	{
+		return;
+	}
+	beginInsertRows(QModelIndex(), static_cast<int>(first), static_cast<int>(first + count - 1));
+	order.resize(first + count);
+	std::iota(order.begin() + first, order.end(), static_cast<int>(first));
+	endInsertRows();
+}
+
+
+// Show the published rows in a different order, keeping the selection and current index on the same modules
+void TableModel::SetOrder(std::vector<int> newOrder)
+{
+	emit layoutAboutToBeChanged();
+	const QModelIndexList oldIndices = persistentIndexList();
+	std::vector<int> oldModules;
+	oldModules.reserve(oldIndices.size());
+	for(const auto &oldIndex : oldIndices)
+	{
+		oldModules.push_back((oldIndex.isValid() && static_cast<size_t>(oldIndex.row()) < order.size()) ? order[oldIndex.row()] : -1);
+	}
+
+	order = std::move(newOrder);
+	std::vector<int> newRows(ids.size(), -1);
+	for(size_t row = 0; row < order.size(); row++)
+	{
+		newRows[order[row]] = static_cast<int>(row);
+	}
+	QModelIndexList newIndices;
+	newIndices.reserve(oldIndices.size());
+	for(int i = 0; i < oldIndices.size(); i++)
+	{
+		const int module = oldModules[i];
+		newIndices.push_back((module >= 0 && newRows[module] >= 0) ? index(newRows[module], oldIndices[i].column()) : QModelIndex());
+	}
+	changePersistentIndexList(oldIndices, newIndices);
+	emit layoutChanged();
+}
+
+
+bool TableModel::FetchAll()
+{
+	if(loading)
+	{
+		// Keep the user interface responsive while waiting, a new search may even replace this one
+		QPointer<TableModel> self(this);
+		QEventLoop loop;
+		connect(this, &TableModel::loadingFinished, &loop, &QEventLoop::quit);
+		connect(this, &QObject::destroyed, &loop, &QEventLoop::quit);
+		loop.exec();
+		if(!self)
+		{
+			return false;
+		}
+	}
+	TakeResults();
+	Publish(ids.size());
+	return true;
+}
+
+
+// Retrieve the display data of the given modules from the database
+void TableModel::CacheEntries(const int *indices, size_t count) const
+{
+	QString idList;
+	QHash<qint64, int> moduleIndex;
+	for(size_t i = 0; i < count; i++)
+	{
+		const int module = indices[i];
+		if(stringOffsets[module] != NOT_CACHED)
+			continue;
+		// Modules that have been removed from the database in the meantime have an empty file name
+		stringOffsets[module] = static_cast<uint32_t>(strings.size());
+		fileNameLengths[module] = 0;
+		titleLengths[module] = 0;
+		moduleIndex.insert(ids[module], module);
+		if(!idList.isEmpty())
+			idList += ',';
+		idList += QString::number(ids[module]);
+	}
+	if(idList.isEmpty())
+	{
+		return;
+	}
+
+	QSqlQuery query(ModDatabase::Instance().GetDB());
+	query.setForwardOnly(true);
+	if(query.exec("SELECT `id`, `filename`, `title`, `filesize`, `filedate` FROM `modlib_modules` WHERE `id` IN (" + idList + ")"))
+	{
+		while(query.next())
+		{
+			const auto index = moduleIndex.find(query.value(0).toLongLong());
+			if(index == moduleIndex.end())
+				continue;
+			const int module = index.value();
+			moduleIndex.erase(index);
+		const QByteArray fileName = query.value(1).toString().toUtf8().left(UINT16_MAX);
+		const QByteArray title = query.value(2).toString().toUtf8().left(UINT16_MAX);
+			stringOffsets[module] = static_cast<uint32_t>(strings.size());
+			fileNameLengths[module] = static_cast<uint16_t>(fileName.size());
+			titleLengths[module] = static_cast<uint16_t>(title.size());
+			strings.insert(strings.end(), fileName.cbegin(), fileName.cend());
+			strings.insert(strings.end(), title.cbegin(), title.cend());
+			fileSizes[module] = query.value(3).toInt();
+			fileDates[module] = query.value(4).toUInt();
+		}
+	}
+	if(query.lastError().isValid())
+	{
+		// Modules that have not been retrieved are tried again the next time they are needed, instead of being shown as removed
+		qDebug() << query.lastError();
+		for(const int module : moduleIndex)
+		{
+			stringOffsets[module] = NOT_CACHED;
+		}
+	}
+}
+
+
+// Refreshed modules are cached again at the end of the string arena, and removed modules leave their strings behind.
+// Once these take up more space than the strings that are still used, copy the used strings to a new arena.
+void TableModel::CompactStrings()
+{
+	size_t usedSize = 0;
+	for(size_t module = 0; module < ids.size(); module++)
+	{
+		if(stringOffsets[module] != NOT_CACHED)
+			usedSize += fileNameLengths[module] + titleLengths[module];
+	}
+	if(strings.size() - usedSize <= std::max(usedSize, MAX_UNUSED_STRINGS))
+	{
+		return;
+	}
+	std::vector<char> compacted;
+	compacted.reserve(usedSize);
+	for(size_t module = 0; module < ids.size(); module++)
+	{
+		if(stringOffsets[module] == NOT_CACHED)
+			continue;
+		const auto first = strings.cbegin() + stringOffsets[module];
+		stringOffsets[module] = static_cast<uint32_t>(compacted.size());
+		compacted.insert(compacted.end(), first, first + fileNameLengths[module] + titleLengths[module]);
+	}
+	strings.swap(compacted);
+}
+
+
+QString TableModel::FileName(int module) const
+{
+	return QString::fromUtf8(strings.data() + stringOffsets[module], fileNameLengths[module]);
+}
+
+
+QString TableModel::Title(int module) const
+{
+	if(!titleLengths[module])
+		return QFileInfo(FileName(module)).fileName();
+	return QString::fromUtf8(strings.data() + stringOffsets[module] + fileNameLengths[module], titleLengths[module]);
+}
+
+
+QVariant TableModel::data(const QModelIndex &index, int role) const
+{
+	if(size_t(index.row()) >= order.size())
+	{
+		return QVariant();
+	}
+	const int module = order[index.row()];
+	if(role == Qt::DisplayRole && index.column() == SCORE_TABLE)
+	{
+		return hasScore ? scores[module] : QVariant();
+	}
+
+	if(stringOffsets[module] == NOT_CACHED)
+	{
+		if(role == Qt::DisplayRole || role == Qt::ToolTipRole || role == Qt::UserRole)
+		{
+			// Don't block painting or tooltips, the row is updated as soon as its data has been retrieved
+			if(!cacheScheduled)
+			{
+				cacheScheduled = true;
+				QMetaObject::invokeMethod(const_cast<TableModel *>(this), &TableModel::CachePendingRows, Qt::QueuedConnection);
+			}
+			pendingRows.push_back(index.row());
+		}
+		return QVariant();
+	}
+	if(!fileNameLengths[module])
+	{
+		// Module has been removed from the database in the meantime
+		return (role == Qt::DisplayRole && index.column() == TITLE_TABLE) ? QVariant("n/a") : QVariant();
+	}
+
+	if(role == Qt::DisplayRole)
+	{
+		// Display strings are only created when they are needed
+		switch(index.column())
+		{
+		case TITLE_TABLE:
+			return Title(module);
+		case FILESIZE_TABLE:
+			{
+				const int fileSize = fileSizes[module];
+				if(fileSize < 1024)
+					return QString::number(fileSize) + " B";
+				else if(fileSize < 1024 * 1024)
+					return QString::number(fileSize / 1024) + " KiB";
+				else
+					return QString("%1.%2 MiB").arg(fileSize / (1024 * 1024)).arg((((fileSize / 1024) % 1024) * 100) / 1024, 2, 10, QChar('0'));
+			}
+		case FILEDATE_TABLE:
+			return locale.toString(QDateTime::fromSecsSinceEpoch(fileDates[module]), QLocale::ShortFormat);
+		}
+	} else if(role == Qt::ToolTipRole || role == Qt::UserRole)
+	{
+		return FileName(module);
+	}
+	return QVariant();
+}
+
+
+// File name of the module in the given row, for actions that need it right away, such as opening or rendering the module.
+// Unlike data(), this retrieves the row from the database if necessary.
+QString TableModel::RowFileName(int row) const
+{
+	if(row < 0 || static_cast<size_t>(row) >= order.size())
+	{
+		return QString();
+	}
+	const int module = order[row];
+	if(stringOffsets[module] == NOT_CACHED)
+	{
+		// Fetch it together with the following rows
+		const size_t first = row - (row % CACHE_BLOCK_SIZE);
+		CacheEntries(order.data() + first, std::min(CACHE_BLOCK_SIZE, order.size() - first));
+	}
+	return (stringOffsets[module] == NOT_CACHED) ? QString() : FileName(module);
+}
+
+
+// Retrieve the display data of all rows that have been painted without being cached
+void TableModel::CachePendingRows()
+{
+	cacheScheduled = false;
+	std::sort(pendingRows.begin(), pendingRows.end());
+	pendingRows.erase(std::unique(pendingRows.begin(), pendingRows.end()), pendingRows.end());
+	while(!pendingRows.empty() && static_cast<size_t>(pendingRows.back()) >= order.size())
+	{
+		pendingRows.pop_back();
+	}
+	if(pendingRows.empty())
+	{
+		return;
+	}
+
+	std::vector<int> indices;
+	indices.reserve(pendingRows.size());
+	for(const int row : pendingRows)
+	{
+		indices.push_back(order[row]);
+	}
+	for(size_t i = 0; i < indices.size(); i += 256)
+	{
+		CacheEntries(indices.data() + i, std::min(size_t(256), indices.size() - i));
+	}
+	emit dataChanged(index(pendingRows.front(), 0), index(pendingRows.back(), columnCount() - 1), { Qt::DisplayRole });
+	pendingRows.clear();
+}
+
+
+// Widest text that is expected to appear in a column, for estimating its width without looking at all rows
+QString TableModel::SampleText(int column) const
+{
+	switch(column)
+	{
+	case FILESIZE_TABLE:
+		return "8888.88 MiB";
+	case FILEDATE_TABLE:
+		return locale.toString(QDateTime(QDate(2000, 12, 28), QTime(20, 58, 58)), QLocale::ShortFormat);
+	case SCORE_TABLE:
+		return "100";
+	}
+	return QString();
+}
+
+
+QVariant TableModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+	if(role == Qt::DisplayRole && orientation == Qt::Horizontal)
+	{
+		switch(section)
+		{
+		case TITLE_TABLE:
+			return tr("Title");
+		case FILESIZE_TABLE:
+			return tr("File Size");
+		case FILEDATE_TABLE:
+			return tr("Last Modified");
+		case SCORE_TABLE:
+			return tr("Match %");
+		}
+	}
+	return QVariant();
+}
+
+
+// Search query in the current order of the table, returning the given columns of the search results (`results`) or of `modlib_modules` (`sorted`).
+// Returns an empty string if the order is only known to the model.
+QString TableModel::SortedQuery(const QString &columns) const
+{
+	static const char *sortColumns[] = { "title_sortkey", "filesize", "filedate" };
+	if(queryStr.isEmpty() || sortColumn == SCORE_TABLE)
+	{
+		return QString();
+	}
+	QString sortedQuery = "SELECT " + columns + " FROM (" + queryStr + ") AS `results` INNER JOIN `modlib_modules` AS `sorted` ON `sorted`.`id` = `results`.`id`";
+	if(sortColumn >= 0)
+	{
+		const QString direction = (sortOrder == Qt::DescendingOrder) ? " DESC" : " ASC";
+		sortedQuery += QString(" ORDER BY `sorted`.`") + sortColumns[sortColumn] + "`" + direction + ", `sorted`.`id`" + direction;
+	}
+	return sortedQuery;
+}
+
+
+// Module IDs of all rows that are currently shown, in the order of the table
+std::vector<qint64> TableModel::RowIds() const
+{
+	std::vector<qint64> rowIds;
+	rowIds.reserve(order.size());
+	for(const int module : order)
+	{
+		rowIds.push_back(ids[module]);
+	}
+	return rowIds;
+}
+
+
+void TableModel::sort(int column, Qt::SortOrder sortOrder)
+{
+	static const char *sortColumns[] = { "title_sortkey", "filesize", "filedate" };
+	const bool descending = (sortOrder == Qt::DescendingOrder);
+	if(column < 0 || column >= columnCount() || (column == SCORE_TABLE && !hasScore))
+	{
+		return;
+	}
+
+	if(queryStr.isEmpty() && loading)
+	{
+		// Neither the query nor all results are known yet
+		pendingSortColumn = column;
+		pendingSortOrder = sortOrder;
+		return;
+	}
+	sortColumn = column;
+	this->sortOrder = sortOrder;
+
+	if(!queryStr.isEmpty() && loading)
+	{
+		// Not all results are known yet. Let the worker run the search query again in the requested order, and show the results while they are being loaded again.
+		SearchJob sortJob;
+		if(column == SCORE_TABLE)
+		{
+			sortJob = [queryStr = queryStr, bindings = bindings, fingerprint = fingerprint, descending](QSqlDatabase &db, ResultBuffer &results)
+			{
+				SearchWorker::RunQuery(db, queryStr, bindings, fingerprint, descending ? ScoreOrder::Descending : ScoreOrder::Ascending, results);
+			};
+		} else
+		{
+			// The database can use its indices for all other columns
+			const QString sortedQuery = SortedQuery("`results`.*");
+			sortJob = [sortedQuery, bindings = bindings, fingerprint = fingerprint](QSqlDatabase &db, ResultBuffer &results)
+			{
+				SearchWorker::RunQuery(db, sortedQuery, bindings, fingerprint, ScoreOrder::None, results);
+			};
+		}
+		beginResetModel();
+		StartJob(std::move(sortJob));
+		endResetModel();
+		return;
+	}
+
+	// All results are known, so they can be sorted in memory without running the search again or losing the selection
+	sortKeys.reset();
+	sortTask = 0;
+	TakeResults();
+	Publish(ids.size());
+	if(column == SCORE_TABLE)
+	{
+		std::vector<int> newOrder = order;
+		std::stable_sort(newOrder.begin(), newOrder.end(), [this, descending](int a, int b) { return descending ? (scores[a] > scores[b]) : (scores[a] < scores[b]); });
+		SetOrder(std::move(newOrder));
+		return;
+	}
+
+	// Only retrieve the column that is sorted by, in the background
+	auto keys = std::make_shared<SortKeys>();
+	keys->column = column;
+	keys->descending = descending;
+	sortKeys = keys;
+	sortTask = SearchWorker::Instance().Post([keys, ids = ids](QSqlDatabase &db)
+	{
+		QSqlQuery query(db);
+		query.setForwardOnly(true);
+		for(size_t i = 0; i < ids.size(); i += 512)
+		{
+			QString idList;
+			for(size_t j = i; j < std::min(i + 512, ids.size()); j++)
+			{
+				if(j != i)
+					idList += ',';
+				idList += QString::number(ids[j]);
+			}
+			if(!query.exec(QString("SELECT `id`, `") + sortColumns[keys->column] + "` FROM `modlib_modules` WHERE `id` IN (" + idList + ")"))
+			{
+				qDebug() << query.lastError();
+				continue;
+			}
+			while(query.next())
+			{
+				if(keys->column == TITLE_TABLE)
+					keys->textKeys.insert(query.value(0).toLongLong(), query.value(1).toByteArray());
+				else
+					keys->numberKeys.insert(query.value(0).toLongLong(), query.value(1).toLongLong());
+			}
+		}
+	});
+}
+
+
+void TableModel::OnSortKeysLoaded()
+{
+	const auto keys = std::move(sortKeys);
+	sortTask = 0;
+	TakeResults();
+	Publish(ids.size());
+
+	// Modules that have been added in the meantime have no key.
+	// Ties are broken by module ID, so that the order is the same as when the database sorts the results.
+	const bool descending = keys->descending;
+	const auto byKey = [this, descending](const auto &sortKeys)
+	{
+		return [this, &sortKeys, descending](int a, int b)
+		{
+			if(sortKeys[a] == sortKeys[b])
+				return descending ? (ids[a] > ids[b]) : (ids[a] < ids[b]);
+			return descending ? (sortKeys[b] < sortKeys[a]) : (sortKeys[a] < sortKeys[b]);
+		};
+	};
+	std::vector<int> newOrder = order;
+	if(keys->column == TITLE_TABLE)
+	{
+		std::vector<QByteArray> textKeys(ids.size());
+		for(size_t module = 0; module < ids.size(); module++)
+			textKeys[module] = keys->textKeys.value(ids[module]);
+		std::sort(newOrder.begin(), newOrder.end(), byKey(textKeys));
+	} else
+	{
+		std::vector<qint64> numberKeys(ids.size());
+		for(size_t module = 0; module < ids.size(); module++)
+			numberKeys[module] = keys->numberKeys.value(ids[module]);
+		std::sort(newOrder.begin(), newOrder.end(), byKey(numberKeys));
+	}
+	SetOrder(std::move(newOrder));
+}
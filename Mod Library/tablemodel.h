@@ -9,247 +9,130 @@
 
 #pragma once
 #include <QAbstractTableModel>
-#include <QSqlQuery>
+#include <QHash>
+#include <QLocale>
+#include <QSet>
+#include <QVariantMap>
+#include "search.h"
 #include <cstdint>
-#include <algorithm>
-#include <chromaprint/src/chromaprint.h>
-#include <QCollator>
-#include <QDateTime>
-#include <QFileInfo>
-#include <QSize>
+#include <memory>
+#include <vector>
 
 
-static const uint8_t BitsSetTable256[256] =
-{
-#	define B2(n) n,     n+1,     n+1,     n+2
-#	define B4(n) B2(n), B2(n+1), B2(n+1), B2(n+2)
-#	define B6(n) B4(n), B4(n+1), B4(n+1), B4(n+2)
-	B6(0), B6(1), B6(1), B6(2)
-};
-
 class TableModel : public QAbstractTableModel
 {
 	Q_OBJECT
 
 public:
-	struct Entry
+	enum TableColumns { TITLE_TABLE = 0, FILESIZE_TABLE = 1, FILEDATE_TABLE = 2, SCORE_TABLE = 3, };
+
+protected:
+	// Search query that is run again with the requested order when sorting while the results are still being loaded
+	QString queryStr;
+	QVariantMap bindings;
+	std::vector<uint32_t> fingerprint;
+	QString summary;
+	ModDatabase::FacetCounts facets;	// Facet values of all results, if they have been counted
+	QLocale locale;
+
+	std::shared_ptr<ResultBuffer> buffer;
+	quint64 job;					// Results of outdated jobs are ignored
+	std::vector<qint64> ids;		// All module IDs received so far
+	std::vector<int> scores;		// Match quality of each module, if available
+
+	// Display data of each module, in the same order as the IDs. Only valid once the module has been cached.
+	// File names and titles are stored back to back as UTF-8 in a single string arena.
+	static constexpr uint32_t NOT_CACHED = UINT32_MAX;
+	mutable std::vector<int32_t> fileSizes;
+	mutable std::vector<uint32_t> fileDates;
+	mutable std::vector<uint32_t> stringOffsets;
+	mutable std::vector<uint16_t> fileNameLengths, titleLengths;
+	mutable std::vector<char> strings;
+	std::vector<int> order;			// Module order according to current sorting scheme, one entry per published row
+	mutable std::vector<int> pendingRows;	// Rows that have been painted but are not cached yet
+	std::vector<qint64> changedModules, removedModules;	// Library changes that have not been applied to the results yet
+
+	// Lookups that run on the search worker, so that the user interface never waits for the database
+	struct ChangeLookup
 	{
-		QString fileName, title, dateStr, sizeStr;
-		uint fileDate;
-		int fileSize;
-		int match;	// Fingerprint match quality and cache flag at the same time (-1 = not cached yet)
-
-		Entry() : match(-1) { }
+		QSet<qint64> changed, removed;
+		std::vector<qint64> ids;	// Changed modules that are found by the query
+		std::vector<int> scores;
+		bool ok = false;
 	};
-
-	// Database columns
-	enum DBColumns { FILENAME_COLUMN = 0, TITLE_COLUMN = 1, FILESIZE_COLUMN = 2, FILEDATE_COLUMN = 3, FINGERPRINT_COLUMN = 4, };
-	enum TableColumns { TITLE_TABLE = 0, FILESIZE_TABLE = 1, FILEDATE_TABLE = 2, FINGERPRINT_TABLE = 3, };
-
-	mutable QSqlQuery query;
-	std::vector<Entry> modules;
-	std::vector<Entry *> modulesSorted;	// Module order according to current sorting scheme
-
-	uint32_t *rawFingerprint;
-	int rawFingerprintSize;
-	int numRows;
-#ifdef _MSC_VER
-	bool hasPopCnt;
-#endif
-
-	TableModel(QSqlQuery &query, uint32_t *fp, int fpsize) : query(query), numRows(0), rawFingerprint(fp), rawFingerprintSize(fpsize)
+	struct SortKeys
 	{
-#ifdef _MSC_VER
-		int CPUInfo[4];
-		__cpuid(CPUInfo, 1);
-		hasPopCnt = (CPUInfo[2] & (1 << 23)) != 0;
-#endif
-
-		query.exec();
-		// SQLite doesn't have query.size()...
-		while(query.next())
-		{
-			numRows++;
-		}
-		modules.resize(numRows);
-		modulesSorted.resize(numRows);
-		for(int i = 0; i < numRows; i++)
-		{
-			modulesSorted[i] = &modules[i];
-		}
-	}
-
-	~TableModel()
-	{
-		chromaprint_dealloc(rawFingerprint);
-	}
-
-	int rowCount(const QModelIndex & = QModelIndex()) const { return numRows; }
-	int columnCount(const QModelIndex & = QModelIndex()) const { return rawFingerprintSize ? 4 : 3; }
+		int column;
+		bool descending;
+		QHash<qint64, QByteArray> textKeys;
+		QHash<qint64, qint64> numberKeys;
+	};
+	std::shared_ptr<ChangeLookup> changeLookup;
+	std::shared_ptr<SortKeys> sortKeys;
+	quint64 changeTask, sortTask;	// Results of outdated tasks are ignored
+
+	int sortColumn, pendingSortColumn;
+	Qt::SortOrder sortOrder, pendingSortOrder;
+	bool hasScore;
+	bool hasFacets;
+	bool loading;
+	bool fetchPending;
+	mutable bool cacheScheduled;
 
-	bool CacheEntry(Entry &entry) const
-	{
-		entry.match = 0;
-		if(!query.seek(&entry - modules.data()))
-		{
-			return false;
-		}
-
-		entry.fileName = query.value(FILENAME_COLUMN).toString();
-		entry.title = query.value(TITLE_COLUMN).toString();
-		if(entry.title.isEmpty()) entry.title = QFileInfo(entry.fileName).fileName();
-		entry.fileSize = query.value(FILESIZE_COLUMN).toInt();
-		entry.fileDate = query.value(FILEDATE_COLUMN).toInt();
-		entry.dateStr = QLocale::system().toString(QDateTime::fromSecsSinceEpoch(entry.fileDate), QLocale::ShortFormat);
-
-		if(entry.fileSize < 1024)
-			entry.sizeStr = QString::number(entry.fileSize) + " B";
-		else if(entry.fileSize < 1024 * 1024)
-			entry.sizeStr = QString::number(entry.fileSize / 1024) + " KiB";
-		else
-			entry.sizeStr = QString("%1.%2 MiB").arg(entry.fileSize / (1024 * 1024)).arg((((entry.fileSize / 1024) % 1024) * 100) / 1024, 2, 10, QChar('0'));
-
-		if(rawFingerprintSize)
-		{
-			auto modFingerprint = query.value(FINGERPRINT_COLUMN).toByteArray();
-			uint32_t *modRawFingerprint = nullptr;
-			int modRawFingerprintSize = 0;
-			chromaprint_decode_fingerprint(modFingerprint.data(), modFingerprint.size(), &modRawFingerprint, &modRawFingerprintSize, nullptr, 0);
-			const int compareLength = std::min(rawFingerprintSize, modRawFingerprintSize);
-			const int maxMatches = 32 * std::max(rawFingerprintSize, modRawFingerprintSize);
-			int bestDifference = INT_MAX;
-
-			for(int offset = 0; offset < 32 && bestDifference > 0; offset++)
-			{
-				const int thisLength = compareLength - offset;
-				int differences = 32 * std::abs(rawFingerprintSize - modRawFingerprintSize);
-#ifdef _MSC_VER
-				if(hasPopCnt)
-				{
-					for(int i = 0; i < thisLength; i++)
-					{
-						differences += _mm_popcnt_u32(rawFingerprint[offset + i] ^ modRawFingerprint[i]);
-					}
-				} else
-#elif defined(__GNUC__)
-				for(int i = 0; i < thisLength; i++)
-				{
-					differences += __builtin_popcount(rawFingerprint[offset + i] ^ modRawFingerprint[i]);
-				}
-				if(0)
-#endif
-				{
-					for(int i = 0; i < thisLength; i++)
-					{
-						union { uint32_t u32; uint8_t u8[4]; } v;
-						v.u32 = rawFingerprint[offset + i] ^ modRawFingerprint[i];
-						differences += BitsSetTable256[v.u8[0]]
-						+ BitsSetTable256[v.u8[1]]
-						+ BitsSetTable256[v.u8[2]]
-						+ BitsSetTable256[v.u8[3]];
-					}
-				}
-				bestDifference = std::min(differences, bestDifference);
-			}
-
-			entry.match = (100 * (maxMatches - bestDifference)) / maxMatches;
-			chromaprint_dealloc(modRawFingerprint);
-		}
-		return true;
-	}
-
-	QVariant data(const QModelIndex &index, int role) const
-	{
-		if(size_t(index.row()) >= modules.size())
-		{
-			return QVariant();
-		}
-		Entry &entry = *modulesSorted[index.row()];
-
-		if(entry.match == -1)
-		{
-			// Entry isn't cached yet, generate info
-			if(!CacheEntry(entry))
-			{
-				return "n/a";
-			}
-		}
-
-		if(role == Qt::DisplayRole)
-		{
-			switch(index.column())
-			{
-			case TITLE_TABLE:
-				return entry.title;
-			case FILESIZE_TABLE:
-				return entry.sizeStr;
-			case FILEDATE_TABLE:
-				return entry.dateStr;
-			case FINGERPRINT_TABLE:
-				return entry.match;
-			}
-		} else if(role == Qt::ToolTipRole || role == Qt::UserRole)
-		{
-			return entry.fileName;
-		}
-		return QVariant();
-	}
-
-	QVariant headerData(int section, Qt::Orientation orientation, int role) const
-	{
-		if(role == Qt::DisplayRole && orientation == Qt::Horizontal)
-		{
-			switch(section)
-			{
-			case TITLE_TABLE:
-				return tr("Title");
-			case FILESIZE_TABLE:
-				return tr("File Size");
-			case FILEDATE_TABLE:
-				return tr("Last Modified");
-			case FINGERPRINT_TABLE:
-				return tr("Match %");
-			}
-		}
-		return QVariant();
-	}
-
-	void sort(int column, Qt::SortOrder order = Qt::AscendingOrder)
-	{
-		// Complete table needs to be cached for sorting, obviously.
-		for(auto &m : modules)
-		{
-			if(m.match == -1)
-			{
-				CacheEntry(m);
-			}
-		}
-
-		QCollator collator;
-		collator.setNumericMode(true);
-		collator.setCaseSensitivity(Qt::CaseInsensitive);
-
-		switch(column)
-		{
-		case TITLE_TABLE:
-			std::sort(modulesSorted.begin(), modulesSorted.end(), [&collator](const Entry *a, const Entry *b) { return collator.compare(a->title, b->title) < 0; });
-			break;
-		case FILESIZE_TABLE:
-			std::sort(modulesSorted.begin(), modulesSorted.end(), [](const Entry *a, const Entry *b) { return a->fileSize < b->fileSize; });
-			break;
-		case FILEDATE_TABLE:
-			std::sort(modulesSorted.begin(), modulesSorted.end(), [](const Entry *a, const Entry *b) { return a->fileDate < b->fileDate; });
-			break;
-		case FINGERPRINT_TABLE:
-			std::sort(modulesSorted.begin(), modulesSorted.end(), [](const Entry *a, const Entry *b) { return a->match < b->match; });
-			break;
-		}
-		if(order == Qt::DescendingOrder)
-		{
-			std::reverse(modulesSorted.begin(), modulesSorted.end());
-		}
-
-		emit dataChanged(QAbstractItemModel::createIndex(0, 0), QAbstractItemModel::createIndex(rowCount() - 1, columnCount() - 1));
-	}
+public:
+	// Run a search job in the background. If the results are already sorted by one of the columns, the view can be told so through initialSortColumn.
+	TableModel(SearchJob searchJob, bool hasScore, int initialSortColumn = -1, Qt::SortOrder initialSortOrder = Qt::AscendingOrder);
+	~TableModel();
+
+	int rowCount(const QModelIndex &parent = QModelIndex()) const;
+	int columnCount(const QModelIndex &parent = QModelIndex()) const;
+	bool canFetchMore(const QModelIndex &parent) const;
+	void fetchMore(const QModelIndex &parent);
+
+	QVariant data(const QModelIndex &index, int role) const;
+	QVariant headerData(int section, Qt::Orientation orientation, int role) const;
+	void sort(int column, Qt::SortOrder order = Qt::AscendingOrder);
+
+	// Wait for the search to finish and show all results. Returns false if the model was deleted in the meantime.
+	bool FetchAll();
+	bool IsLoading() const { return loading; }
+	int NumResults() const { return static_cast<int>(ids.size()); }
+	QString Summary() const { return summary; }
+	bool HasFacets() const { return hasFacets; }
+	const ModDatabase::FacetCounts &Facets() const { return facets; }
+	int SortColumn() const { return sortColumn; }
+	Qt::SortOrder SortOrder() const { return sortOrder; }
+	QString SampleText(int column) const;
+	QString SortedQuery(const QString &columns) const;
+	const QVariantMap &Bindings() const { return bindings; }
+	std::vector<qint64> RowIds() const;
+	QString RowFileName(int row) const;
+
+signals:
+	void loadingFinished(int numResults);
+	// Modules have been added to or removed from the results because the library has changed
+	void resultsChanged(int numResults);
+
+protected slots:
+	void CachePendingRows();
+
+protected:
+	void StartJob(SearchJob searchJob);
+	void OnRowsAvailable();
+	void OnJobFinished();
+	void OnModulesChanged(const QVector<qint64> &inserted, const QVector<qint64> &updated, const QVector<qint64> &removed);
+	void ApplyChanges();
+	void OnChangesLookedUp();
+	void ApplyChanges(const QSet<qint64> &changed, const QSet<qint64> &removed, QHash<qint64, int> matches, bool hasQuery);
+	void OnSortKeysLoaded();
+	bool ApplyPendingSort();
+	void TakeResults();
+	void ResizeColumns();
+	void Publish(size_t maxRows);
+	void SetOrder(std::vector<int> newOrder);
+	void CacheEntries(const int *indices, size_t count) const;
+	void CompactStrings();
+	QString FileName(int module) const;
+	QString Title(int module) const;
 };
 